@@ -0,0 +1,822 @@
+/*
+ * ===========================================================================
+ * uWSGI Prometheus Standalone Exporter
+ * ===========================================================================
+ *
+ * Serves the metrics uWSGI persists with --metrics-dir from a separate
+ * process:
+ *
+ *    uwsgi_prometheus_exporter --metrics-dir /run/uwsgi/metrics --server :9091
+ *
+ * Every file of the directory holds the current value of one metric, as
+ * text, in a page the instance keeps mapped. The exporter maps them
+ * read-only, so a scrape takes no lock and never involves the master or the
+ * workers. Name conversion, label rules, constant labels and headers come
+ * from plugin.c, built here with PROMETHEUS_STANDALONE.
+ *
+ * EMPEROR MODE serves all the vassals of a node as a single target:
+ *
+ *    uwsgi_prometheus_exporter --emperor-dir /run/uwsgi/metrics --server :9091
+ *
+ * Every subdirectory is the metrics-dir of one vassal (metrics-dir =
+ * /run/uwsgi/metrics/%n) and its series get a vassal="<directory>" label.
+ * Each vassal renders its series into a snapshot, cut in one segment per
+ * family, which is reused for --refresh milliseconds (shared by scrapes that
+ * arrive together, never held across a scrape interval). Stale snapshots are
+ * rendered in parallel by --threads threads, and the exposition is then
+ * assembled family by family by copying the segments of every vassal.
+ *
+ * The directories are watched with inotify: vassals and metrics created
+ * after startup are added incrementally, removed ones are unmapped.
+ *
+ * ===========================================================================
+ */
+
+#define PROMETHEUS_STANDALONE
+#include "plugin.c"
+
+#include <getopt.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+// a value is at most 20 digits, a sign and a newline
+#define EXPORTER_VALUE_MAX 32
+#define EXPORTER_LISTEN_QUEUE 100
+#define EXPORTER_THREADS_MAX 64
+#define EXPORTER_REFRESH 1000           // ms, well below any scrape interval
+#define EXPORTER_WATCH_METRICS (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+#define EXPORTER_WATCH_VASSALS (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+
+struct exporter_metric {
+	char *file;            // file name, i.e. the uWSGI metric name
+	size_t file_len;
+	char *map;             // NULL until the file has been written
+	size_t map_len;
+	uint32_t family;
+	char *line;            // 'name{labels} '
+	size_t line_len;
+};
+
+struct exporter_family {
+	char *name;
+	size_t name_len;
+	char *header;
+	size_t header_len;
+};
+
+struct exporter_segment {
+	size_t off;
+	size_t len;
+};
+
+struct exporter_vassal {
+	char *name;            // NULL with --metrics-dir (no vassal label)
+	char *dir;
+	int dir_fd;
+	int wd;
+	struct exporter_metric *metrics;  // ordered by family
+	uint32_t metrics_cnt;
+	uint32_t metrics_size;
+	struct uwsgi_buffer *snapshot;
+	struct exporter_segment *segments;  // by family, up to segments_cnt
+	uint32_t segments_cnt;
+	uint32_t segments_size;
+	uint64_t refreshed;    // milliseconds, 0 when the metrics changed
+};
+
+static struct {
+	char *dir;
+	int emperor;
+	int dir_fd;
+	int wd;
+	int inotify_fd;
+	int server_fd;
+	int threads;
+	int refresh;           // milliseconds
+	size_t page_size;
+	struct exporter_vassal **vassals;
+	uint32_t vassals_cnt;
+	uint32_t vassals_size;
+	struct exporter_family *families;
+	uint32_t families_cnt;
+	uint32_t families_size;
+	struct exporter_vassal **stale;
+	uint32_t stale_cnt;
+	struct uwsgi_buffer *name_buf;
+	struct uwsgi_buffer *labels_buf;
+	struct uwsgi_buffer *head;
+	struct uwsgi_buffer *body;
+} exporter;
+
+static void *exporter_grow(void *items, uint32_t *size, size_t item_size) {
+	*size = *size ? *size * 2 : 16;
+	items = realloc(items, item_size * *size);
+	if (!items) {
+		uwsgi_error("[prometheus] realloc()");
+		uwsgi_exit(1);
+	}
+	return items;
+}
+
+static uint64_t exporter_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * ===========================================================================
+ * METRIC FILES
+ * ===========================================================================
+ */
+
+static void exporter_unmap(struct exporter_metric *em) {
+	if (!em->map) return;
+	munmap(em->map, em->map_len);
+	em->map = NULL;
+}
+
+/*
+ * uWSGI creates the file, extends it to a page and only then maps it: a file
+ * seen by inotify right after its creation can still be empty, its mapping
+ * is retried at the next refresh.
+ */
+static int exporter_map(struct exporter_vassal *ev, struct exporter_metric *em) {
+	int fd = openat(ev->dir_fd, em->file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	size_t len = (size_t) st.st_size < exporter.page_size ? (size_t) st.st_size : exporter.page_size;
+	char *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		uwsgi_error("[prometheus] mmap()");
+		return -1;
+	}
+
+	exporter_unmap(em);
+	em->map = map;
+	em->map_len = len;
+	return 0;
+}
+
+/*
+ * The instance rewrites the value in place with snprintf(): copy it until two
+ * reads agree, so a scrape never sees the digits of two different values.
+ */
+static int64_t exporter_value(struct exporter_metric *em) {
+	char value[EXPORTER_VALUE_MAX], check[EXPORTER_VALUE_MAX];
+	size_t len = em->map_len < EXPORTER_VALUE_MAX - 1 ? em->map_len : EXPORTER_VALUE_MAX - 1;
+	int tries;
+
+	memcpy(value, em->map, len);
+	for (tries = 0; tries < 3; tries++) {
+		__sync_synchronize();
+		memcpy(check, em->map, len);
+		if (!memcmp(value, check, len)) break;
+		memcpy(value, check, len);
+	}
+	value[len] = 0;
+	return strtoll(value, NULL, 10);
+}
+
+static struct exporter_metric *exporter_find(struct exporter_vassal *ev, const char *file, size_t file_len) {
+	uint32_t i;
+	for (i = 0; i < ev->metrics_cnt; i++) {
+		struct exporter_metric *em = &ev->metrics[i];
+		if (em->file_len == file_len && !memcmp(em->file, file, file_len)) return em;
+	}
+	return NULL;
+}
+
+// families are shared by all the vassals, so that each is rendered once
+static uint32_t exporter_family(const char *name, size_t name_len, const char *file, size_t file_len) {
+	uint32_t i;
+	for (i = 0; i < exporter.families_cnt; i++) {
+		struct exporter_family *ef = &exporter.families[i];
+		if (ef->name_len == name_len && !memcmp(ef->name, name, name_len)) return i;
+	}
+
+	if (exporter.families_cnt == exporter.families_size) {
+		exporter.families = exporter_grow(exporter.families, &exporter.families_size, sizeof(struct exporter_family));
+	}
+	struct exporter_family *ef = &exporter.families[exporter.families_cnt];
+	ef->name = uwsgi_strncopy((char *) name, name_len);
+	ef->name_len = name_len;
+	// the files carry no type: the family is untyped, HELP is the uWSGI name
+	ef->header = prometheus_render_header(name, name_len, file, file_len, "untyped", &ef->header_len);
+	return exporter.families_cnt++;
+}
+
+static int exporter_labels(struct exporter_vassal *ev, struct uwsgi_buffer *labels_buf) {
+	if (ev->name) {
+		if (labels_buf->pos > 0) {
+			if (uwsgi_buffer_append(labels_buf, (char *) ",", 1)) return -1;
+		}
+		if (uwsgi_buffer_append(labels_buf, (char *) "vassal=\"", 8)) return -1;
+		if (prometheus_escape_string(labels_buf, ev->name, strlen(ev->name))) return -1;
+		if (uwsgi_buffer_append(labels_buf, (char *) "\"", 1)) return -1;
+	}
+	return prometheus_const_labels_splice(labels_buf);
+}
+
+static void exporter_add(struct exporter_vassal *ev, const char *file) {
+	size_t file_len = strlen(file);
+	if (file_len == 0 || file[0] == '.') return;
+
+	ev->refreshed = 0;
+	struct exporter_metric *em = exporter_find(ev, file, file_len);
+	if (em) {
+		// recreated (e.g. by a new instance): map the new file
+		exporter_map(ev, em);
+		return;
+	}
+
+	if (ump_config.no_workers && !uwsgi_starts_with((char *) file, file_len, (char *) "worker.", 7)) return;
+
+	struct uwsgi_buffer *name_buf = exporter.name_buf;
+	struct uwsgi_buffer *labels_buf = exporter.labels_buf;
+	int ruled = prometheus_rules_apply(name_buf, labels_buf, file, file_len);
+	if (ruled < 0 || (!ruled && prometheus_format_metric_name(name_buf, labels_buf, file, file_len, prometheus_prefix()) < 0) ||
+	    exporter_labels(ev, labels_buf)) {
+		uwsgi_log("[prometheus] Failed to format metric: %s\n", file);
+		return;
+	}
+	if (name_buf->pos == 0) return;
+
+	uint32_t family = exporter_family(name_buf->buf, name_buf->pos, file, file_len);
+
+	// keep the metrics of a family together: a refresh then cuts one segment per family
+	if (ev->metrics_cnt == ev->metrics_size) {
+		ev->metrics = exporter_grow(ev->metrics, &ev->metrics_size, sizeof(struct exporter_metric));
+	}
+	uint32_t pos = ev->metrics_cnt;
+	while (pos > 0 && ev->metrics[pos - 1].family > family) pos--;
+	memmove(&ev->metrics[pos + 1], &ev->metrics[pos], sizeof(struct exporter_metric) * (ev->metrics_cnt - pos));
+	ev->metrics_cnt++;
+
+	em = &ev->metrics[pos];
+	memset(em, 0, sizeof(struct exporter_metric));
+	em->file = uwsgi_strncopy((char *) file, file_len);
+	em->file_len = file_len;
+	em->family = family;
+	em->line = prometheus_render_line(name_buf->buf, name_buf->pos, labels_buf->buf, labels_buf->pos, &em->line_len);
+	exporter_map(ev, em);
+}
+
+static void exporter_remove(struct exporter_vassal *ev, const char *file) {
+	struct exporter_metric *em = exporter_find(ev, file, strlen(file));
+	if (!em) return;
+	exporter_unmap(em);
+	free(em->file);
+	free(em->line);
+	uint32_t pos = em - ev->metrics;
+	memmove(em, em + 1, sizeof(struct exporter_metric) * (ev->metrics_cnt - pos - 1));
+	ev->metrics_cnt--;
+	ev->refreshed = 0;
+}
+
+/*
+ * Full scan, when a directory is added and when the inotify queue
+ * overflowed: files that disappeared in the meantime are dropped as well.
+ */
+static void exporter_scan(struct exporter_vassal *ev) {
+	uint32_t i = 0;
+	while (i < ev->metrics_cnt) {
+		struct exporter_metric *em = &ev->metrics[i];
+		if (faccessat(ev->dir_fd, em->file, F_OK, 0)) {
+			exporter_remove(ev, em->file);
+			continue;
+		}
+		i++;
+	}
+
+	int fd = dup(ev->dir_fd);
+	DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		uwsgi_error("[prometheus] opendir()");
+		if (fd >= 0) close(fd);
+		return;
+	}
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+		exporter_add(ev, de->d_name);
+	}
+	closedir(dir);
+}
+
+/*
+ * ===========================================================================
+ * VASSALS
+ * ===========================================================================
+ */
+
+static struct exporter_vassal *exporter_vassal_find(const char *name, int wd) {
+	uint32_t i;
+	for (i = 0; i < exporter.vassals_cnt; i++) {
+		struct exporter_vassal *ev = exporter.vassals[i];
+		if (name ? (ev->name && !strcmp(ev->name, name)) : ev->wd == wd) return ev;
+	}
+	return NULL;
+}
+
+// watch before the first scan, so no file created in between is missed
+static struct exporter_vassal *exporter_vassal_add(char *name, char *dir, int dir_fd) {
+	struct exporter_vassal *ev = uwsgi_calloc(sizeof(struct exporter_vassal));
+	ev->name = name;
+	ev->dir = dir;
+	ev->dir_fd = dir_fd;
+	ev->snapshot = uwsgi_buffer_new(4096);
+	ev->wd = inotify_add_watch(exporter.inotify_fd, dir, EXPORTER_WATCH_METRICS);
+	if (ev->wd < 0) {
+		uwsgi_error("[prometheus] inotify_add_watch()");
+	}
+
+	if (exporter.vassals_cnt == exporter.vassals_size) {
+		exporter.vassals = exporter_grow(exporter.vassals, &exporter.vassals_size, sizeof(struct exporter_vassal *));
+		exporter.stale = realloc(exporter.stale, sizeof(struct exporter_vassal *) * exporter.vassals_size);
+		if (!exporter.stale) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+	}
+	exporter.vassals[exporter.vassals_cnt++] = ev;
+	exporter_scan(ev);
+	return ev;
+}
+
+static void exporter_vassal_remove(struct exporter_vassal *ev) {
+	uint32_t i;
+	for (i = 0; i < exporter.vassals_cnt; i++) {
+		if (exporter.vassals[i] == ev) break;
+	}
+	exporter.vassals[i] = exporter.vassals[--exporter.vassals_cnt];
+
+	// the watch is already gone if the directory was deleted
+	if (ev->wd >= 0) inotify_rm_watch(exporter.inotify_fd, ev->wd);
+	for (i = 0; i < ev->metrics_cnt; i++) {
+		exporter_unmap(&ev->metrics[i]);
+		free(ev->metrics[i].file);
+		free(ev->metrics[i].line);
+	}
+	close(ev->dir_fd);
+	uwsgi_buffer_destroy(ev->snapshot);
+	free(ev->metrics);
+	free(ev->segments);
+	free(ev->name);
+	free(ev->dir);
+	free(ev);
+}
+
+static void exporter_emperor_add(const char *name) {
+	if (name[0] == '.' || exporter_vassal_find(name, -1)) return;
+	int dir_fd = openat(exporter.dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) return;
+
+	size_t dir_len = strlen(exporter.dir) + strlen(name) + 2;
+	char *dir = uwsgi_malloc(dir_len);
+	snprintf(dir, dir_len, "%s/%s", exporter.dir, name);
+	struct exporter_vassal *ev = exporter_vassal_add(uwsgi_strncopy((char *) name, strlen(name)), dir, dir_fd);
+	uwsgi_log("[prometheus] vassal %s: %u metrics\n", ev->name, ev->metrics_cnt);
+}
+
+static void exporter_emperor_remove(const char *name) {
+	struct exporter_vassal *ev = exporter_vassal_find(name, -1);
+	if (!ev) return;
+	uwsgi_log("[prometheus] vassal %s removed\n", name);
+	exporter_vassal_remove(ev);
+}
+
+static void exporter_emperor_scan(void) {
+	uint32_t i = 0;
+	while (i < exporter.vassals_cnt) {
+		struct exporter_vassal *ev = exporter.vassals[i];
+		if (faccessat(exporter.dir_fd, ev->name, F_OK, 0)) {
+			exporter_emperor_remove(ev->name);
+			continue;
+		}
+		exporter_scan(ev);
+		i++;
+	}
+
+	int fd = dup(exporter.dir_fd);
+	DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		uwsgi_error("[prometheus] opendir()");
+		if (fd >= 0) close(fd);
+		return;
+	}
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		// vassal directories can also be symlinks to the real metrics-dir
+		if (de->d_type != DT_DIR && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN) continue;
+		exporter_emperor_add(de->d_name);
+	}
+	closedir(dir);
+}
+
+static void exporter_watch(void) {
+	char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+	for (;;) {
+		ssize_t len = read(exporter.inotify_fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len < 0 && errno != EAGAIN && errno != EINTR) uwsgi_error("[prometheus] read()");
+			return;
+		}
+		char *ptr = buf;
+		while (ptr < buf + len) {
+			struct inotify_event *ev = (struct inotify_event *) ptr;
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				if (exporter.emperor) {
+					exporter_emperor_scan();
+				} else {
+					exporter_scan(exporter.vassals[0]);
+				}
+				continue;
+			}
+
+			if (exporter.emperor && ev->wd == exporter.wd) {
+				if (ev->len == 0) continue;
+				if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+					exporter_emperor_add(ev->name);
+				} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					exporter_emperor_remove(ev->name);
+				}
+				continue;
+			}
+
+			struct exporter_vassal *vassal = exporter_vassal_find(NULL, ev->wd);
+			if (!vassal) continue;
+			if (ev->mask & IN_IGNORED) {
+				vassal->wd = -1;
+			} else if (ev->len == 0 || (ev->mask & IN_ISDIR)) {
+				continue;
+			} else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				exporter_add(vassal, ev->name);
+			} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				exporter_remove(vassal, ev->name);
+			}
+		}
+	}
+}
+
+/*
+ * ===========================================================================
+ * SNAPSHOTS
+ * ===========================================================================
+ */
+
+/*
+ * Render the series of a vassal into its snapshot, one contiguous segment
+ * per family. Runs in the refresh threads: it only touches the vassal.
+ */
+static void exporter_vassal_refresh(struct exporter_vassal *ev, uint32_t families_cnt, uint64_t now) {
+	struct uwsgi_buffer *ub = ev->snapshot;
+	uint32_t i;
+
+	if (families_cnt > ev->segments_size) {
+		ev->segments_size = families_cnt;
+		ev->segments = realloc(ev->segments, sizeof(struct exporter_segment) * families_cnt);
+		if (!ev->segments) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+	}
+	memset(ev->segments, 0, sizeof(struct exporter_segment) * families_cnt);
+	ev->segments_cnt = families_cnt;
+	ub->pos = 0;
+
+	for (i = 0; i < ev->metrics_cnt; i++) {
+		struct exporter_metric *em = &ev->metrics[i];
+		if (!em->map && exporter_map(ev, em)) continue;
+		struct exporter_segment *seg = &ev->segments[em->family];
+		if (seg->len == 0) seg->off = ub->pos;
+		if (uwsgi_buffer_append(ub, em->line, em->line_len) ||
+		    uwsgi_buffer_num64(ub, exporter_value(em)) ||
+		    uwsgi_buffer_append(ub, (char *) "\n", 1)) {
+			// an empty snapshot, rendered again at the next scrape
+			ev->segments_cnt = 0;
+			ev->refreshed = 0;
+			return;
+		}
+		seg->len = ub->pos - seg->off;
+	}
+	ev->refreshed = now;
+}
+
+struct exporter_slice {
+	uint32_t first;
+	uint32_t step;
+	uint64_t now;
+};
+
+static void *exporter_refresh_slice(void *arg) {
+	struct exporter_slice *slice = (struct exporter_slice *) arg;
+	uint32_t i;
+	for (i = slice->first; i < exporter.stale_cnt; i += slice->step) {
+		exporter_vassal_refresh(exporter.stale[i], exporter.families_cnt, slice->now);
+	}
+	return NULL;
+}
+
+static void exporter_refresh(void) {
+	uint64_t now = exporter_now();
+	// a single metrics-dir is always read live: snapshots only pay off across vassals
+	uint64_t refresh = exporter.emperor ? (uint64_t) exporter.refresh : 0;
+	uint32_t threads = exporter.threads, i, t;
+	pthread_t tids[EXPORTER_THREADS_MAX];
+	struct exporter_slice slices[EXPORTER_THREADS_MAX];
+
+	exporter.stale_cnt = 0;
+	for (i = 0; i < exporter.vassals_cnt; i++) {
+		struct exporter_vassal *ev = exporter.vassals[i];
+		if (ev->refreshed && now - ev->refreshed < refresh) continue;
+		exporter.stale[exporter.stale_cnt++] = ev;
+	}
+
+	// below a few vassals per thread, spawning costs more than it saves
+	if (threads > exporter.stale_cnt / 4) threads = (exporter.stale_cnt / 4) > 0 ? exporter.stale_cnt / 4 : 1;
+	for (t = 0; t < threads; t++) {
+		slices[t].first = t;
+		slices[t].step = threads;
+		slices[t].now = now;
+		if (t > 0 && pthread_create(&tids[t], NULL, exporter_refresh_slice, &slices[t])) {
+			// fall back to the calling thread for this slice
+			slices[t].step = 0;
+		}
+	}
+	exporter_refresh_slice(&slices[0]);
+	for (t = 1; t < threads; t++) {
+		if (slices[t].step) {
+			pthread_join(tids[t], NULL);
+		} else {
+			slices[t].step = threads;
+			exporter_refresh_slice(&slices[t]);
+		}
+	}
+}
+
+/*
+ * ===========================================================================
+ * SERVER
+ * ===========================================================================
+ */
+
+static struct uwsgi_buffer *exporter_generate(void) {
+	struct uwsgi_buffer *ub = exporter.body;
+	uint32_t i, j;
+
+	exporter_refresh();
+	ub->pos = 0;
+	for (i = 0; i < exporter.families_cnt; i++) {
+		struct exporter_family *ef = &exporter.families[i];
+		int header = 0;
+		for (j = 0; j < exporter.vassals_cnt; j++) {
+			struct exporter_vassal *ev = exporter.vassals[j];
+			if (i >= ev->segments_cnt || ev->segments[i].len == 0) continue;
+			if (!header) {
+				if (uwsgi_buffer_append(ub, ef->header, ef->header_len)) return NULL;
+				header = 1;
+			}
+			if (uwsgi_buffer_append(ub, ev->snapshot->buf + ev->segments[i].off, ev->segments[i].len)) return NULL;
+		}
+	}
+	return ub;
+}
+
+static void exporter_handle_request(void) {
+	struct prometheus_http_request req;
+	int client_fd = prometheus_http_accept(exporter.server_fd, &req);
+	if (client_fd < 0) return;
+
+	struct uwsgi_buffer *metrics = exporter_generate();
+	if (!metrics) {
+		prometheus_http_error(client_fd);
+	} else {
+		prometheus_http_respond(client_fd, exporter.head, PROMETHEUS_TEXT_CONTENT_TYPE, metrics);
+	}
+	close(client_fd);
+}
+
+// same address formats as --prometheus-server: [host]:port or a unix socket path
+static int exporter_bind(char *address) {
+	int fd;
+	char *port = strrchr(address, ':');
+
+	if (port) {
+		struct addrinfo hints, *res;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		char *host = prometheus_address_host(address, port);
+		int ret = getaddrinfo(host, port + 1, &hints, &res);
+		free(host);
+		if (ret) {
+			uwsgi_log("[prometheus] ERROR: unable to resolve %s: %s\n", address, gai_strerror(ret));
+			return -1;
+		}
+		fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int reuse = 1;
+		if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen)) {
+			uwsgi_error("[prometheus] bind()");
+			freeaddrinfo(res);
+			if (fd >= 0) close(fd);
+			return -1;
+		}
+		freeaddrinfo(res);
+	} else {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(address) >= sizeof(sun.sun_path)) {
+			uwsgi_log("[prometheus] ERROR: unix socket path too long: %s\n", address);
+			return -1;
+		}
+		strcpy(sun.sun_path, address);
+		unlink(address);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *) &sun, sizeof(sun))) {
+			uwsgi_error("[prometheus] bind()");
+			if (fd >= 0) close(fd);
+			return -1;
+		}
+	}
+
+	if (listen(fd, EXPORTER_LISTEN_QUEUE)) {
+		uwsgi_error("[prometheus] listen()");
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	return fd;
+}
+
+/*
+ * ===========================================================================
+ * MAIN
+ * ===========================================================================
+ */
+
+static void exporter_usage(const char *argv0) {
+	uwsgi_log("usage: %s (--metrics-dir DIR | --emperor-dir DIR) --server ADDRESS [options]\n"
+	          "  --metrics-dir DIR      directory of the instance's --metrics-dir\n"
+	          "  --emperor-dir DIR      directory holding the metrics-dir of every vassal\n"
+	          "  --server ADDRESS       serve metrics on [host]:port or a unix socket path\n"
+	          "  --threads N            threads rendering the vassals (default: 1)\n"
+	          "  --refresh MS           emperor mode: reuse the rendered series of a vassal for MS milliseconds (default: 1000)\n"
+	          "  --prefix PREFIX        set metrics prefix (default: uwsgi_)\n"
+	          "  --no-workers           skip per-worker metrics\n"
+	          "  --no-help              disable HELP comments\n"
+	          "  --no-type              disable TYPE comments\n"
+	          "  --label-rule RULE      map uWSGI metric names to Prometheus names and labels (can be repeated)\n"
+	          "  --label KEY=VALUE      add a constant label to every series (can be repeated)\n",
+	          argv0);
+}
+
+int main(int argc, char **argv) {
+	static struct option options[] = {
+		{"metrics-dir", required_argument, 0, 'd'},
+		{"emperor-dir", required_argument, 0, 'e'},
+		{"server", required_argument, 0, 's'},
+		{"threads", required_argument, 0, 't'},
+		{"refresh", required_argument, 0, 'R'},
+		{"prefix", required_argument, 0, 'p'},
+		{"no-workers", no_argument, 0, 'W'},
+		{"no-help", no_argument, 0, 'H'},
+		{"no-type", no_argument, 0, 'T'},
+		{"label-rule", required_argument, 0, 'r'},
+		{"label", required_argument, 0, 'l'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0},
+	};
+	struct uwsgi_string_list *usl;
+	int opt;
+
+	ump_config.include_help = 1;
+	ump_config.include_type = 1;
+	exporter.threads = 1;
+	exporter.refresh = EXPORTER_REFRESH;
+
+	while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+		switch (opt) {
+			case 'd': exporter.dir = optarg; exporter.emperor = 0; break;
+			case 'e': exporter.dir = optarg; exporter.emperor = 1; break;
+			case 's': ump_config.server_address = optarg; break;
+			case 't': exporter.threads = atoi(optarg); break;
+			case 'R': exporter.refresh = atoi(optarg); break;
+			case 'p': ump_config.prefix = optarg; break;
+			case 'W': ump_config.no_workers = 1; break;
+			case 'H': ump_config.include_help = 0; break;
+			case 'T': ump_config.include_type = 0; break;
+			case 'r': uwsgi_string_new_list(&ump_config.label_rules, optarg); break;
+			case 'l': uwsgi_string_new_list(&ump_config.const_labels, optarg); break;
+			case 'h': exporter_usage(argv[0]); return 0;
+			default: exporter_usage(argv[0]); return 1;
+		}
+	}
+	if (!exporter.dir || !ump_config.server_address || optind < argc) {
+		exporter_usage(argv[0]);
+		return 1;
+	}
+	if (exporter.threads <= 0 || exporter.threads > EXPORTER_THREADS_MAX) {
+		uwsgi_log("[prometheus] ERROR: --threads must be between 1 and %d\n", EXPORTER_THREADS_MAX);
+		return 1;
+	}
+	if (exporter.refresh < 0) {
+		uwsgi_log("[prometheus] ERROR: --refresh must not be negative\n");
+		return 1;
+	}
+
+	uwsgi_foreach(usl, ump_config.label_rules) {
+		prometheus_rule_compile(usl->value);
+	}
+	// emperor mode sets vassal itself: a constant or captured one would duplicate the label
+	if (exporter.emperor) {
+		if (prometheus_rules_capture("vassal", 6)) {
+			uwsgi_log("[prometheus] ERROR: --label-rule cannot capture {vassal} in emperor mode\n");
+			return 1;
+		}
+		uwsgi_foreach(usl, ump_config.const_labels) {
+			if (!uwsgi_starts_with(usl->value, usl->len, (char *) "vassal=", 7)) {
+				uwsgi_log("[prometheus] ERROR: --label vassal is reserved in emperor mode\n");
+				return 1;
+			}
+		}
+	}
+	prometheus_const_labels_compile();
+
+	signal(SIGPIPE, SIG_IGN);
+	exporter.page_size = sysconf(_SC_PAGESIZE);
+	exporter.name_buf = uwsgi_buffer_new(256);
+	exporter.labels_buf = uwsgi_buffer_new(256);
+	exporter.head = uwsgi_buffer_new(256);
+	exporter.body = uwsgi_buffer_new(65536);
+
+	exporter.dir_fd = open(exporter.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (exporter.dir_fd < 0) {
+		uwsgi_error("[prometheus] open()");
+		uwsgi_log("[prometheus] ERROR: unable to open metrics directory %s\n", exporter.dir);
+		return 1;
+	}
+
+	exporter.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (exporter.inotify_fd < 0) {
+		uwsgi_error("[prometheus] inotify_init1()");
+		return 1;
+	}
+
+	if (exporter.emperor) {
+		exporter.wd = inotify_add_watch(exporter.inotify_fd, exporter.dir, EXPORTER_WATCH_VASSALS);
+		if (exporter.wd < 0) {
+			uwsgi_error("[prometheus] inotify_add_watch()");
+			return 1;
+		}
+		exporter_emperor_scan();
+	} else {
+		struct exporter_vassal *ev = exporter_vassal_add(NULL, exporter.dir, dup(exporter.dir_fd));
+		if (ev->wd < 0) return 1;
+	}
+
+	exporter.server_fd = exporter_bind(ump_config.server_address);
+	if (exporter.server_fd < 0) {
+		uwsgi_log("[prometheus] ERROR: Failed to bind to %s\n", ump_config.server_address);
+		return 1;
+	}
+
+	if (exporter.emperor) {
+		uwsgi_log("[prometheus] exporting %u vassals of %s on %s\n", exporter.vassals_cnt, exporter.dir, ump_config.server_address);
+	} else {
+		uwsgi_log("[prometheus] exporting %u metrics of %s on %s\n", exporter.vassals[0]->metrics_cnt, exporter.dir,
+		          ump_config.server_address);
+	}
+
+	struct pollfd fds[2];
+	fds[0].fd = exporter.inotify_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = exporter.server_fd;
+	fds[1].events = POLLIN;
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			uwsgi_error("[prometheus] poll()");
+			return 1;
+		}
+		// apply the directory changes first, a scrape always sees the latest set
+		if (fds[0].revents) exporter_watch();
+		if (fds[1].revents) exporter_handle_request();
+	}
+}
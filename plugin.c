@@ -18,11 +18,25 @@
  * ===========================================================================
  */
 
+#ifdef PROMETHEUS_STANDALONE
+#include "standalone.h"
+#else
 #include <uwsgi.h>
+#endif
+#include <math.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+#include <sys/syscall.h>
+#endif
 
-#ifdef UWSGI_ROUTING
+#if defined(UWSGI_ROUTING) || defined(PROMETHEUS_STANDALONE)
 
+#ifndef PROMETHEUS_STANDALONE
 extern struct uwsgi_server uwsgi;
+#endif
 
 /*
  * ===========================================================================
@@ -37,16 +51,82 @@ struct uwsgi_metrics_prometheus_config {
 	int include_type;
 	char *server_address;     // NEW: Dedicated server address (e.g., ":9091")
 	int server_fd;            // NEW: Server socket file descriptor
+	uint64_t *buffer_reallocs; // Output buffer growth events (shared memory, all processes)
+	struct uwsgi_string_list *aggregate_modes;
+	int aggregate;            // Bitmask of PROMETHEUS_AGG_* modes
+	struct uwsgi_string_list *include;  // Regexps, compiled in custom_ptr
+	struct uwsgi_string_list *exclude;
+	struct uwsgi_string_list *label_rules;
+	struct uwsgi_string_list *const_labels;
+	char *const_labels_block;  // Pre-rendered 'key="value",...' (NULL if none)
+	size_t const_labels_block_len;
+	int request_metrics;      // Record per-request metrics from an after-request hook
+	char *histogram_buckets;  // Request duration buckets, in seconds
+	int native_histograms;    // Sparse exponential buckets, served over protobuf
+	int native_schema;
+	char *status_codes;       // Exact codes for requests_total (others use their class)
+	struct uwsgi_string_list *route_groups;  // name=regex, compiled in post_init
+	char *quantiles;          // Sliding-window request duration quantiles
+	char *quantile_accuracy;
+	int quantile_window;      // seconds
+	char *const_labels_pb;     // Constant labels as encoded LabelPair fields
+	size_t const_labels_pb_len;
+	int topk;                 // Heavy hitters reported per tracker (0: disabled)
+	int topk_window;          // seconds
+	int cardinality;          // Distinct clients and paths (HyperLogLog)
+	int cardinality_window;   // seconds
+	int scoreboard;           // Per-worker families read from uwsgi.workers[]
+	int listen_queue;         // Accept queue depth and backlog from the kernel
+	int proc;                 // Per-worker /proc stats
+	int proc_refresh;         // milliseconds
+	int proc_threads;
+	int cgroup;               // cgroup v2 resources and pressure (PSI)
+	char *state;              // File backing the registry, kept across reloads
+	int cgroup_refresh;       // milliseconds
+	struct uwsgi_string_list *samples;  // Sources read by the background sampler
+	int sample_rate;          // Hz
+	int sample_window;        // seconds
 } ump_config;
 
+#ifndef PROMETHEUS_STANDALONE
 static struct uwsgi_option metrics_prometheus_options[] = {
 	{"prometheus-prefix", required_argument, 0, "set metrics prefix (default: uwsgi_)", uwsgi_opt_set_str, &ump_config.prefix, 0},
 	{"prometheus-no-workers", no_argument, 0, "skip per-worker metrics", uwsgi_opt_true, &ump_config.no_workers, 0},
 	{"prometheus-no-help", no_argument, 0, "disable HELP comments", uwsgi_opt_false, &ump_config.include_help, 0},
 	{"prometheus-no-type", no_argument, 0, "disable TYPE comments", uwsgi_opt_false, &ump_config.include_type, 0},
 	{"prometheus-server", required_argument, 0, "enable dedicated metrics server on address (e.g., :9091 or /tmp/metrics.sock)", uwsgi_opt_set_str, &ump_config.server_address, 0},
+	{"prometheus-include", required_argument, 0, "only export uWSGI metrics whose name matches the regexp (can be repeated)", uwsgi_opt_add_string_list, &ump_config.include, 0},
+	{"prometheus-exclude", required_argument, 0, "do not export uWSGI metrics whose name matches the regexp (can be repeated)", uwsgi_opt_add_string_list, &ump_config.exclude, 0},
+	{"prometheus-label-rule", required_argument, 0, "map uWSGI metric names to Prometheus names and labels (e.g. 'socket.{socket}.listen_queue -> uwsgi_socket_listen_queue', can be repeated)", uwsgi_opt_add_string_list, &ump_config.label_rules, 0},
+	{"prometheus-label", required_argument, 0, "add a constant key=value label to every series (can be repeated)", uwsgi_opt_add_string_list, &ump_config.const_labels, 0},
+	{"prometheus-request-metrics", no_argument, 0, "record per-request metrics in shared memory shards", uwsgi_opt_true, &ump_config.request_metrics, 0},
+	{"prometheus-histogram-buckets", required_argument, 0, "comma separated request duration histogram buckets in seconds (default: 0.005 to 10)", uwsgi_opt_set_str, &ump_config.histogram_buckets, 0},
+	{"prometheus-native-histograms", no_argument, 0, "also record request histograms with sparse exponential buckets, exported with the protobuf format (implies --prometheus-request-metrics)", uwsgi_opt_true, &ump_config.native_histograms, 0},
+	{"prometheus-native-schema", required_argument, 0, "native histogram resolution, 2^schema buckets per power of two (0-8, default: 3)", uwsgi_opt_set_int, &ump_config.native_schema, 0},
+	{"prometheus-status-codes", required_argument, 0, "comma separated status codes counted individually in requests_total (others are counted by class, e.g. 4xx)", uwsgi_opt_set_str, &ump_config.status_codes, 0},
+	{"prometheus-route-group", required_argument, 0, "record per-route request metrics for PATH_INFO matching a regexp, as name=regexp (first match wins, can be repeated, implies --prometheus-request-metrics)", uwsgi_opt_add_string_list, &ump_config.route_groups, 0},
+	{"prometheus-quantiles", required_argument, 0, "export comma separated request duration quantiles over a sliding window (e.g. 0.5,0.99,0.999, implies --prometheus-request-metrics)", uwsgi_opt_set_str, &ump_config.quantiles, 0},
+	{"prometheus-quantile-window", required_argument, 0, "sliding window of --prometheus-quantiles in seconds (default: 60)", uwsgi_opt_set_int, &ump_config.quantile_window, 0},
+	{"prometheus-quantile-accuracy", required_argument, 0, "relative accuracy of --prometheus-quantiles (default: 0.02, about 41KB of shared memory per shard, (numproc + 1) * cores shards, doubled when halved)", uwsgi_opt_set_str, &ump_config.quantile_accuracy, 0},
+	{"prometheus-topk", required_argument, 0, "track the N most frequent request paths and clients in fixed memory (implies --prometheus-request-metrics)", uwsgi_opt_set_int, &ump_config.topk, 0},
+	{"prometheus-topk-window", required_argument, 0, "window of --prometheus-topk in seconds (default: 60)", uwsgi_opt_set_int, &ump_config.topk_window, 0},
+	{"prometheus-cardinality", no_argument, 0, "estimate distinct clients and request paths with HyperLogLog (implies --prometheus-request-metrics)", uwsgi_opt_true, &ump_config.cardinality, 0},
+	{"prometheus-cardinality-window", required_argument, 0, "window of --prometheus-cardinality in seconds (default: 60)", uwsgi_opt_set_int, &ump_config.cardinality_window, 0},
+	{"prometheus-scoreboard", no_argument, 0, "export per-worker families read directly from the worker scoreboard (does not need --enable-metrics)", uwsgi_opt_true, &ump_config.scoreboard, 0},
+	{"prometheus-proc", no_argument, 0, "export CPU, memory, open fds and context switches of every worker from /proc", uwsgi_opt_true, &ump_config.proc, 0},
+	{"prometheus-proc-refresh", required_argument, 0, "minimum interval between two reads of /proc in milliseconds (default: 1000)", uwsgi_opt_set_int, &ump_config.proc_refresh, 0},
+	{"prometheus-proc-threads", required_argument, 0, "threads reading /proc for large worker counts (default: 1)", uwsgi_opt_set_int, &ump_config.proc_threads, 0},
+	{"prometheus-cgroup", no_argument, 0, "export CPU throttling, memory and pressure stall information (PSI) of the instance's cgroup v2", uwsgi_opt_true, &ump_config.cgroup, 0},
+	{"prometheus-cgroup-refresh", required_argument, 0, "minimum interval between two reads of the cgroup files in milliseconds (default: 1000)", uwsgi_opt_set_int, &ump_config.cgroup_refresh, 0},
+	{"prometheus-listen-queue", no_argument, 0, "export the accept queue depth and backlog of every socket, read from the kernel (TCP_INFO and sock_diag)", uwsgi_opt_true, &ump_config.listen_queue, 0},
+	{"prometheus-sample", required_argument, 0, "sample a gauge in the master at a high frequency and export its max, min and average (busy_workers, inflight_requests, listen_queue; can be repeated)", uwsgi_opt_add_string_list, &ump_config.samples, 0},
+	{"prometheus-sample-rate", required_argument, 0, "samples per second taken by --prometheus-sample (default: 100)", uwsgi_opt_set_int, &ump_config.sample_rate, 0},
+	{"prometheus-sample-window", required_argument, 0, "window of --prometheus-sample in seconds (default: 15)", uwsgi_opt_set_int, &ump_config.sample_window, 0},
+	{"prometheus-state", required_argument, 0, "keep the exporter's request counters in a file mapped in shared memory, so they survive reloads (use a tmpfs)", uwsgi_opt_set_str, &ump_config.state, 0},
+	{"prometheus-aggregate", required_argument, 0, "replace per-worker series with cross-worker aggregates (sum, max, min; can be repeated)", uwsgi_opt_add_string_list, &ump_config.aggregate_modes, 0},
 	UWSGI_END_OF_OPTIONS
 };
+#endif
 
 /*
  * ===========================================================================
@@ -54,269 +134,5129 @@ static struct uwsgi_option metrics_prometheus_options[] = {
  * ===========================================================================
  */
 
-/*
- * Simple set to track seen metric names (for HELP/TYPE deduplication)
- */
-struct seen_metric_name {
-	char *name;
-	size_t name_len;
-	struct seen_metric_name *next;
-};
+/*
+ * Bump-pointer arena for transient per-scrape allocations
+ *
+ * Chunks are kept after a reset, so once the arena has grown to the size a
+ * scrape needs, further scrapes never call malloc()/free(). The master lives
+ * for months; this keeps allocator locks and fragmentation out of it.
+ */
+#define PROMETHEUS_ARENA_CHUNK 16384
+
+struct prometheus_arena_chunk {
+	size_t size;
+	size_t used;
+	struct prometheus_arena_chunk *next;
+	char data[];
+};
+
+struct prometheus_arena {
+	struct prometheus_arena_chunk *head;
+	struct prometheus_arena_chunk *current;
+};
+
+static void *prometheus_arena_alloc(struct prometheus_arena *arena, size_t size) {
+	// keep every allocation pointer-aligned
+	size = (size + (sizeof(void *) - 1)) & ~(sizeof(void *) - 1);
+
+	struct prometheus_arena_chunk *chunk = arena->current;
+	while (chunk) {
+		if (chunk->size - chunk->used >= size) {
+			void *ptr = chunk->data + chunk->used;
+			chunk->used += size;
+			arena->current = chunk;
+			return ptr;
+		}
+		if (!chunk->next) break;
+		chunk = chunk->next;
+		chunk->used = 0;
+	}
+
+	size_t chunk_size = UMAX(size, (size_t) PROMETHEUS_ARENA_CHUNK);
+	struct prometheus_arena_chunk *new_chunk = malloc(sizeof(struct prometheus_arena_chunk) + chunk_size);
+	if (!new_chunk) {
+		uwsgi_error("[prometheus] arena malloc()");
+		return NULL;
+	}
+	new_chunk->size = chunk_size;
+	new_chunk->used = size;
+	new_chunk->next = NULL;
+
+	if (chunk) {
+		chunk->next = new_chunk;
+	} else {
+		arena->head = new_chunk;
+	}
+	arena->current = new_chunk;
+
+	if (ump_config.buffer_reallocs) {
+		__atomic_add_fetch(ump_config.buffer_reallocs, 1, __ATOMIC_RELAXED);
+	}
+	return new_chunk->data;
+}
+
+static void prometheus_arena_reset(struct prometheus_arena *arena) {
+	arena->current = arena->head;
+	if (arena->head) arena->head->used = 0;
+}
+
+static int prometheus_escape_string(struct uwsgi_buffer *ub, const char *str, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		switch (str[i]) {
+			case '\\':
+				if (uwsgi_buffer_append(ub, (char *)"\\\\", 2)) return -1;
+				break;
+			case '"':
+				if (uwsgi_buffer_append(ub, (char *)"\\\"", 2)) return -1;
+				break;
+			case '\n':
+				if (uwsgi_buffer_append(ub, (char *)"\\n", 2)) return -1;
+				break;
+			default:
+				if (uwsgi_buffer_append(ub, (char *)&str[i], 1)) return -1;
+				break;
+		}
+	}
+	return 0;
+}
+
+static inline uint64_t prometheus_hash(const char *buf, size_t len) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t) buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Default conversion: text segments form the name, numeric segments become
+ * positional labels (worker, core, thread, id, then id4, id5, ...).
+ */
+static int prometheus_format_metric_name(struct uwsgi_buffer *name_buf, struct uwsgi_buffer *labels_buf,
+                                         const char *metric_name, size_t metric_name_len, const char *prefix) {
+	size_t i, j, label_index = 0;
+	size_t segment_start = 0;
+	size_t prefix_len = strlen(prefix);
+	int in_numeric_sequence = 0;
+	static const char *label_names[4] = {"worker", "core", "thread", "id"};
+
+	name_buf->pos = 0;
+	labels_buf->pos = 0;
+
+	if (uwsgi_buffer_append(name_buf, (char *)prefix, prefix_len)) return -1;
+
+	for (i = 0; i <= metric_name_len; i++) {
+		if (i < metric_name_len && metric_name[i] != '.') continue;
+
+		const char *segment = metric_name + segment_start;
+		size_t segment_len = i - segment_start;
+		segment_start = i + 1;
+		if (segment_len == 0) continue;
+
+		int is_numeric = 1;
+		for (j = 0; j < segment_len; j++) {
+			if (segment[j] < '0' || segment[j] > '9') {
+				is_numeric = 0;
+				break;
+			}
+		}
+
+		if (is_numeric) {
+			if (labels_buf->pos > 0) {
+				if (uwsgi_buffer_append(labels_buf, (char *)",", 1)) return -1;
+			}
+			if (label_index < 4) {
+				if (uwsgi_buffer_append(labels_buf, (char *)label_names[label_index], strlen(label_names[label_index]))) return -1;
+			} else {
+				if (uwsgi_buffer_append(labels_buf, (char *)"id", 2)) return -1;
+				if (uwsgi_buffer_num64(labels_buf, label_index)) return -1;
+			}
+			if (uwsgi_buffer_append(labels_buf, (char *)"=\"", 2)) return -1;
+			if (uwsgi_buffer_append(labels_buf, (char *)segment, segment_len)) return -1;
+			if (uwsgi_buffer_append(labels_buf, (char *)"\"", 1)) return -1;
+			label_index++;
+			in_numeric_sequence = 1;
+			continue;
+		}
+
+		if (name_buf->pos > prefix_len && !in_numeric_sequence) {
+			if (uwsgi_buffer_append(name_buf, (char *)"_", 1)) return -1;
+		}
+		for (j = 0; j < segment_len; j++) {
+			char c = segment[j];
+			if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+			      (c >= '0' && c <= '9') || c == '_')) {
+				c = '_';
+			}
+			if (uwsgi_buffer_append(name_buf, &c, 1)) return -1;
+		}
+		in_numeric_sequence = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * ===========================================================================
+ * LABEL RULES
+ * ===========================================================================
+ */
+
+/*
+ * User supplied mappings that override the default conversion:
+ *
+ *   --prometheus-label-rule 'socket.{socket}.listen_queue -> uwsgi_socket_listen_queue'
+ *
+ * Patterns are dot-separated: a literal segment must match exactly, "*"
+ * matches any segment and "{label}" captures the segment as a label value.
+ * The target is the complete metric name (no prefix is added; counters
+ * still get "_total").
+ *
+ * Rules are compiled once into a decision table indexed by segment count,
+ * then only consulted while building the series cache. The first matching
+ * rule wins.
+ */
+#define PROMETHEUS_RULE_LITERAL 0
+#define PROMETHEUS_RULE_ANY     1
+#define PROMETHEUS_RULE_CAPTURE 2
+#define PROMETHEUS_RULE_MAX_SEGMENTS 32
+
+struct prometheus_rule_segment {
+	uint8_t type;
+	char *str;                  // literal text or label name
+	size_t len;
+};
+
+struct prometheus_rule {
+	char *target;
+	size_t target_len;
+	uint32_t segments_cnt;
+	struct prometheus_rule_segment *segments;
+	struct prometheus_rule *next;   // next rule with the same segment count
+};
+
+// rules by number of segments, in configuration order
+static struct prometheus_rule *prometheus_rules_table[PROMETHEUS_RULE_MAX_SEGMENTS + 1];
+
+static int prometheus_valid_name(const char *name, size_t len) {
+	size_t i;
+	if (len == 0 || (name[0] >= '0' && name[0] <= '9')) return 0;
+	for (i = 0; i < len; i++) {
+		char c = name[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == ':')) return 0;
+	}
+	return 1;
+}
+
+static char *prometheus_trim(char *str, size_t *len) {
+	while (*len > 0 && isspace((unsigned char)str[0])) {
+		str++;
+		(*len)--;
+	}
+	while (*len > 0 && isspace((unsigned char)str[*len - 1])) {
+		(*len)--;
+	}
+	return str;
+}
+
+static void prometheus_rule_compile(char *rule_str) {
+	char *arrow = strstr(rule_str, "->");
+	if (!arrow) {
+		uwsgi_log("[prometheus] ERROR: invalid label rule '%s' (expected 'pattern -> name')\n", rule_str);
+		uwsgi_exit(1);
+	}
+
+	size_t pattern_len = arrow - rule_str;
+	char *pattern = prometheus_trim(rule_str, &pattern_len);
+	size_t target_len = strlen(arrow + 2);
+	char *target = prometheus_trim(arrow + 2, &target_len);
+
+	if (pattern_len == 0 || !prometheus_valid_name(target, target_len)) {
+		uwsgi_log("[prometheus] ERROR: invalid label rule '%s'\n", rule_str);
+		uwsgi_exit(1);
+	}
+
+	struct prometheus_rule *rule = uwsgi_calloc(sizeof(struct prometheus_rule));
+	rule->target = uwsgi_strncopy(target, target_len);
+	rule->target_len = target_len;
+	rule->segments = uwsgi_calloc(sizeof(struct prometheus_rule_segment) * PROMETHEUS_RULE_MAX_SEGMENTS);
+
+	size_t i, start = 0;
+	for (i = 0; i <= pattern_len; i++) {
+		if (i < pattern_len && pattern[i] != '.') continue;
+		if (rule->segments_cnt == PROMETHEUS_RULE_MAX_SEGMENTS) {
+			uwsgi_log("[prometheus] ERROR: label rule '%s' has too many segments\n", rule_str);
+			uwsgi_exit(1);
+		}
+
+		struct prometheus_rule_segment *seg = &rule->segments[rule->segments_cnt++];
+		char *str = pattern + start;
+		size_t len = i - start;
+		start = i + 1;
+
+		if (len == 1 && str[0] == '*') {
+			seg->type = PROMETHEUS_RULE_ANY;
+		} else if (len > 2 && str[0] == '{' && str[len - 1] == '}') {
+			seg->type = PROMETHEUS_RULE_CAPTURE;
+			seg->str = uwsgi_strncopy(str + 1, len - 2);
+			seg->len = len - 2;
+			// "__" is reserved by Prometheus (__name__ and friends)
+			if (!prometheus_valid_name(seg->str, seg->len) || memchr(seg->str, ':', seg->len) ||
+			    (seg->len >= 2 && seg->str[0] == '_' && seg->str[1] == '_')) {
+				uwsgi_log("[prometheus] ERROR: invalid label name '%s' in rule '%s'\n", seg->str, rule_str);
+				uwsgi_exit(1);
+			}
+			uint32_t j;
+			for (j = 0; j + 1 < rule->segments_cnt; j++) {
+				struct prometheus_rule_segment *other = &rule->segments[j];
+				if (other->type == PROMETHEUS_RULE_CAPTURE && other->len == seg->len && !memcmp(other->str, seg->str, seg->len)) {
+					uwsgi_log("[prometheus] ERROR: label '%s' captured twice in rule '%s'\n", seg->str, rule_str);
+					uwsgi_exit(1);
+				}
+			}
+		} else if (len > 0) {
+			seg->type = PROMETHEUS_RULE_LITERAL;
+			seg->str = uwsgi_strncopy(str, len);
+			seg->len = len;
+		} else {
+			uwsgi_log("[prometheus] ERROR: empty segment in label rule '%s'\n", rule_str);
+			uwsgi_exit(1);
+		}
+	}
+
+	// append, so that configuration order is preserved
+	struct prometheus_rule **slot = &prometheus_rules_table[rule->segments_cnt];
+	while (*slot) slot = &(*slot)->next;
+	*slot = rule;
+}
+
+/*
+ * Label names the exporter sets itself: the positional labels of the
+ * default conversion (id4, id5, ... too), and those of its own families.
+ */
+static const char *prometheus_reserved_labels[] = {
+	"worker", "core", "thread", "id", "le", "quantile", "rank", "path", "client", "route", "code",
+	"socket", "state", "event", "kind", "method", "resource", NULL
+};
+
+static int prometheus_label_reserved(const char *name, size_t len) {
+	const char **reserved;
+	size_t i;
+	for (reserved = prometheus_reserved_labels; *reserved; reserved++) {
+		if (strlen(*reserved) == len && !memcmp(*reserved, name, len)) return 1;
+	}
+	if (len <= 2 || name[0] != 'i' || name[1] != 'd') return 0;
+	for (i = 2; i < len; i++) {
+		if (name[i] < '0' || name[i] > '9') return 0;
+	}
+	return 1;
+}
+
+// does any rule capture the label name?
+static int prometheus_rules_capture(const char *name, size_t len) {
+	struct prometheus_rule *rule;
+	uint32_t i, j;
+	for (i = 0; i <= PROMETHEUS_RULE_MAX_SEGMENTS; i++) {
+		for (rule = prometheus_rules_table[i]; rule; rule = rule->next) {
+			for (j = 0; j < rule->segments_cnt; j++) {
+				struct prometheus_rule_segment *seg = &rule->segments[j];
+				if (seg->type == PROMETHEUS_RULE_CAPTURE && seg->len == len && !memcmp(seg->str, name, len)) return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Constant labels (--prometheus-label key=value) are rendered once at startup
+ * and spliced into the cached label block of every series.
+ */
+static void prometheus_const_labels_compile(void) {
+	struct uwsgi_string_list *usl;
+	if (!ump_config.const_labels) return;
+
+	struct uwsgi_buffer *ub = uwsgi_buffer_new(256);
+	uwsgi_foreach(usl, ump_config.const_labels) {
+		char *eq = strchr(usl->value, '=');
+		size_t key_len = eq ? (size_t)(eq - usl->value) : 0;
+		if (!eq || !prometheus_valid_name(usl->value, key_len) || memchr(usl->value, ':', key_len) ||
+		    (key_len >= 2 && usl->value[0] == '_' && usl->value[1] == '_')) {
+			uwsgi_log("[prometheus] ERROR: invalid constant label '%s' (expected key=value)\n", usl->value);
+			uwsgi_exit(1);
+		}
+		if (prometheus_label_reserved(usl->value, key_len)) {
+			uwsgi_log("[prometheus] ERROR: constant label '%.*s' is reserved for the exporter's own labels\n", (int) key_len, usl->value);
+			uwsgi_exit(1);
+		}
+		struct uwsgi_string_list *prev;
+		for (prev = ump_config.const_labels; prev != usl; prev = prev->next) {
+			if (!strncmp(prev->value, usl->value, key_len) && prev->value[key_len] == '=') {
+				uwsgi_log("[prometheus] ERROR: constant label '%.*s' is set twice\n", (int) key_len, usl->value);
+				uwsgi_exit(1);
+			}
+		}
+		// rules are compiled first: a captured label would appear twice
+		if (prometheus_rules_capture(usl->value, key_len)) {
+			uwsgi_log("[prometheus] ERROR: constant label '%.*s' is also captured by a label rule\n", (int) key_len, usl->value);
+			uwsgi_exit(1);
+		}
+		if (ub->pos > 0) {
+			if (uwsgi_buffer_append(ub, (char *)",", 1)) goto error;
+		}
+		if (uwsgi_buffer_append(ub, usl->value, key_len)) goto error;
+		if (uwsgi_buffer_append(ub, (char *)"=\"", 2)) goto error;
+		if (prometheus_escape_string(ub, eq + 1, strlen(eq + 1))) goto error;
+		if (uwsgi_buffer_append(ub, (char *)"\"", 1)) goto error;
+	}
+
+	ump_config.const_labels_block = ub->buf;
+	ump_config.const_labels_block_len = ub->pos;
+	free(ub);
+	return;
+
+error:
+	uwsgi_log("[prometheus] ERROR: unable to render constant labels\n");
+	uwsgi_exit(1);
+}
+
+static int prometheus_const_labels_splice(struct uwsgi_buffer *labels_buf) {
+	if (!ump_config.const_labels_block) return 0;
+	if (labels_buf->pos > 0) {
+		if (uwsgi_buffer_append(labels_buf, (char *)",", 1)) return -1;
+	}
+	return uwsgi_buffer_append(labels_buf, ump_config.const_labels_block, ump_config.const_labels_block_len);
+}
+
+/*
+ * Returns 1 if a rule matched and name_buf/labels_buf were filled,
+ * 0 if the default conversion should be used, -1 on error.
+ */
+static int prometheus_rules_apply(struct uwsgi_buffer *name_buf, struct uwsgi_buffer *labels_buf,
+                                  const char *metric_name, size_t metric_name_len) {
+	const char *segments[PROMETHEUS_RULE_MAX_SEGMENTS];
+	size_t segments_len[PROMETHEUS_RULE_MAX_SEGMENTS];
+	uint32_t cnt = 0;
+	size_t i, start = 0;
+
+	for (i = 0; i <= metric_name_len; i++) {
+		if (i < metric_name_len && metric_name[i] != '.') continue;
+		if (cnt == PROMETHEUS_RULE_MAX_SEGMENTS) return 0;
+		segments[cnt] = metric_name + start;
+		segments_len[cnt] = i - start;
+		cnt++;
+		start = i + 1;
+	}
+
+	struct prometheus_rule *rule;
+	for (rule = prometheus_rules_table[cnt]; rule; rule = rule->next) {
+		uint32_t j;
+		for (j = 0; j < cnt; j++) {
+			struct prometheus_rule_segment *seg = &rule->segments[j];
+			if (seg->type == PROMETHEUS_RULE_LITERAL &&
+			    (seg->len != segments_len[j] || memcmp(seg->str, segments[j], seg->len))) break;
+		}
+		if (j < cnt) continue;
+
+		name_buf->pos = 0;
+		labels_buf->pos = 0;
+		if (uwsgi_buffer_append(name_buf, rule->target, rule->target_len)) return -1;
+		for (j = 0; j < cnt; j++) {
+			struct prometheus_rule_segment *seg = &rule->segments[j];
+			if (seg->type != PROMETHEUS_RULE_CAPTURE) continue;
+			if (labels_buf->pos > 0) {
+				if (uwsgi_buffer_append(labels_buf, (char *)",", 1)) return -1;
+			}
+			if (uwsgi_buffer_append(labels_buf, seg->str, seg->len)) return -1;
+			if (uwsgi_buffer_append(labels_buf, (char *)"=\"", 2)) return -1;
+			if (prometheus_escape_string(labels_buf, segments[j], segments_len[j])) return -1;
+			if (uwsgi_buffer_append(labels_buf, (char *)"\"", 1)) return -1;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static const char *prometheus_prefix(void) {
+	return ump_config.prefix ? ump_config.prefix : "uwsgi_";
+}
+
+// exporter-only types, next to the UWSGI_METRIC_* ones
+#define PROMETHEUS_TYPE_HISTOGRAM 0x10
+#define PROMETHEUS_TYPE_SUMMARY   0x11
+
+static const char *prometheus_type_name(uint8_t type) {
+	switch (type) {
+		case UWSGI_METRIC_COUNTER:
+			return "counter";
+		case UWSGI_METRIC_GAUGE:
+		case UWSGI_METRIC_ABSOLUTE:
+			return "gauge";
+		case PROMETHEUS_TYPE_HISTOGRAM:
+			return "histogram";
+		case PROMETHEUS_TYPE_SUMMARY:
+			return "summary";
+	}
+	return "untyped";
+}
+
+static char *prometheus_render_header(const char *name, size_t name_len, const char *help, size_t help_len,
+                                      const char *type, size_t *len) {
+	struct uwsgi_buffer *ub = uwsgi_buffer_new(name_len * 2 + help_len + 32);
+	if (ump_config.include_help) {
+		if (uwsgi_buffer_append(ub, (char *)"# HELP ", 7)) goto error;
+		if (uwsgi_buffer_append(ub, (char *)name, name_len)) goto error;
+		if (uwsgi_buffer_append(ub, (char *)" ", 1)) goto error;
+		if (uwsgi_buffer_append(ub, (char *)help, help_len)) goto error;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) goto error;
+	}
+	if (ump_config.include_type) {
+		if (uwsgi_buffer_append(ub, (char *)"# TYPE ", 7)) goto error;
+		if (uwsgi_buffer_append(ub, (char *)name, name_len)) goto error;
+		if (uwsgi_buffer_append(ub, (char *)" ", 1)) goto error;
+		if (uwsgi_buffer_append(ub, (char *)type, strlen(type))) goto error;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) goto error;
+	}
+	// hand the raw memory over to the cache
+	char *buf = ub->buf;
+	*len = ub->pos;
+	free(ub);
+	return buf;
+
+error:
+	uwsgi_buffer_destroy(ub);
+	*len = 0;
+	return NULL;
+}
+
+static char *prometheus_render_line(const char *name, size_t name_len, const char *labels, size_t labels_len, size_t *len) {
+	char *line = uwsgi_malloc(name_len + labels_len + 3);
+	size_t pos = 0;
+	memcpy(line, name, name_len);
+	pos += name_len;
+	if (labels_len > 0) {
+		line[pos++] = '{';
+		memcpy(line + pos, labels, labels_len);
+		pos += labels_len;
+		line[pos++] = '}';
+	}
+	line[pos++] = ' ';
+	*len = pos;
+	return line;
+}
+
+/*
+ * ===========================================================================
+ * HTTP SERVER
+ * ===========================================================================
+ */
+
+/*
+ * The dedicated server and the standalone exporter answer one request per
+ * connection, in a single thread: a client that does not send its request
+ * or read the response in time is dropped instead of stalling the others.
+ */
+#define PROMETHEUS_HTTP_TIMEOUT 1       // seconds
+#define PROMETHEUS_TEXT_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+struct prometheus_http_request {
+	char buf[4096];
+	const char *path;           // "GET /path?query HTTP/1.1"
+	size_t path_len;
+	const char *query;          // NULL without a query string
+	size_t query_len;
+	const char *accept;         // value of the Accept header, NULL if absent
+	size_t accept_len;
+};
+
+/*
+ * Accept a connection and read its request (only the request line and the
+ * Accept header are looked at). Returns the client fd, -1 if there is
+ * nothing to answer.
+ */
+static int prometheus_http_accept(int server_fd, struct prometheus_http_request *req) {
+	int client_fd = accept(server_fd, NULL, NULL);
+	if (client_fd < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+			uwsgi_error("[prometheus] accept()");
+		}
+		return -1;
+	}
+
+	// not every system clears O_NONBLOCK of the listening socket
+	fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, 0) & ~O_NONBLOCK);
+	struct timeval tv = {PROMETHEUS_HTTP_TIMEOUT, 0};
+	setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	ssize_t rlen = read(client_fd, req->buf, sizeof(req->buf) - 1);
+	if (rlen <= 0) {
+		close(client_fd);
+		return -1;
+	}
+	req->buf[rlen] = 0;
+	req->path = req->query = req->accept = NULL;
+	req->path_len = req->query_len = req->accept_len = 0;
+
+	char *uri = memchr(req->buf, ' ', rlen);
+	if (uri) {
+		size_t uri_len = strcspn(uri + 1, " \r\n");
+		char *qmark = memchr(uri + 1, '?', uri_len);
+		req->path = uri + 1;
+		req->path_len = qmark ? (size_t)(qmark - (uri + 1)) : uri_len;
+		if (qmark) {
+			req->query = qmark + 1;
+			req->query_len = (uri + 1 + uri_len) - req->query;
+		}
+	}
+
+	char *line = strstr(req->buf, "\r\n");
+	while (line && line[2] != '\r' && line[2] != 0) {
+		line += 2;
+		char *eol = strstr(line, "\r\n");
+		if (!strncasecmp(line, "accept:", 7)) {
+			req->accept = line + 7;
+			req->accept_len = (eol ? eol : req->buf + rlen) - req->accept;
+			break;
+		}
+		line = eol;
+	}
+	return client_fd;
+}
+
+static void prometheus_http_error(int client_fd) {
+	const char *response =
+		"HTTP/1.0 500 Internal Server Error\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: 27\r\n"
+		"\r\n"
+		"Failed to generate metrics\n";
+	if (write(client_fd, response, strlen(response)) < 0) {
+		uwsgi_error("[prometheus] write()");
+	}
+}
+
+// build the headers into head (reused across requests) and send them with body in a single syscall
+static int prometheus_http_respond(int client_fd, struct uwsgi_buffer *head, const char *content_type, struct uwsgi_buffer *body) {
+	head->pos = 0;
+	if (uwsgi_buffer_append(head, (char *)"HTTP/1.0 200 OK\r\nContent-Type: ", 31)) return -1;
+	if (uwsgi_buffer_append(head, (char *)content_type, strlen(content_type))) return -1;
+	if (uwsgi_buffer_append(head, (char *)"\r\nContent-Length: ", 18)) return -1;
+	if (uwsgi_buffer_num64(head, body->pos)) return -1;
+	if (uwsgi_buffer_append(head, (char *)"\r\nConnection: close\r\n\r\n", 23)) return -1;
+
+	struct iovec iov[2];
+	iov[0].iov_base = head->buf;
+	iov[0].iov_len = head->pos;
+	iov[1].iov_base = body->buf;
+	iov[1].iov_len = body->pos;
+	if (writev(client_fd, iov, 2) < 0) {
+		uwsgi_error("[prometheus] writev()");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Host part of a "host:port" server address, without the brackets of an
+ * IPv6 literal ("[::1]:9091"), NULL when empty (":9091"). port points to
+ * the ':' before the port.
+ */
+static char *prometheus_address_host(const char *address, const char *port) {
+	size_t len = port - address;
+	if (len >= 2 && address[0] == '[' && port[-1] == ']') return uwsgi_strncopy((char *) address + 1, len - 2);
+	return len > 0 ? uwsgi_strncopy((char *) address, len) : NULL;
+}
+
+// the standalone exporter (exporter.c) stops here: the rest needs a uWSGI instance
+#ifndef PROMETHEUS_STANDALONE
+
+/*
+ * ===========================================================================
+ * PROTOBUF EXPOSITION
+ * ===========================================================================
+ */
+
+/*
+ * Minimal encoder for the delimited io.prometheus.client.MetricFamily
+ * format, the only exposition format able to carry native histograms.
+ * Only the handful of fields we emit are known here:
+ *
+ *   MetricFamily { 1: name, 2: help, 3: type, 4: repeated Metric }
+ *   Metric       { 1: repeated LabelPair, 2: Gauge, 3: Counter, 4: Summary, 7: Histogram }
+ *   LabelPair    { 1: name, 2: value }
+ *
+ * Everything that does not change between scrapes (family headers, label
+ * pairs) is encoded once, next to the text lines.
+ */
+#define PROMETHEUS_PB_CONTENT_TYPE "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited"
+
+#define PROMETHEUS_PB_VARINT  0
+#define PROMETHEUS_PB_FIXED64 1
+#define PROMETHEUS_PB_BYTES   2
+
+#define PROMETHEUS_PB_COUNTER   0
+#define PROMETHEUS_PB_GAUGE     1
+#define PROMETHEUS_PB_SUMMARY   2
+#define PROMETHEUS_PB_UNTYPED   3
+#define PROMETHEUS_PB_HISTOGRAM 4
+
+static inline size_t prometheus_pb_varint_len(uint64_t value) {
+	size_t len = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		len++;
+	}
+	return len;
+}
+
+static int prometheus_pb_varint(struct uwsgi_buffer *ub, uint64_t value) {
+	char buf[10];
+	size_t len = 0;
+	while (value >= 0x80) {
+		buf[len++] = (char)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	buf[len++] = (char) value;
+	return uwsgi_buffer_append(ub, buf, len);
+}
+
+static inline uint64_t prometheus_pb_zigzag(int64_t value) {
+	return ((uint64_t) value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int prometheus_pb_tag(struct uwsgi_buffer *ub, uint32_t field, uint32_t wire_type) {
+	return prometheus_pb_varint(ub, (field << 3) | wire_type);
+}
+
+static int prometheus_pb_uint(struct uwsgi_buffer *ub, uint32_t field, uint64_t value) {
+	if (prometheus_pb_tag(ub, field, PROMETHEUS_PB_VARINT)) return -1;
+	return prometheus_pb_varint(ub, value);
+}
+
+static int prometheus_pb_double(struct uwsgi_buffer *ub, uint32_t field, double value) {
+	uint64_t bits;
+	char buf[8];
+	int i;
+	memcpy(&bits, &value, sizeof(bits));
+	for (i = 0; i < 8; i++) {
+		buf[i] = (char)(bits >> (i * 8));
+	}
+	if (prometheus_pb_tag(ub, field, PROMETHEUS_PB_FIXED64)) return -1;
+	return uwsgi_buffer_append(ub, buf, 8);
+}
+
+static int prometheus_pb_bytes(struct uwsgi_buffer *ub, uint32_t field, const char *data, size_t len) {
+	if (prometheus_pb_tag(ub, field, PROMETHEUS_PB_BYTES)) return -1;
+	if (prometheus_pb_varint(ub, len)) return -1;
+	return uwsgi_buffer_append(ub, (char *)data, len);
+}
+
+static uint32_t prometheus_pb_type(uint8_t type) {
+	switch (type) {
+		case UWSGI_METRIC_COUNTER:
+			return PROMETHEUS_PB_COUNTER;
+		case UWSGI_METRIC_GAUGE:
+		case UWSGI_METRIC_ABSOLUTE:
+			return PROMETHEUS_PB_GAUGE;
+		case PROMETHEUS_TYPE_HISTOGRAM:
+			return PROMETHEUS_PB_HISTOGRAM;
+		case PROMETHEUS_TYPE_SUMMARY:
+			return PROMETHEUS_PB_SUMMARY;
+	}
+	return PROMETHEUS_PB_UNTYPED;
+}
+
+// MetricFamily name, help and type: the part of a family shared by every scrape
+static char *prometheus_pb_header(const char *name, size_t name_len, const char *help, size_t help_len, uint8_t type, size_t *len) {
+	struct uwsgi_buffer *ub = uwsgi_buffer_new(name_len + help_len + 16);
+	if (prometheus_pb_bytes(ub, 1, name, name_len)) goto error;
+	if (ump_config.include_help && help_len > 0) {
+		if (prometheus_pb_bytes(ub, 2, help, help_len)) goto error;
+	}
+	if (prometheus_pb_uint(ub, 3, prometheus_pb_type(type))) goto error;
+	char *buf = ub->buf;
+	*len = ub->pos;
+	free(ub);
+	return buf;
+
+error:
+	uwsgi_buffer_destroy(ub);
+	*len = 0;
+	return NULL;
+}
+
+/*
+ * Encode a text label block ('key="value",...', values escaped) as the
+ * LabelPair fields of a Metric.
+ */
+static char *prometheus_pb_labels(const char *labels, size_t labels_len, size_t *len) {
+	struct uwsgi_buffer *ub = uwsgi_buffer_new(labels_len + 16);
+	struct uwsgi_buffer *pair = uwsgi_buffer_new(labels_len + 16);
+	struct uwsgi_buffer *value = uwsgi_buffer_new(labels_len + 1);
+	const char *ptr = labels;
+	const char *end = labels + labels_len;
+
+	while (ptr < end) {
+		const char *eq = memchr(ptr, '=', end - ptr);
+		if (!eq || eq + 1 >= end || eq[1] != '"') goto error;
+
+		value->pos = 0;
+		const char *cur;
+		for (cur = eq + 2; cur < end && *cur != '"'; cur++) {
+			char c = *cur;
+			if (c == '\\' && cur + 1 < end) {
+				cur++;
+				c = *cur == 'n' ? '\n' : *cur;
+			}
+			if (uwsgi_buffer_append(value, &c, 1)) goto error;
+		}
+		if (cur >= end) goto error;
+
+		pair->pos = 0;
+		if (prometheus_pb_bytes(pair, 1, ptr, eq - ptr)) goto error;
+		if (prometheus_pb_bytes(pair, 2, value->buf, value->pos)) goto error;
+		if (prometheus_pb_bytes(ub, 1, pair->buf, pair->pos)) goto error;
+		// skip the closing quote and the ',' separator
+		ptr = cur + 2;
+	}
+
+	uwsgi_buffer_destroy(value);
+	uwsgi_buffer_destroy(pair);
+	char *buf = ub->buf;
+	*len = ub->pos;
+	free(ub);
+	return buf;
+
+error:
+	uwsgi_log("[prometheus] ERROR: unable to encode labels '%.*s'\n", (int) labels_len, labels);
+	uwsgi_buffer_destroy(value);
+	uwsgi_buffer_destroy(pair);
+	uwsgi_buffer_destroy(ub);
+	*len = 0;
+	return NULL;
+}
+
+// Counter or Gauge metric with a single value
+static int prometheus_pb_metric_value(struct uwsgi_buffer *ub, const char *labels, size_t labels_len, uint8_t type, double value) {
+	// Metric.gauge, Metric.counter or Metric.untyped, as announced by MetricFamily.type
+	uint32_t field;
+	switch (prometheus_pb_type(type)) {
+		case PROMETHEUS_PB_COUNTER:
+			field = 3;
+			break;
+		case PROMETHEUS_PB_GAUGE:
+			field = 2;
+			break;
+		default:
+			field = 5;
+			break;
+	}
+	// labels + value message tag/len + (double tag + 8 bytes)
+	if (prometheus_pb_tag(ub, 4, PROMETHEUS_PB_BYTES)) return -1;
+	if (prometheus_pb_varint(ub, labels_len + 2 + 9)) return -1;
+	if (uwsgi_buffer_append(ub, (char *)labels, labels_len)) return -1;
+	if (prometheus_pb_tag(ub, field, PROMETHEUS_PB_BYTES)) return -1;
+	if (prometheus_pb_varint(ub, 9)) return -1;
+	return prometheus_pb_double(ub, 1, value);
+}
+
+// Length-delimited MetricFamily: families are built in a scratch buffer first
+static int prometheus_pb_family_end(struct uwsgi_buffer *body, struct uwsgi_buffer *family) {
+	if (prometheus_pb_varint(body, family->pos)) return -1;
+	return uwsgi_buffer_append(body, family->buf, family->pos);
+}
+
+/*
+ * Accept negotiation: Prometheus asks for the delimited MetricFamily
+ * protobuf first when native histograms are enabled on its side.
+ */
+static int prometheus_accepts_protobuf(const char *accept, size_t len) {
+	if (!ump_config.native_histograms || !accept || len == 0) return 0;
+	const char *ptr = accept;
+	const char *end = accept + len;
+	while (ptr < end) {
+		const char *comma = memchr(ptr, ',', end - ptr);
+		size_t item_len = (comma ? comma : end) - ptr;
+		if (uwsgi_contains_n((char *)ptr, item_len, (char *)"application/vnd.google.protobuf", 31) &&
+		    uwsgi_contains_n((char *)ptr, item_len, (char *)"io.prometheus.client.MetricFamily", 33) &&
+		    uwsgi_contains_n((char *)ptr, item_len, (char *)"delimited", 9)) {
+			return 1;
+		}
+		if (!comma) break;
+		ptr = comma + 1;
+	}
+	return 0;
+}
+
+/*
+ * ===========================================================================
+ * SCRAPE CONTEXT
+ * ===========================================================================
+ */
+
+/*
+ * Output buffers that survive between scrapes.
+ *
+ * The master (dedicated server) owns a single context, workers (route handler)
+ * own one per core, indexed by wsgi_req->async_id. Buffers keep the capacity
+ * reached by previous scrapes, so in the steady state a scrape does not touch
+ * the allocator at all.
+ */
+struct prometheus_scrape_ctx {
+	struct uwsgi_buffer *body;
+	struct uwsgi_buffer *name_buf;
+	struct uwsgi_buffer *labels_buf;
+	struct uwsgi_buffer *head;
+	struct uwsgi_buffer *pb_family;   // protobuf scratch: current MetricFamily
+	struct uwsgi_buffer *pb_value;    // protobuf scratch: nested value message
+	struct prometheus_arena arena;
+	uint64_t *scoreboard;             // worker scoreboard columns, taken once per scrape
+	uint64_t *listen;                 // listen queue depths then backlogs, once per scrape
+	uint64_t *proc;                   // /proc columns, once per scrape
+	uint64_t *cgroup;                 // cgroup values, once per scrape
+	struct prometheus_topk_item *topk[2];   // merged top-K paths and clients, once per scrape
+	int topk_cnt[2];
+};
+
+static struct prometheus_scrape_ctx prometheus_master_ctx;
+static struct prometheus_scrape_ctx *prometheus_core_ctx;
+
+static int prometheus_scrape_ctx_init(struct prometheus_scrape_ctx *ctx) {
+	if (ctx->body) return 0;
+
+	ctx->body = uwsgi_buffer_new(uwsgi.page_size);
+	ctx->name_buf = uwsgi_buffer_new(256);
+	ctx->labels_buf = uwsgi_buffer_new(256);
+	ctx->head = uwsgi_buffer_new(256);
+	ctx->pb_family = uwsgi_buffer_new(256);
+	ctx->pb_value = uwsgi_buffer_new(256);
+	if (!ctx->body || !ctx->name_buf || !ctx->labels_buf || !ctx->head || !ctx->pb_family || !ctx->pb_value) {
+		uwsgi_log("[prometheus] Failed to allocate output buffers\n");
+		if (ctx->body) uwsgi_buffer_destroy(ctx->body);
+		if (ctx->name_buf) uwsgi_buffer_destroy(ctx->name_buf);
+		if (ctx->labels_buf) uwsgi_buffer_destroy(ctx->labels_buf);
+		if (ctx->head) uwsgi_buffer_destroy(ctx->head);
+		if (ctx->pb_family) uwsgi_buffer_destroy(ctx->pb_family);
+		if (ctx->pb_value) uwsgi_buffer_destroy(ctx->pb_value);
+		memset(ctx, 0, sizeof(struct prometheus_scrape_ctx));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * End of a scrape: everything allocated from the arena is released at once.
+ */
+static void prometheus_scrape_ctx_end(struct prometheus_scrape_ctx *ctx) {
+	prometheus_arena_reset(&ctx->arena);
+	ctx->scoreboard = NULL;
+	ctx->listen = NULL;
+	ctx->proc = NULL;
+	ctx->cgroup = NULL;
+	ctx->topk[0] = ctx->topk[1] = NULL;
+}
+
+/*
+ * Count a buffer growth if the last scrape had to realloc it.
+ *
+ * uwsgi_buffer_append() grows one page at a time, so after a growth we add
+ * 1/8 of headroom in one step to avoid paying a realloc per page on the
+ * next scrape when the output keeps growing slowly.
+ */
+static void prometheus_buffer_track(struct uwsgi_buffer *ub, size_t old_len) {
+	if (ub->len == old_len) return;
+
+	if (ump_config.buffer_reallocs) {
+		__atomic_add_fetch(ump_config.buffer_reallocs, 1, __ATOMIC_RELAXED);
+	}
+	uwsgi_buffer_fix(ub, ub->pos + (ub->pos / 8));
+}
+
+/*
+ * ===========================================================================
+ * SHARDED REGISTRY
+ * ===========================================================================
+ */
+
+/*
+ * Exporter-owned counters for high-frequency (per request) updates.
+ *
+ * Families and their slots are declared before fork. post_init then maps one
+ * shared memory region holding a shard per (worker, core), each aligned to a
+ * cache line. A core only ever writes its own shard, so updates are plain
+ * stores without uwsgi.metrics_lock or atomic read-modify-write. The exporter
+ * sums the shards at scrape time.
+ *
+ *   shard(wid, core) = base + ((wid * cores) + core) * stride
+ *
+ * Worker 0 is used by code running outside of a worker (the master).
+ */
+#define PROMETHEUS_CACHELINE 64
+
+struct prometheus_registry_family;
+struct prometheus_registry_series;
+typedef int (*prometheus_registry_render_fn)(struct prometheus_registry_family *, uint64_t *, struct prometheus_scrape_ctx *);
+typedef void (*prometheus_registry_prepare_fn)(struct prometheus_registry_family *, struct prometheus_registry_series *, struct uwsgi_buffer *);
+typedef int (*prometheus_registry_render_pb_fn)(struct prometheus_registry_family *, uint64_t *, struct prometheus_scrape_ctx *);
+
+struct prometheus_registry_series {
+	char *labels;               // raw label block, without constant labels
+	uint32_t slot;              // first slot
+	uint32_t slots;
+	char *line;                 // "name{labels} ", rendered at allocation
+	size_t line_len;
+	char **lines;               // family specific lines (e.g. histogram buckets)
+	size_t *lines_len;
+	char *pb_labels;            // encoded LabelPairs (protobuf only)
+	size_t pb_labels_len;
+};
+
+struct prometheus_registry_family {
+	char *name;                 // without prefix
+	char *help;
+	uint8_t type;
+	char *full_name;            // with prefix, set at allocation
+	size_t full_name_len;
+	char *header;
+	size_t header_len;
+	struct prometheus_registry_series *series;
+	uint32_t series_cnt;
+	prometheus_registry_render_fn render;
+	prometheus_registry_prepare_fn prepare;   // optional, renders series lines at allocation
+	prometheus_registry_render_pb_fn render_pb;
+	int sparse;                 // default renderers skip series still at zero
+	uint32_t totals;            // leading slots of each series summed at scrape time, 0 for all
+	char *pb_header;            // encoded name/help/type (protobuf only)
+	size_t pb_header_len;
+	void *data;                 // render specific (e.g. histogram buckets)
+};
+
+struct prometheus_registry_range {
+	uint32_t slot;
+	uint32_t cnt;
+};
+
+struct prometheus_registry {
+	struct prometheus_registry_family *families;
+	uint32_t families_cnt;
+	uint32_t slots;
+	struct prometheus_registry_range *ranges;  // slots summed into totals[], set at allocation
+	uint32_t ranges_cnt;
+	size_t stride;              // bytes per shard, cache line aligned
+	uint32_t shards;
+	uint64_t *base;             // shared memory, NULL until allocated
+} prometheus_registry;
+
+static uint32_t prometheus_registry_family_new(const char *name, const char *help, uint8_t type,
+                                               prometheus_registry_render_fn render, void *data) {
+	if (prometheus_registry.base) {
+		uwsgi_log("[prometheus] BUG: registry family %s declared after allocation\n", name);
+		uwsgi_exit(1);
+	}
+	struct prometheus_registry *reg = &prometheus_registry;
+	reg->families = realloc(reg->families, sizeof(struct prometheus_registry_family) * (reg->families_cnt + 1));
+	if (!reg->families) {
+		uwsgi_error("[prometheus] realloc()");
+		uwsgi_exit(1);
+	}
+	struct prometheus_registry_family *rf = &reg->families[reg->families_cnt];
+	memset(rf, 0, sizeof(struct prometheus_registry_family));
+	rf->name = uwsgi_str((char *)name);
+	rf->help = uwsgi_str((char *)help);
+	rf->type = type;
+	rf->render = render;
+	rf->data = data;
+	return reg->families_cnt++;
+}
+
+/*
+ * Reserve a series of `slots` consecutive slots in a family. Returns the
+ * first slot, which is what the hot path uses to address the shard.
+ */
+static uint32_t prometheus_registry_series_new(uint32_t family, const char *labels, uint32_t slots) {
+	struct prometheus_registry *reg = &prometheus_registry;
+	struct prometheus_registry_family *rf = &reg->families[family];
+	rf->series = realloc(rf->series, sizeof(struct prometheus_registry_series) * (rf->series_cnt + 1));
+	if (!rf->series) {
+		uwsgi_error("[prometheus] realloc()");
+		uwsgi_exit(1);
+	}
+	struct prometheus_registry_series *rs = &rf->series[rf->series_cnt++];
+	memset(rs, 0, sizeof(struct prometheus_registry_series));
+	rs->labels = uwsgi_str(labels ? (char *)labels : (char *)"");
+	rs->slot = reg->slots;
+	rs->slots = slots;
+	reg->slots += slots;
+	return rs->slot;
+}
+
+static inline uint64_t *prometheus_registry_shard(int wid, int core) {
+	return (uint64_t *)((char *)prometheus_registry.base + (((size_t)wid * uwsgi.cores) + core) * prometheus_registry.stride);
+}
+
+// single writer per shard: a relaxed store is enough and keeps readers untorn
+static inline void prometheus_shard_add(uint64_t *shard, uint32_t slot, uint64_t n) {
+	__atomic_store_n(&shard[slot], shard[slot] + n, __ATOMIC_RELAXED);
+}
+
+static int prometheus_registry_render_default(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	struct uwsgi_buffer *ub = ctx->body;
+	uint32_t i;
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (rf->sparse && !totals[rs->slot]) continue;
+		if (uwsgi_buffer_append(ub, rs->line, rs->line_len)) return -1;
+		if (uwsgi_buffer_num64(ub, totals[rs->slot])) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+	}
+	return 0;
+}
+
+static int prometheus_registry_render_pb_default(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t i;
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (rf->sparse && !totals[rs->slot]) continue;
+		if (prometheus_pb_metric_value(ctx->pb_family, rs->pb_labels, rs->pb_labels_len, rf->type, (double) totals[rs->slot])) return -1;
+	}
+	return 0;
+}
+
+/*
+ * With --prometheus-state the shards live in a file instead of anonymous
+ * shared memory, so a reload (the master re-executing itself) or a restart
+ * maps the same counters again. A header identifies the layout: if the
+ * families, series or shard geometry changed, the counters cannot be
+ * matched and start from zero.
+ */
+#define PROMETHEUS_STATE_MAGIC "uwsgiprm"
+
+struct prometheus_state_header {
+	char magic[8];
+	uint64_t layout;            // hash of the families, series and shards
+	uint64_t size;              // of the whole file
+};
+
+static uint64_t prometheus_state_layout(struct prometheus_registry *reg) {
+	uint64_t layout = prometheus_hash((const char *) &reg->stride, sizeof(reg->stride));
+	uint32_t i, j;
+	layout = (layout * 31) ^ reg->shards;
+	for (i = 0; i < reg->families_cnt; i++) {
+		struct prometheus_registry_family *rf = &reg->families[i];
+		layout = (layout * 31) ^ prometheus_hash(rf->name, strlen(rf->name));
+		for (j = 0; j < rf->series_cnt; j++) {
+			struct prometheus_registry_series *rs = &rf->series[j];
+			layout = (layout * 31) ^ prometheus_hash(rs->labels, strlen(rs->labels));
+			layout = (layout * 31) ^ rs->slot;
+		}
+	}
+	return layout;
+}
+
+static uint64_t *prometheus_state_map(struct prometheus_registry *reg) {
+	struct prometheus_state_header *header;
+	uint64_t layout = prometheus_state_layout(reg);
+	// the header takes one cache line, so the shards stay aligned
+	size_t size = PROMETHEUS_CACHELINE + (reg->stride * reg->shards);
+	struct stat st;
+
+	int fd = open(ump_config.state, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || fstat(fd, &st)) {
+		uwsgi_error_open(ump_config.state);
+		uwsgi_exit(1);
+	}
+	int reuse = (size_t) st.st_size == size;
+	if (!reuse && (ftruncate(fd, 0) || ftruncate(fd, size))) {
+		uwsgi_error("[prometheus] ftruncate()");
+		uwsgi_exit(1);
+	}
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		uwsgi_error("[prometheus] mmap()");
+		uwsgi_exit(1);
+	}
+	header = (struct prometheus_state_header *) base;
+	reuse = reuse && !memcmp(header->magic, PROMETHEUS_STATE_MAGIC, 8) && header->layout == layout && header->size == size;
+	if (!reuse) {
+		// the header goes last: an interrupted start leaves no valid header
+		memset(base, 0, size);
+		header->layout = layout;
+		header->size = size;
+		memcpy(header->magic, PROMETHEUS_STATE_MAGIC, 8);
+	}
+	uwsgi_log("[prometheus] state: %s counters in %s\n", reuse ? "restored" : "new", ump_config.state);
+	return (uint64_t *)(base + PROMETHEUS_CACHELINE);
+}
+
+/*
+ * Families reading their shards themselves (e.g. the sub-sketches of a
+ * quantile sketch) keep those slots out of the scrape time sum. Adjacent
+ * ranges are merged, so without such families this is a single range.
+ */
+static void prometheus_registry_range_add(uint32_t slot, uint32_t cnt) {
+	struct prometheus_registry *reg = &prometheus_registry;
+	if (cnt == 0) return;
+	if (reg->ranges_cnt > 0) {
+		struct prometheus_registry_range *last = &reg->ranges[reg->ranges_cnt - 1];
+		if (last->slot + last->cnt == slot) {
+			last->cnt += cnt;
+			return;
+		}
+	}
+	reg->ranges = realloc(reg->ranges, sizeof(struct prometheus_registry_range) * (reg->ranges_cnt + 1));
+	if (!reg->ranges) {
+		uwsgi_error("[prometheus] realloc()");
+		uwsgi_exit(1);
+	}
+	reg->ranges[reg->ranges_cnt].slot = slot;
+	reg->ranges[reg->ranges_cnt].cnt = cnt;
+	reg->ranges_cnt++;
+}
+
+/*
+ * Called from post_init, before workers are forked, once every feature has
+ * declared its families.
+ */
+static void prometheus_registry_allocate(void) {
+	struct prometheus_registry *reg = &prometheus_registry;
+	uint32_t i, j;
+	if (reg->families_cnt == 0) return;
+
+	const char *prefix = prometheus_prefix();
+	struct uwsgi_buffer *labels = uwsgi_buffer_new(256);
+
+	for (i = 0; i < reg->families_cnt; i++) {
+		struct prometheus_registry_family *rf = &reg->families[i];
+		rf->full_name = uwsgi_concat2((char *)prefix, rf->name);
+		rf->full_name_len = strlen(rf->full_name);
+		rf->header = prometheus_render_header(rf->full_name, rf->full_name_len, rf->help, strlen(rf->help),
+		                                      prometheus_type_name(rf->type), &rf->header_len);
+		if (!rf->render) rf->render = prometheus_registry_render_default;
+		if (!rf->render_pb) rf->render_pb = prometheus_registry_render_pb_default;
+		if (ump_config.native_histograms) {
+			rf->pb_header = prometheus_pb_header(rf->full_name, rf->full_name_len, rf->help, strlen(rf->help), rf->type, &rf->pb_header_len);
+			if (!rf->pb_header) uwsgi_exit(1);
+		}
+		for (j = 0; j < rf->series_cnt; j++) {
+			struct prometheus_registry_series *rs = &rf->series[j];
+			labels->pos = 0;
+			if (uwsgi_buffer_append(labels, rs->labels, strlen(rs->labels)) || prometheus_const_labels_splice(labels)) {
+				uwsgi_log("[prometheus] ERROR: unable to render registry labels\n");
+				uwsgi_exit(1);
+			}
+			rs->line = prometheus_render_line(rf->full_name, rf->full_name_len, labels->buf, labels->pos, &rs->line_len);
+			if (ump_config.native_histograms) {
+				rs->pb_labels = prometheus_pb_labels(labels->buf, labels->pos, &rs->pb_labels_len);
+				if (!rs->pb_labels) uwsgi_exit(1);
+			}
+			if (rf->prepare) rf->prepare(rf, rs, labels);
+			prometheus_registry_range_add(rs->slot, rf->totals && rf->totals < rs->slots ? rf->totals : rs->slots);
+		}
+	}
+	uwsgi_buffer_destroy(labels);
+
+	reg->stride = ((reg->slots * sizeof(uint64_t)) + (PROMETHEUS_CACHELINE - 1)) & ~((size_t) PROMETHEUS_CACHELINE - 1);
+	// families without slots (e.g. the scoreboard) still need base to be mapped
+	if (reg->stride == 0) reg->stride = PROMETHEUS_CACHELINE;
+	reg->shards = (uwsgi.numproc + 1) * uwsgi.cores;
+	reg->base = ump_config.state ? prometheus_state_map(reg) : uwsgi_calloc_shared(reg->stride * reg->shards);
+
+	uwsgi_log("[prometheus] registry: %u slots, %u shards, %llu bytes of shared memory\n",
+	          reg->slots, reg->shards, (unsigned long long)(reg->stride * reg->shards));
+}
+
+/*
+ * Sum every shard into totals[]. Shards are contiguous and the inner loop is
+ * a straight vector add over each summed range; slots outside of them stay
+ * zero.
+ */
+static void prometheus_registry_sum(uint64_t *totals) {
+	struct prometheus_registry *reg = &prometheus_registry;
+	uint32_t i, r, slot;
+	memset(totals, 0, sizeof(uint64_t) * reg->slots);
+	for (i = 0; i < reg->shards; i++) {
+		uint64_t *shard = (uint64_t *)((char *)reg->base + (i * reg->stride));
+		for (r = 0; r < reg->ranges_cnt; r++) {
+			uint32_t end = reg->ranges[r].slot + reg->ranges[r].cnt;
+			for (slot = reg->ranges[r].slot; slot < end; slot++) {
+				totals[slot] += __atomic_load_n(&shard[slot], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+/*
+ * ===========================================================================
+ * HISTOGRAMS
+ * ===========================================================================
+ */
+
+/*
+ * Fixed-bucket histograms on top of the registry. A series uses
+ * buckets_cnt + 2 slots:
+ *
+ *   [0 .. buckets_cnt - 1]  observations <= bounds[i] (not cumulative)
+ *   [buckets_cnt]           +Inf bucket
+ *   [buckets_cnt + 1]       sum of observations, in integer units
+ *
+ * Recording is a binary search plus two shard increments. Buckets are made
+ * cumulative and _count is derived at scrape time.
+ *
+ * With native buckets enabled the series is followed by a zero bucket and a
+ * dense window of exponential buckets (see prometheus_exp_buckets_init()).
+ * The window is fixed at allocation so the shard layout never changes;
+ * sparseness only exists on the wire, where empty buckets are skipped.
+ */
+struct prometheus_exp_buckets {
+	int schema;                 // -1 when disabled
+	double *bounds;             // 2^schema fractions of a power of two, in [0.5, 1)
+	int32_t min;                // bucket index of the first slot of the window
+	uint32_t cnt;
+};
+
+struct prometheus_histogram {
+	uint32_t buckets_cnt;
+	uint64_t *bounds;           // upper bounds in observation units
+	double *upper;              // upper bounds in exported units (protobuf)
+	char **le;                  // "le" label values, as configured
+	uint64_t scale;             // observation units per exported unit (power of ten)
+	struct prometheus_exp_buckets native;
+};
+
+#define PROMETHEUS_DEFAULT_BUCKETS "0.005,0.01,0.025,0.05,0.1,0.25,0.5,1,2.5,5,10"
+
+/*
+ * Parse an ascending comma separated list of bounds (in exported units,
+ * e.g. seconds) into a histogram recording in units of 1/scale. A NULL
+ * spec gives a histogram with only the +Inf bucket.
+ */
+static struct prometheus_histogram *prometheus_histogram_new(const char *spec, uint64_t scale) {
+	struct prometheus_histogram *h = uwsgi_calloc(sizeof(struct prometheus_histogram));
+	h->scale = scale;
+	h->native.schema = -1;
+	if (!spec) return h;
+
+	char *list = uwsgi_str((char *)spec);
+	char *ctx = NULL;
+	char *p = strtok_r(list, ",", &ctx);
+	while (p) {
+		size_t len = strlen(p);
+		p = prometheus_trim(p, &len);
+		p[len] = 0;
+		char *end = NULL;
+		double bound = strtod(p, &end);
+		if (len == 0 || !end || *end || bound < 0) {
+			uwsgi_log("[prometheus] ERROR: invalid histogram bucket '%s'\n", p);
+			uwsgi_exit(1);
+		}
+		uint64_t ubound = (uint64_t)((bound * scale) + 0.5);
+		if (h->buckets_cnt > 0 && ubound <= h->bounds[h->buckets_cnt - 1]) {
+			uwsgi_log("[prometheus] ERROR: histogram buckets must be ascending ('%s')\n", spec);
+			uwsgi_exit(1);
+		}
+		h->bounds = realloc(h->bounds, sizeof(uint64_t) * (h->buckets_cnt + 1));
+		h->upper = realloc(h->upper, sizeof(double) * (h->buckets_cnt + 1));
+		h->le = realloc(h->le, sizeof(char *) * (h->buckets_cnt + 1));
+		if (!h->bounds || !h->upper || !h->le) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+		h->bounds[h->buckets_cnt] = ubound;
+		h->upper[h->buckets_cnt] = bound;
+		h->le[h->buckets_cnt] = uwsgi_str(p);
+		h->buckets_cnt++;
+		p = strtok_r(NULL, ",", &ctx);
+	}
+	free(list);
+	if (h->buckets_cnt == 0) {
+		uwsgi_log("[prometheus] ERROR: empty histogram bucket list\n");
+		uwsgi_exit(1);
+	}
+	return h;
+}
+
+/*
+ * Native bucket index of v, as defined by Prometheus: bucket i covers
+ * (base^(i-1), base^i] with base = 2^(2^-schema). frexp() splits v into
+ * frac * 2^exp and the fraction is looked up among the 2^schema bounds.
+ */
+static inline int32_t prometheus_exp_index(struct prometheus_exp_buckets *eb, double v) {
+	int exp;
+	double frac = frexp(v, &exp);
+	uint32_t n = 1 << eb->schema;
+	uint32_t lo = 0, hi = n;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (eb->bounds[mid] < frac) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (int32_t) lo + ((exp - 1) * (int32_t) n);
+}
+
+/*
+ * Window of buckets covering one observation unit (1/scale) up to 2^max_exp
+ * exported units. Observations outside of it land in the edge buckets.
+ */
+static void prometheus_exp_buckets_init(struct prometheus_exp_buckets *eb, int schema, uint64_t scale, int max_exp) {
+	uint32_t i, n = 1 << schema;
+	eb->schema = schema;
+	eb->bounds = uwsgi_malloc(sizeof(double) * n);
+	for (i = 0; i < n; i++) {
+		eb->bounds[i] = exp2(((double) i / n) - 1);
+	}
+	eb->min = prometheus_exp_index(eb, 1.0 / scale);
+	eb->cnt = (uint32_t)((max_exp * (int32_t) n) - eb->min + 1);
+}
+
+// position of a positive observation inside the window
+static inline uint32_t prometheus_exp_offset(struct prometheus_exp_buckets *eb, uint64_t value, uint64_t scale) {
+	int32_t index = prometheus_exp_index(eb, (double) value / scale) - eb->min;
+	if (index < 0) return 0;
+	if ((uint32_t) index >= eb->cnt) return eb->cnt - 1;
+	return (uint32_t) index;
+}
+
+static inline uint32_t prometheus_histogram_slots(struct prometheus_histogram *h) {
+	return h->buckets_cnt + 2 + (h->native.schema >= 0 ? 1 + h->native.cnt : 0);
+}
+
+static inline void prometheus_histogram_observe(struct prometheus_histogram *h, uint64_t *shard, uint32_t slot, uint64_t value) {
+	uint32_t lo = 0, hi = h->buckets_cnt;
+	// first bound >= value, buckets_cnt (+Inf) if none
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (h->bounds[mid] < value) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	prometheus_shard_add(shard, slot + lo, 1);
+	prometheus_shard_add(shard, slot + h->buckets_cnt + 1, value);
+
+	if (h->native.schema < 0) return;
+	// zero bucket, then the native window
+	uint32_t native = slot + h->buckets_cnt + 2;
+	if (value > 0) {
+		native += 1 + prometheus_exp_offset(&h->native, value, h->scale);
+	}
+	prometheus_shard_add(shard, native, 1);
+}
+
+// "name<suffix>{labels,key="value"} ", key is "le" for buckets and "quantile" for summaries
+static char *prometheus_histogram_line(struct prometheus_registry_family *rf, const char *suffix, struct uwsgi_buffer *labels,
+                                       const char *key, const char *value, size_t *len) {
+	struct uwsgi_buffer *ub = uwsgi_buffer_new(rf->full_name_len + labels->pos + 64);
+	if (uwsgi_buffer_append(ub, rf->full_name, rf->full_name_len)) goto error;
+	if (uwsgi_buffer_append(ub, (char *)suffix, strlen(suffix))) goto error;
+	if (labels->pos > 0 || value) {
+		if (uwsgi_buffer_append(ub, (char *)"{", 1)) goto error;
+		if (uwsgi_buffer_append(ub, labels->buf, labels->pos)) goto error;
+		if (value) {
+			if (labels->pos > 0 && uwsgi_buffer_append(ub, (char *)",", 1)) goto error;
+			if (uwsgi_buffer_append(ub, (char *)key, strlen(key))) goto error;
+			if (uwsgi_buffer_append(ub, (char *)"=\"", 2)) goto error;
+			if (uwsgi_buffer_append(ub, (char *)value, strlen(value))) goto error;
+			if (uwsgi_buffer_append(ub, (char *)"\"", 1)) goto error;
+		}
+		if (uwsgi_buffer_append(ub, (char *)"}", 1)) goto error;
+	}
+	if (uwsgi_buffer_append(ub, (char *)" ", 1)) goto error;
+	char *line = ub->buf;
+	*len = ub->pos;
+	free(ub);
+	return line;
+
+error:
+	uwsgi_log("[prometheus] ERROR: unable to render histogram line\n");
+	uwsgi_exit(1);
+}
+
+// lines: one per bucket, +Inf, _sum, _count
+static void prometheus_histogram_prepare(struct prometheus_registry_family *rf, struct prometheus_registry_series *rs, struct uwsgi_buffer *labels) {
+	struct prometheus_histogram *h = (struct prometheus_histogram *) rf->data;
+	uint32_t i, lines = h->buckets_cnt + 3;
+	rs->lines = uwsgi_calloc(sizeof(char *) * lines);
+	rs->lines_len = uwsgi_calloc(sizeof(size_t) * lines);
+	for (i = 0; i < h->buckets_cnt; i++) {
+		rs->lines[i] = prometheus_histogram_line(rf, "_bucket", labels, "le", h->le[i], &rs->lines_len[i]);
+	}
+	rs->lines[i] = prometheus_histogram_line(rf, "_bucket", labels, "le", "+Inf", &rs->lines_len[i]);
+	i++;
+	rs->lines[i] = prometheus_histogram_line(rf, "_sum", labels, NULL, NULL, &rs->lines_len[i]);
+	i++;
+	rs->lines[i] = prometheus_histogram_line(rf, "_count", labels, NULL, NULL, &rs->lines_len[i]);
+}
+
+/*
+ * Exact decimal rendering of value / scale for power-of-ten scales
+ * (e.g. microseconds as seconds), without going through a double.
+ */
+static int prometheus_buffer_append_scaled(struct uwsgi_buffer *ub, uint64_t value, uint64_t scale) {
+	char num[64];
+	uint64_t frac = value % scale;
+	int len = snprintf(num, sizeof(num), "%llu", (unsigned long long)(value / scale));
+	if (frac > 0) {
+		int digits = 0;
+		uint64_t s;
+		for (s = scale; s > 1; s /= 10) digits++;
+		len += snprintf(num + len, sizeof(num) - len, ".%0*llu", digits, (unsigned long long) frac);
+		while (num[len - 1] == '0') len--;
+	}
+	if (len <= 0 || (size_t) len >= sizeof(num)) return -1;
+	return uwsgi_buffer_append(ub, num, len);
+}
+
+static int prometheus_histogram_render(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	struct prometheus_histogram *h = (struct prometheus_histogram *) rf->data;
+	struct uwsgi_buffer *ub = ctx->body;
+	uint32_t i, j;
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		uint64_t *slots = totals + rs->slot;
+		uint64_t cumulative = 0;
+		for (j = 0; j <= h->buckets_cnt; j++) {
+			cumulative += slots[j];
+			if (uwsgi_buffer_append(ub, rs->lines[j], rs->lines_len[j])) return -1;
+			if (uwsgi_buffer_num64(ub, cumulative)) return -1;
+			if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+		}
+		if (uwsgi_buffer_append(ub, rs->lines[j], rs->lines_len[j])) return -1;
+		if (prometheus_buffer_append_scaled(ub, slots[h->buckets_cnt + 1], h->scale)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+		j++;
+		if (uwsgi_buffer_append(ub, rs->lines[j], rs->lines_len[j])) return -1;
+		if (uwsgi_buffer_num64(ub, cumulative)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Histogram message: classic buckets (without +Inf, implied by the count)
+ * and, when enabled, the native buckets as spans of non-empty buckets with
+ * delta-encoded counts.
+ *
+ *   Histogram  { 1: sample_count, 2: sample_sum, 3: repeated Bucket, 5: schema,
+ *                6: zero_threshold, 7: zero_count, 12: repeated BucketSpan,
+ *                13: packed positive_delta }
+ *   Bucket     { 1: cumulative_count, 2: upper_bound }
+ *   BucketSpan { 1: offset, 2: length }
+ */
+static int prometheus_histogram_encode(struct prometheus_histogram *h, uint64_t *slots, struct uwsgi_buffer *ub) {
+	uint32_t j;
+	uint64_t count = 0;
+	for (j = 0; j <= h->buckets_cnt; j++) {
+		count += slots[j];
+	}
+	if (prometheus_pb_uint(ub, 1, count)) return -1;
+	if (prometheus_pb_double(ub, 2, (double) slots[h->buckets_cnt + 1] / h->scale)) return -1;
+
+	uint64_t cumulative = 0;
+	for (j = 0; j < h->buckets_cnt; j++) {
+		cumulative += slots[j];
+		if (prometheus_pb_tag(ub, 3, PROMETHEUS_PB_BYTES)) return -1;
+		if (prometheus_pb_varint(ub, 1 + prometheus_pb_varint_len(cumulative) + 9)) return -1;
+		if (prometheus_pb_uint(ub, 1, cumulative)) return -1;
+		if (prometheus_pb_double(ub, 2, h->upper[j])) return -1;
+	}
+
+	struct prometheus_exp_buckets *eb = &h->native;
+	if (eb->schema < 0) return 0;
+
+	uint64_t *native = slots + h->buckets_cnt + 3;
+	if (prometheus_pb_uint(ub, 5, prometheus_pb_zigzag(eb->schema))) return -1;
+	if (prometheus_pb_double(ub, 6, 0)) return -1;
+	if (prometheus_pb_uint(ub, 7, slots[h->buckets_cnt + 2])) return -1;
+
+	// spans: runs of non-empty buckets, offsets relative to the previous run
+	int spans = 0;
+	size_t deltas_len = 0;
+	uint64_t prev = 0;
+	int32_t next = 0;
+	j = 0;
+	while (j < eb->cnt) {
+		if (!native[j]) {
+			j++;
+			continue;
+		}
+		uint32_t start = j;
+		for (; j < eb->cnt && native[j]; j++) {
+			deltas_len += prometheus_pb_varint_len(prometheus_pb_zigzag((int64_t)(native[j] - prev)));
+			prev = native[j];
+		}
+		int32_t index = eb->min + (int32_t) start;
+		uint64_t offset = prometheus_pb_zigzag(spans ? index - next : index);
+		if (prometheus_pb_tag(ub, 12, PROMETHEUS_PB_BYTES)) return -1;
+		if (prometheus_pb_varint(ub, 2 + prometheus_pb_varint_len(offset) + prometheus_pb_varint_len(j - start))) return -1;
+		if (prometheus_pb_uint(ub, 1, offset)) return -1;
+		if (prometheus_pb_uint(ub, 2, j - start)) return -1;
+		next = eb->min + (int32_t) j;
+		spans++;
+	}
+
+	if (!spans) {
+		// an empty span marks the histogram as native even without observations
+		if (prometheus_pb_tag(ub, 12, PROMETHEUS_PB_BYTES)) return -1;
+		if (prometheus_pb_varint(ub, 4)) return -1;
+		if (prometheus_pb_uint(ub, 1, 0)) return -1;
+		return prometheus_pb_uint(ub, 2, 0);
+	}
+
+	if (prometheus_pb_tag(ub, 13, PROMETHEUS_PB_BYTES)) return -1;
+	if (prometheus_pb_varint(ub, deltas_len)) return -1;
+	prev = 0;
+	for (j = 0; j < eb->cnt; j++) {
+		if (!native[j]) continue;
+		if (prometheus_pb_varint(ub, prometheus_pb_zigzag((int64_t)(native[j] - prev)))) return -1;
+		prev = native[j];
+	}
+	return 0;
+}
+
+static int prometheus_histogram_render_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	struct prometheus_histogram *h = (struct prometheus_histogram *) rf->data;
+	struct uwsgi_buffer *ub = ctx->pb_family;
+	struct uwsgi_buffer *value = ctx->pb_value;
+	uint32_t i;
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		value->pos = 0;
+		if (prometheus_histogram_encode(h, totals + rs->slot, value)) return -1;
+		if (prometheus_pb_tag(ub, 4, PROMETHEUS_PB_BYTES)) return -1;
+		if (prometheus_pb_varint(ub, rs->pb_labels_len + 1 + prometheus_pb_varint_len(value->pos) + value->pos)) return -1;
+		if (uwsgi_buffer_append(ub, rs->pb_labels, rs->pb_labels_len)) return -1;
+		if (prometheus_pb_bytes(ub, 7, value->buf, value->pos)) return -1;
+	}
+	return 0;
+}
+
+static uint32_t prometheus_histogram_family_new(const char *name, const char *help, struct prometheus_histogram *h) {
+	uint32_t family = prometheus_registry_family_new(name, help, PROMETHEUS_TYPE_HISTOGRAM, prometheus_histogram_render, h);
+	prometheus_registry.families[family].prepare = prometheus_histogram_prepare;
+	prometheus_registry.families[family].render_pb = prometheus_histogram_render_pb;
+	return family;
+}
+
+/*
+ * ===========================================================================
+ * QUANTILE SKETCHES
+ * ===========================================================================
+ */
+
+/*
+ * Sliding-window quantiles, exported as a summary.
+ *
+ * The sketch reuses the exponential buckets of native histograms. With
+ * gamma = 2^(2^-schema), reporting bucket i as 2 * gamma^i / (gamma + 1)
+ * is off by at most (gamma - 1) / (gamma + 1) relative to any value in the
+ * bucket (this is DDSketch), and sketches merge by adding bucket counters.
+ * A series uses:
+ *
+ *   [0]  sum of observations (cumulative, in integer units)
+ *   [1]  count of observations (cumulative)
+ *   then PROMETHEUS_SKETCH_ROTATIONS sub-sketches: [epoch + 1] [zero] [buckets...]
+ *
+ * Sub-sketch r holds the observations of the periods with epoch % ROTATIONS
+ * == r. The core owning the shard clears a sub-sketch when it reuses it for
+ * a new period; the exporter skips sub-sketches that fell out of the window,
+ * which also takes care of idle workers.
+ */
+#define PROMETHEUS_SKETCH_ROTATIONS 5
+#define PROMETHEUS_SKETCH_ACCURACY 0.02
+
+struct prometheus_sketch {
+	struct prometheus_exp_buckets buckets;
+	double gamma;
+	uint64_t scale;             // observation units per exported unit
+	uint64_t period;            // lifetime of a sub-sketch, in microseconds
+	uint32_t quantiles_cnt;
+	double *quantiles;
+	char **quantile_labels;     // "quantile" label values, as configured
+};
+
+/*
+ * The schema is the coarsest one meeting the requested relative accuracy,
+ * the bucket window covers one observation unit up to 2^max_exp.
+ */
+static struct prometheus_sketch *prometheus_sketch_new(const char *quantiles, double accuracy, int window, uint64_t scale, int max_exp) {
+	struct prometheus_sketch *sk = uwsgi_calloc(sizeof(struct prometheus_sketch));
+	char *list = uwsgi_str((char *)quantiles);
+	char *ctx = NULL;
+	char *p = strtok_r(list, ",", &ctx);
+	while (p) {
+		size_t len = strlen(p);
+		p = prometheus_trim(p, &len);
+		p[len] = 0;
+		char *end = NULL;
+		double q = strtod(p, &end);
+		if (len == 0 || !end || *end || q < 0 || q > 1) {
+			uwsgi_log("[prometheus] ERROR: invalid quantile '%s' (expected a value between 0 and 1)\n", p);
+			uwsgi_exit(1);
+		}
+		sk->quantiles = realloc(sk->quantiles, sizeof(double) * (sk->quantiles_cnt + 1));
+		sk->quantile_labels = realloc(sk->quantile_labels, sizeof(char *) * (sk->quantiles_cnt + 1));
+		if (!sk->quantiles || !sk->quantile_labels) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+		sk->quantiles[sk->quantiles_cnt] = q;
+		sk->quantile_labels[sk->quantiles_cnt] = uwsgi_str(p);
+		sk->quantiles_cnt++;
+		p = strtok_r(NULL, ",", &ctx);
+	}
+	free(list);
+	if (sk->quantiles_cnt == 0) {
+		uwsgi_log("[prometheus] ERROR: empty quantile list\n");
+		uwsgi_exit(1);
+	}
+
+	if (accuracy <= 0 || accuracy >= 1) {
+		uwsgi_log("[prometheus] ERROR: quantile accuracy must be between 0 and 1\n");
+		uwsgi_exit(1);
+	}
+	int schema;
+	for (schema = 0; schema <= 8; schema++) {
+		double gamma = exp2(exp2(-schema));
+		if ((gamma - 1) / (gamma + 1) <= accuracy) break;
+	}
+	if (schema > 8) {
+		// native histogram schemas stop at 8
+		uwsgi_log("[prometheus] ERROR: quantile accuracy must be at least 0.00136\n");
+		uwsgi_exit(1);
+	}
+	prometheus_exp_buckets_init(&sk->buckets, schema, scale, max_exp);
+	sk->gamma = exp2(exp2(-schema));
+	sk->scale = scale;
+
+	if (window < PROMETHEUS_SKETCH_ROTATIONS) {
+		uwsgi_log("[prometheus] ERROR: quantile window must be at least %d seconds\n", PROMETHEUS_SKETCH_ROTATIONS);
+		uwsgi_exit(1);
+	}
+	sk->period = ((uint64_t) window * 1000000) / PROMETHEUS_SKETCH_ROTATIONS;
+	return sk;
+}
+
+static inline uint32_t prometheus_sketch_slots(struct prometheus_sketch *sk) {
+	return 2 + (PROMETHEUS_SKETCH_ROTATIONS * (sk->buckets.cnt + 2));
+}
+
+static inline void prometheus_sketch_observe(struct prometheus_sketch *sk, uint64_t *shard, uint32_t slot, uint64_t value, uint64_t now) {
+	uint64_t epoch = now / sk->period;
+	uint64_t *sub = shard + slot + 2 + ((epoch % PROMETHEUS_SKETCH_ROTATIONS) * (sk->buckets.cnt + 2));
+	if (sub[0] != epoch + 1) {
+		uint32_t i;
+		for (i = 1; i < sk->buckets.cnt + 2; i++) {
+			__atomic_store_n(&sub[i], 0, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&sub[0], epoch + 1, __ATOMIC_RELAXED);
+	}
+	prometheus_shard_add(shard, slot, value);
+	prometheus_shard_add(shard, slot + 1, 1);
+	prometheus_shard_add(sub, value > 0 ? 2 + prometheus_exp_offset(&sk->buckets, value, sk->scale) : 1, 1);
+}
+
+/*
+ * Merge the live sub-sketches of every shard and evaluate the configured
+ * quantiles into out[] (NaN without observations in the window).
+ */
+static int prometheus_sketch_quantiles(struct prometheus_sketch *sk, struct prometheus_registry_series *rs,
+                                       struct prometheus_scrape_ctx *ctx, double *out) {
+	struct prometheus_registry *reg = &prometheus_registry;
+	uint32_t cnt = sk->buckets.cnt + 1;
+	uint64_t *merged = prometheus_arena_alloc(&ctx->arena, sizeof(uint64_t) * cnt);
+	if (!merged) return -1;
+	memset(merged, 0, sizeof(uint64_t) * cnt);
+
+	uint64_t epoch = uwsgi_micros() / sk->period;
+	uint64_t total = 0;
+	uint32_t i, r, b;
+	for (i = 0; i < reg->shards; i++) {
+		uint64_t *series = (uint64_t *)((char *)reg->base + (i * reg->stride)) + rs->slot + 2;
+		for (r = 0; r < PROMETHEUS_SKETCH_ROTATIONS; r++) {
+			uint64_t *sub = series + (r * (cnt + 1));
+			uint64_t tag = __atomic_load_n(&sub[0], __ATOMIC_RELAXED);
+			if (tag == 0 || tag - 1 + PROMETHEUS_SKETCH_ROTATIONS <= epoch) continue;
+			for (b = 0; b < cnt; b++) {
+				uint64_t n = __atomic_load_n(&sub[1 + b], __ATOMIC_RELAXED);
+				merged[b] += n;
+				total += n;
+			}
+		}
+	}
+
+	uint32_t n = 1 << sk->buckets.schema;
+	for (i = 0; i < sk->quantiles_cnt; i++) {
+		if (total == 0) {
+			out[i] = NAN;
+			continue;
+		}
+		double rank = sk->quantiles[i] * (total - 1);
+		uint64_t cumulative = 0;
+		for (b = 0; b < cnt - 1; b++) {
+			cumulative += merged[b];
+			if (cumulative > rank) break;
+		}
+		// slot 0 is the zero bucket
+		out[i] = b == 0 ? 0 : exp2((double)(sk->buckets.min + (int32_t) b - 1) / n) * 2 / (1 + sk->gamma);
+	}
+	return 0;
+}
+
+static int prometheus_buffer_append_double(struct uwsgi_buffer *ub, double value) {
+	char num[32];
+	if (isnan(value)) return uwsgi_buffer_append(ub, (char *)"NaN", 3);
+	int len = snprintf(num, sizeof(num), "%.6g", value);
+	if (len <= 0 || (size_t) len >= sizeof(num)) return -1;
+	return uwsgi_buffer_append(ub, num, len);
+}
+
+// lines: one per quantile, _sum, _count
+static void prometheus_sketch_prepare(struct prometheus_registry_family *rf, struct prometheus_registry_series *rs, struct uwsgi_buffer *labels) {
+	struct prometheus_sketch *sk = (struct prometheus_sketch *) rf->data;
+	uint32_t i, lines = sk->quantiles_cnt + 2;
+	rs->lines = uwsgi_calloc(sizeof(char *) * lines);
+	rs->lines_len = uwsgi_calloc(sizeof(size_t) * lines);
+	for (i = 0; i < sk->quantiles_cnt; i++) {
+		rs->lines[i] = prometheus_histogram_line(rf, "", labels, "quantile", sk->quantile_labels[i], &rs->lines_len[i]);
+	}
+	rs->lines[i] = prometheus_histogram_line(rf, "_sum", labels, NULL, NULL, &rs->lines_len[i]);
+	i++;
+	rs->lines[i] = prometheus_histogram_line(rf, "_count", labels, NULL, NULL, &rs->lines_len[i]);
+}
+
+static int prometheus_sketch_render(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	struct prometheus_sketch *sk = (struct prometheus_sketch *) rf->data;
+	struct uwsgi_buffer *ub = ctx->body;
+	double *values = prometheus_arena_alloc(&ctx->arena, sizeof(double) * sk->quantiles_cnt);
+	uint32_t i, j;
+	if (!values) return -1;
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (prometheus_sketch_quantiles(sk, rs, ctx, values)) return -1;
+		for (j = 0; j < sk->quantiles_cnt; j++) {
+			if (uwsgi_buffer_append(ub, rs->lines[j], rs->lines_len[j])) return -1;
+			if (prometheus_buffer_append_double(ub, values[j])) return -1;
+			if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+		}
+		if (uwsgi_buffer_append(ub, rs->lines[j], rs->lines_len[j])) return -1;
+		if (prometheus_buffer_append_scaled(ub, totals[rs->slot], sk->scale)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+		j++;
+		if (uwsgi_buffer_append(ub, rs->lines[j], rs->lines_len[j])) return -1;
+		if (uwsgi_buffer_num64(ub, totals[rs->slot + 1])) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+	}
+	return 0;
+}
+
+/*
+ *   Summary  { 1: sample_count, 2: sample_sum, 3: repeated Quantile }
+ *   Quantile { 1: quantile, 2: value }
+ */
+static int prometheus_sketch_render_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	struct prometheus_sketch *sk = (struct prometheus_sketch *) rf->data;
+	struct uwsgi_buffer *ub = ctx->pb_family;
+	struct uwsgi_buffer *value = ctx->pb_value;
+	double *values = prometheus_arena_alloc(&ctx->arena, sizeof(double) * sk->quantiles_cnt);
+	uint32_t i, j;
+	if (!values) return -1;
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (prometheus_sketch_quantiles(sk, rs, ctx, values)) return -1;
+		value->pos = 0;
+		if (prometheus_pb_uint(value, 1, totals[rs->slot + 1])) return -1;
+		if (prometheus_pb_double(value, 2, (double) totals[rs->slot] / sk->scale)) return -1;
+		for (j = 0; j < sk->quantiles_cnt; j++) {
+			if (prometheus_pb_tag(value, 3, PROMETHEUS_PB_BYTES)) return -1;
+			if (prometheus_pb_varint(value, 18)) return -1;
+			if (prometheus_pb_double(value, 1, sk->quantiles[j])) return -1;
+			if (prometheus_pb_double(value, 2, values[j])) return -1;
+		}
+		if (prometheus_pb_tag(ub, 4, PROMETHEUS_PB_BYTES)) return -1;
+		if (prometheus_pb_varint(ub, rs->pb_labels_len + 1 + prometheus_pb_varint_len(value->pos) + value->pos)) return -1;
+		if (uwsgi_buffer_append(ub, rs->pb_labels, rs->pb_labels_len)) return -1;
+		if (prometheus_pb_bytes(ub, 4, value->buf, value->pos)) return -1;
+	}
+	return 0;
+}
+
+static uint32_t prometheus_sketch_family_new(const char *name, const char *help, struct prometheus_sketch *sk) {
+	uint32_t family = prometheus_registry_family_new(name, help, PROMETHEUS_TYPE_SUMMARY, prometheus_sketch_render, sk);
+	prometheus_registry.families[family].prepare = prometheus_sketch_prepare;
+	prometheus_registry.families[family].render_pb = prometheus_sketch_render_pb;
+	// sum and count only, the render merges the sub-sketches itself
+	prometheus_registry.families[family].totals = 2;
+	return family;
+}
+
+/*
+ * ===========================================================================
+ * HEAVY HITTERS
+ * ===========================================================================
+ */
+
+/*
+ * Top-K request paths and clients, by count, with the Space-Saving
+ * algorithm: a table of `capacity` counters where a new key evicts the
+ * smallest counter and inherits its count as overestimation (error).
+ * Any key with more than total / capacity hits is guaranteed to be in the
+ * table, so capacity is a multiple of K.
+ *
+ * Every core owns a table in shared memory (no locks, no atomic RMW).
+ * Tables alternate between two windows, so the exporter always sees the
+ * previous window plus the current one; the owner clears a table when it
+ * reuses it. Evicting rewrites the key, which is guarded by a per-entry
+ * sequence counter: readers skip entries being rewritten.
+ *
+ * Only the owner looks keys up, through an open-addressing index (linear
+ * probing) after the entries, and finds the smallest counter at the root of
+ * a min-heap of the entries by count: a request costs O(1) plus O(log K)
+ * instead of a scan of every counter.
+ */
+#define PROMETHEUS_TOPK_KEY 96
+#define PROMETHEUS_TOPK_CAPACITY 4      // counters per reported key
+#define PROMETHEUS_TOPK_MAX 100
+
+struct prometheus_topk_entry {
+	uint32_t seq;               // odd while the owner rewrites the key
+	uint32_t key_len;
+	uint64_t hash;
+	uint64_t count;
+	uint64_t error;
+	uint64_t time;              // microseconds
+	char key[PROMETHEUS_TOPK_KEY];
+};
+
+struct prometheus_topk_table {
+	uint64_t epoch;             // window + 1, 0 while being cleared
+	uint32_t used;
+	struct prometheus_topk_entry entries[];
+};
+
+struct prometheus_topk {
+	uint32_t id;                // slot in the scrape context
+	const char *name;           // "paths", "clients"
+	const char *label;          // "path", "client"
+	uint32_t k;
+	uint32_t capacity;
+	uint32_t index_mask;        // index slots - 1, a power of two >= 2 * capacity
+	uint64_t period;            // window, in microseconds
+	size_t table_size;
+	char *base;                 // shared memory, two tables per shard
+};
+
+static struct prometheus_topk prometheus_topk_paths = {0, "paths", "path", 0, 0, 0, 0, 0, NULL};
+static struct prometheus_topk prometheus_topk_clients = {1, "clients", "client", 0, 0, 0, 0, 0, NULL};
+
+// a merged key, as seen by the exporter
+struct prometheus_topk_item {
+	uint64_t hash;
+	uint64_t count;
+	uint64_t error;
+	uint64_t time;
+	uint32_t key_len;
+	char key[PROMETHEUS_TOPK_KEY];
+};
+
+static inline struct prometheus_topk_table *prometheus_topk_table(struct prometheus_topk *t, uint32_t shard, uint64_t epoch) {
+	return (struct prometheus_topk_table *)(t->base + ((((size_t) shard * 2) + (epoch & 1)) * t->table_size));
+}
+
+/*
+ * Owner-only data after the entries: heap[capacity] (entries by count, the
+ * smallest first), pos[capacity] (position of every entry in heap) and
+ * index[index_mask + 1] (entry + 1, 0 for an empty slot).
+ */
+static inline uint16_t *prometheus_topk_heap(struct prometheus_topk *t, struct prometheus_topk_table *table) {
+	return (uint16_t *) &table->entries[t->capacity];
+}
+
+static inline uint32_t prometheus_topk_home(struct prometheus_topk *t, uint64_t hash) {
+	return (uint32_t)(hash ^ (hash >> 32)) & t->index_mask;
+}
+
+// index slot of key, or the empty slot where it goes
+static uint32_t prometheus_topk_find(struct prometheus_topk *t, struct prometheus_topk_table *table, uint64_t hash, const char *key, size_t key_len) {
+	uint16_t *index = prometheus_topk_heap(t, table) + (t->capacity * 2);
+	uint32_t slot = prometheus_topk_home(t, hash);
+	while (index[slot]) {
+		struct prometheus_topk_entry *e = &table->entries[index[slot] - 1];
+		if (e->hash == hash && e->key_len == key_len && !memcmp(e->key, key, key_len)) break;
+		slot = (slot + 1) & t->index_mask;
+	}
+	return slot;
+}
+
+// remove the key of entry from the index, moving back the keys that probed past it
+static void prometheus_topk_unindex(struct prometheus_topk *t, struct prometheus_topk_table *table, struct prometheus_topk_entry *e) {
+	uint16_t *index = prometheus_topk_heap(t, table) + (t->capacity * 2);
+	uint32_t i = prometheus_topk_find(t, table, e->hash, e->key, e->key_len), j = i;
+	for (;;) {
+		j = (j + 1) & t->index_mask;
+		if (!index[j]) break;
+		uint32_t home = prometheus_topk_home(t, table->entries[index[j] - 1].hash);
+		// home in (i, j]: the key is still reachable from there
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+		index[i] = index[j];
+		i = j;
+	}
+	index[i] = 0;
+}
+
+static void prometheus_topk_swap(uint16_t *heap, uint16_t *pos, uint32_t a, uint32_t b) {
+	uint16_t tmp = heap[a];
+	heap[a] = heap[b];
+	heap[b] = tmp;
+	pos[heap[a]] = a;
+	pos[heap[b]] = b;
+}
+
+// restore the heap order of position i, among used entries
+static void prometheus_topk_sift(struct prometheus_topk *t, struct prometheus_topk_table *table, uint32_t i, uint32_t used) {
+	uint16_t *heap = prometheus_topk_heap(t, table), *pos = heap + t->capacity;
+	struct prometheus_topk_entry *entries = table->entries;
+	while (i > 0 && entries[heap[(i - 1) / 2]].count > entries[heap[i]].count) {
+		prometheus_topk_swap(heap, pos, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		uint32_t child = (i * 2) + 1, min = i;
+		if (child < used && entries[heap[child]].count < entries[heap[min]].count) min = child;
+		if (child + 1 < used && entries[heap[child + 1]].count < entries[heap[min]].count) min = child + 1;
+		if (min == i) break;
+		prometheus_topk_swap(heap, pos, i, min);
+		i = min;
+	}
+}
+
+static void prometheus_topk_observe(struct prometheus_topk *t, uint32_t shard, const char *key, size_t key_len, uint64_t time, uint64_t now) {
+	if (key_len > PROMETHEUS_TOPK_KEY) key_len = PROMETHEUS_TOPK_KEY;
+	uint64_t epoch = (now / t->period) + 1;
+	struct prometheus_topk_table *table = prometheus_topk_table(t, shard, epoch);
+	uint16_t *heap = prometheus_topk_heap(t, table), *pos = heap + t->capacity, *index = pos + t->capacity;
+	uint64_t hash = prometheus_hash(key, key_len);
+
+	if (table->epoch != epoch) {
+		__atomic_store_n(&table->epoch, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&table->used, 0, __ATOMIC_RELEASE);
+		memset(index, 0, sizeof(uint16_t) * (t->index_mask + 1));
+		__atomic_store_n(&table->epoch, epoch, __ATOMIC_RELEASE);
+	}
+
+	uint32_t used = table->used;
+	uint32_t slot = prometheus_topk_find(t, table, hash, key, key_len);
+	if (index[slot]) {
+		struct prometheus_topk_entry *e = &table->entries[index[slot] - 1];
+		__atomic_store_n(&e->count, e->count + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->time, e->time + time, __ATOMIC_RELAXED);
+		prometheus_topk_sift(t, table, pos[index[slot] - 1], used);
+		return;
+	}
+
+	uint64_t error = 0;
+	uint32_t entry;
+	if (used < t->capacity) {
+		entry = used;
+		heap[used] = entry;
+		pos[entry] = used;
+	} else {
+		// evict the smallest counter
+		entry = heap[0];
+		error = table->entries[entry].count;
+		prometheus_topk_unindex(t, table, &table->entries[entry]);
+		slot = prometheus_topk_find(t, table, hash, key, key_len);
+	}
+	struct prometheus_topk_entry *e = &table->entries[entry];
+
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(e->key, key, key_len);
+	e->key_len = key_len;
+	e->hash = hash;
+	e->error = error;
+	e->time = time;
+	__atomic_store_n(&e->count, error + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+	index[slot] = entry + 1;
+
+	if (used < t->capacity) {
+		prometheus_topk_sift(t, table, used, used + 1);
+		__atomic_store_n(&table->used, used + 1, __ATOMIC_RELEASE);
+	} else {
+		prometheus_topk_sift(t, table, 0, used);
+	}
+}
+
+static int prometheus_topk_cmp_hash(const void *a, const void *b) {
+	const struct prometheus_topk_item *x = a, *y = b;
+	if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	if (x->key_len != y->key_len) return x->key_len < y->key_len ? -1 : 1;
+	return memcmp(x->key, y->key, x->key_len);
+}
+
+static int prometheus_topk_cmp_count(const void *a, const void *b) {
+	const struct prometheus_topk_item *x = a, *y = b;
+	if (x->count != y->count) return x->count > y->count ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Merge the live tables of every shard (current and previous window) into
+ * the top K keys, most frequent first. Returns the number of keys. Done
+ * once per scrape: the requests and seconds families (and the JSON view)
+ * then rank the same keys from the same instant.
+ */
+static int prometheus_topk_merge(struct prometheus_topk *t, struct prometheus_scrape_ctx *ctx, struct prometheus_topk_item **out) {
+	if (ctx->topk[t->id]) {
+		*out = ctx->topk[t->id];
+		return ctx->topk_cnt[t->id];
+	}
+	uint32_t shards = (uwsgi.numproc + 1) * uwsgi.cores;
+	struct prometheus_topk_item *items = prometheus_arena_alloc(&ctx->arena, sizeof(struct prometheus_topk_item) * shards * 2 * t->capacity);
+	if (!items) return -1;
+
+	uint64_t epoch = (uwsgi_micros() / t->period) + 1;
+	uint32_t n = 0, i, w, j;
+	for (i = 0; i < shards; i++) {
+		for (w = 0; w < 2; w++) {
+			struct prometheus_topk_table *table = prometheus_topk_table(t, i, epoch - w);
+			uint64_t table_epoch = __atomic_load_n(&table->epoch, __ATOMIC_ACQUIRE);
+			uint32_t first = n;
+			if (table_epoch != epoch - w) continue;
+			uint32_t used = __atomic_load_n(&table->used, __ATOMIC_ACQUIRE);
+			for (j = 0; j < used && j < t->capacity; j++) {
+				struct prometheus_topk_entry *e = &table->entries[j];
+				struct prometheus_topk_item *item = &items[n];
+				uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+				if (seq & 1) continue;
+				item->key_len = e->key_len;
+				if (item->key_len > PROMETHEUS_TOPK_KEY) continue;
+				memcpy(item->key, e->key, item->key_len);
+				item->hash = e->hash;
+				item->error = e->error;
+				item->count = __atomic_load_n(&e->count, __ATOMIC_RELAXED);
+				item->time = __atomic_load_n(&e->time, __ATOMIC_RELAXED);
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue;
+				n++;
+			}
+			// the owner moved to a new window while we were reading the table
+			if (__atomic_load_n(&table->epoch, __ATOMIC_ACQUIRE) != table_epoch) n = first;
+		}
+	}
+
+	// same key from different shards and windows: add the counters up
+	qsort(items, n, sizeof(struct prometheus_topk_item), prometheus_topk_cmp_hash);
+	uint32_t merged = 0;
+	for (i = 0; i < n; i++) {
+		if (merged > 0 && !prometheus_topk_cmp_hash(&items[merged - 1], &items[i])) {
+			items[merged - 1].count += items[i].count;
+			items[merged - 1].error += items[i].error;
+			items[merged - 1].time += items[i].time;
+			continue;
+		}
+		if (merged != i) items[merged] = items[i];
+		merged++;
+	}
+
+	qsort(items, merged, sizeof(struct prometheus_topk_item), prometheus_topk_cmp_count);
+	*out = ctx->topk[t->id] = items;
+	ctx->topk_cnt[t->id] = merged < t->k ? merged : t->k;
+	return ctx->topk_cnt[t->id];
+}
+
+static int prometheus_topk_labels(struct uwsgi_buffer *ub, struct prometheus_topk *t, uint32_t rank, struct prometheus_topk_item *item) {
+	if (uwsgi_buffer_append(ub, (char *)"rank=\"", 6)) return -1;
+	if (uwsgi_buffer_num64(ub, rank)) return -1;
+	if (uwsgi_buffer_append(ub, (char *)"\",", 2)) return -1;
+	if (uwsgi_buffer_append(ub, (char *)t->label, strlen(t->label))) return -1;
+	if (uwsgi_buffer_append(ub, (char *)"=\"", 2)) return -1;
+	if (prometheus_escape_string(ub, item->key, item->key_len)) return -1;
+	if (uwsgi_buffer_append(ub, (char *)"\"", 1)) return -1;
+	if (ump_config.const_labels_block) {
+		if (uwsgi_buffer_append(ub, (char *)",", 1)) return -1;
+		if (uwsgi_buffer_append(ub, ump_config.const_labels_block, ump_config.const_labels_block_len)) return -1;
+	}
+	return 0;
+}
+
+/*
+ * The *_requests and *_seconds gauges share the render functions, the
+ * family's data pointing to the tracker and the seconds flag to the value.
+ */
+static int prometheus_topk_render_family(struct prometheus_registry_family *rf, struct prometheus_scrape_ctx *ctx, struct prometheus_topk *t, int seconds) {
+	struct uwsgi_buffer *ub = ctx->body;
+	struct prometheus_topk_item *items;
+	int i, cnt = prometheus_topk_merge(t, ctx, &items);
+	if (cnt < 0) return -1;
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	for (i = 0; i < cnt; i++) {
+		if (uwsgi_buffer_append(ub, rf->full_name, rf->full_name_len)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"{", 1)) return -1;
+		if (prometheus_topk_labels(ub, t, i + 1, &items[i])) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"} ", 2)) return -1;
+		if (seconds) {
+			if (prometheus_buffer_append_scaled(ub, items[i].time, 1000000)) return -1;
+		} else if (uwsgi_buffer_num64(ub, items[i].count)) {
+			return -1;
+		}
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+	}
+	return 0;
+}
+
+static int prometheus_pb_label(struct uwsgi_buffer *ub, const char *name, size_t name_len, const char *value, size_t value_len) {
+	size_t len = 2 + prometheus_pb_varint_len(name_len) + name_len + prometheus_pb_varint_len(value_len) + value_len;
+	if (prometheus_pb_tag(ub, 1, PROMETHEUS_PB_BYTES)) return -1;
+	if (prometheus_pb_varint(ub, len)) return -1;
+	if (prometheus_pb_bytes(ub, 1, name, name_len)) return -1;
+	return prometheus_pb_bytes(ub, 2, value, value_len);
+}
+
+static int prometheus_topk_render_family_pb(struct prometheus_registry_family *rf, struct prometheus_scrape_ctx *ctx, struct prometheus_topk *t, int seconds) {
+	struct uwsgi_buffer *labels = ctx->pb_value;
+	struct prometheus_topk_item *items;
+	char rank[11];
+	int i, cnt = prometheus_topk_merge(t, ctx, &items);
+	if (cnt < 0) return -1;
+	for (i = 0; i < cnt; i++) {
+		int rank_len = snprintf(rank, sizeof(rank), "%d", i + 1);
+		labels->pos = 0;
+		if (prometheus_pb_label(labels, "rank", 4, rank, rank_len)) return -1;
+		if (prometheus_pb_label(labels, t->label, strlen(t->label), items[i].key, items[i].key_len)) return -1;
+		if (uwsgi_buffer_append(labels, ump_config.const_labels_pb, ump_config.const_labels_pb_len)) return -1;
+		double value = seconds ? (double) items[i].time / 1000000 : (double) items[i].count;
+		if (prometheus_pb_metric_value(ctx->pb_family, labels->buf, labels->pos, UWSGI_METRIC_GAUGE, value)) return -1;
+	}
+	return 0;
+}
+
+static int prometheus_topk_render_requests(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	return prometheus_topk_render_family(rf, ctx, (struct prometheus_topk *) rf->data, 0);
+}
+
+static int prometheus_topk_render_seconds(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	return prometheus_topk_render_family(rf, ctx, (struct prometheus_topk *) rf->data, 1);
+}
+
+static int prometheus_topk_render_requests_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	return prometheus_topk_render_family_pb(rf, ctx, (struct prometheus_topk *) rf->data, 0);
+}
+
+static int prometheus_topk_render_seconds_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	return prometheus_topk_render_family_pb(rf, ctx, (struct prometheus_topk *) rf->data, 1);
+}
+
+static void prometheus_topk_declare(struct prometheus_topk *t) {
+	char name[64], help[128];
+	uint32_t family;
+
+	t->k = ump_config.topk;
+	t->capacity = t->k * PROMETHEUS_TOPK_CAPACITY;
+	t->index_mask = 1;
+	while (t->index_mask < t->capacity * 2) t->index_mask <<= 1;
+	t->index_mask--;
+	t->period = (uint64_t) ump_config.topk_window * 1000000;
+
+	snprintf(name, sizeof(name), "top_%s_requests", t->name);
+	snprintf(help, sizeof(help), "requests of the most frequent %s over the last one to two windows (upper bound)", t->name);
+	family = prometheus_registry_family_new(name, help, UWSGI_METRIC_GAUGE, prometheus_topk_render_requests, t);
+	prometheus_registry.families[family].render_pb = prometheus_topk_render_requests_pb;
+
+	snprintf(name, sizeof(name), "top_%s_seconds", t->name);
+	snprintf(help, sizeof(help), "time spent serving the most frequent %s over the last one to two windows", t->name);
+	family = prometheus_registry_family_new(name, help, UWSGI_METRIC_GAUGE, prometheus_topk_render_seconds, t);
+	prometheus_registry.families[family].render_pb = prometheus_topk_render_seconds_pb;
+}
+
+// the tables live outside of the registry: they are not summable counters
+static void prometheus_topk_allocate(struct prometheus_topk *t) {
+	uint32_t shards = (uwsgi.numproc + 1) * uwsgi.cores;
+	t->table_size = sizeof(struct prometheus_topk_table) + (sizeof(struct prometheus_topk_entry) * t->capacity) +
+	                (sizeof(uint16_t) * ((t->capacity * 2) + t->index_mask + 1));
+	t->table_size = (t->table_size + (PROMETHEUS_CACHELINE - 1)) & ~((size_t) PROMETHEUS_CACHELINE - 1);
+	t->base = uwsgi_calloc_shared(t->table_size * shards * 2);
+	uwsgi_log("[prometheus] top-%u %s: %llu bytes of shared memory\n", t->k, t->name, (unsigned long long)(t->table_size * shards * 2));
+}
+
+static int prometheus_topk_json_list(struct uwsgi_buffer *ub, struct prometheus_scrape_ctx *ctx, struct prometheus_topk *t) {
+	struct prometheus_topk_item *items;
+	int i, cnt = prometheus_topk_merge(t, ctx, &items);
+	if (cnt < 0) return -1;
+	if (uwsgi_buffer_append(ub, (char *)"\"", 1)) return -1;
+	if (uwsgi_buffer_append(ub, (char *)t->name, strlen(t->name))) return -1;
+	if (uwsgi_buffer_append(ub, (char *)"\":[", 3)) return -1;
+	for (i = 0; i < cnt; i++) {
+		if (i > 0 && uwsgi_buffer_append(ub, (char *)",", 1)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"{\"rank\":", 8)) return -1;
+		if (uwsgi_buffer_num64(ub, i + 1)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)",\"key\":\"", 8)) return -1;
+		if (uwsgi_buffer_append_json(ub, items[i].key, items[i].key_len)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\",\"count\":", 10)) return -1;
+		if (uwsgi_buffer_num64(ub, items[i].count)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)",\"error\":", 9)) return -1;
+		if (uwsgi_buffer_num64(ub, items[i].error)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)",\"seconds\":", 11)) return -1;
+		if (prometheus_buffer_append_scaled(ub, items[i].time, 1000000)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"}", 1)) return -1;
+	}
+	return uwsgi_buffer_append(ub, (char *)"]", 1);
+}
+
+/*
+ * Debug view of the trackers, with the overestimation of every count:
+ *
+ *   {"window":60,"paths":[{"rank":1,"key":"/","count":10,"error":0,"seconds":0.5}],"clients":[...]}
+ */
+static struct uwsgi_buffer *prometheus_topk_json(struct prometheus_scrape_ctx *ctx) {
+	if (prometheus_scrape_ctx_init(ctx)) return NULL;
+	struct uwsgi_buffer *ub = ctx->body;
+	ub->pos = 0;
+	if (uwsgi_buffer_append(ub, (char *)"{\"window\":", 10)) goto error;
+	if (uwsgi_buffer_num64(ub, ump_config.topk_window)) goto error;
+	if (uwsgi_buffer_append(ub, (char *)",", 1)) goto error;
+	if (prometheus_topk_json_list(ub, ctx, &prometheus_topk_paths)) goto error;
+	if (uwsgi_buffer_append(ub, (char *)",", 1)) goto error;
+	if (prometheus_topk_json_list(ub, ctx, &prometheus_topk_clients)) goto error;
+	if (uwsgi_buffer_append(ub, (char *)"}\n", 2)) goto error;
+	return ub;
+
+error:
+	ub->pos = 0;
+	return NULL;
+}
+
+/*
+ * ===========================================================================
+ * CARDINALITY ESTIMATES
+ * ===========================================================================
+ */
+
+/*
+ * Distinct clients and paths, with HyperLogLog: 2^12 one-byte registers
+ * per tracker and core give a standard error of about 1.6% whatever the
+ * number of distinct keys.
+ *
+ * Like the heavy hitters, every core owns a pair of register sets in
+ * shared memory, one per window parity, and clears a set when it moves to
+ * a new window. Registers only grow, so a plain store of the new maximum
+ * is enough. The exporter merges every live set with a register-wise max
+ * and estimates the union.
+ */
+#define PROMETHEUS_HLL_PRECISION 12
+#define PROMETHEUS_HLL_REGISTERS (1 << PROMETHEUS_HLL_PRECISION)
+
+struct prometheus_hll_table {
+	uint64_t epoch;             // window + 1, 0 while being cleared
+	uint8_t registers[PROMETHEUS_HLL_REGISTERS];
+};
+
+struct prometheus_hll {
+	const char *name;           // "clients", "paths"
+	uint64_t period;            // window, in microseconds
+	size_t table_size;
+	char *base;                 // shared memory, two tables per shard
+};
+
+static struct prometheus_hll prometheus_hll_clients = {"clients", 0, 0, NULL};
+static struct prometheus_hll prometheus_hll_paths = {"paths", 0, 0, NULL};
+
+static inline struct prometheus_hll_table *prometheus_hll_table(struct prometheus_hll *h, uint32_t shard, uint64_t epoch) {
+	return (struct prometheus_hll_table *)(h->base + ((((size_t) shard * 2) + (epoch & 1)) * h->table_size));
+}
+
+static void prometheus_hll_observe(struct prometheus_hll *h, uint32_t shard, const char *key, size_t key_len, uint64_t now) {
+	uint64_t epoch = (now / h->period) + 1;
+	struct prometheus_hll_table *table = prometheus_hll_table(h, shard, epoch);
+
+	if (table->epoch != epoch) {
+		__atomic_store_n(&table->epoch, 0, __ATOMIC_RELEASE);
+		memset(table->registers, 0, PROMETHEUS_HLL_REGISTERS);
+		__atomic_store_n(&table->epoch, epoch, __ATOMIC_RELEASE);
+	}
+
+	// FNV-1a has weak high bits on short keys: finish with the murmur3 mixer
+	uint64_t hash = prometheus_hash(key, key_len);
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	uint32_t index = hash >> (64 - PROMETHEUS_HLL_PRECISION);
+	// position of the first set bit in the remaining bits, capped by a sentinel
+	uint8_t rank = __builtin_clzll((hash << PROMETHEUS_HLL_PRECISION) | (1ULL << (PROMETHEUS_HLL_PRECISION - 1))) + 1;
+	if (table->registers[index] < rank) {
+		__atomic_store_n(&table->registers[index], rank, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Union of every shard over the current and previous window, with the
+ * small range correction (linear counting) of the original paper.
+ */
+static double prometheus_hll_estimate(struct prometheus_hll *h, struct prometheus_scrape_ctx *ctx) {
+	uint32_t shards = (uwsgi.numproc + 1) * uwsgi.cores;
+	uint8_t *merged = prometheus_arena_alloc(&ctx->arena, PROMETHEUS_HLL_REGISTERS);
+	if (!merged) return NAN;
+	memset(merged, 0, PROMETHEUS_HLL_REGISTERS);
+
+	uint64_t epoch = (uwsgi_micros() / h->period) + 1;
+	uint32_t i, w, r;
+	for (i = 0; i < shards; i++) {
+		for (w = 0; w < 2; w++) {
+			struct prometheus_hll_table *table = prometheus_hll_table(h, i, epoch - w);
+			if (__atomic_load_n(&table->epoch, __ATOMIC_ACQUIRE) != epoch - w) continue;
+			for (r = 0; r < PROMETHEUS_HLL_REGISTERS; r++) {
+				merged[r] = table->registers[r] > merged[r] ? table->registers[r] : merged[r];
+			}
+		}
+	}
+
+	double sum = 0;
+	uint32_t zeros = 0;
+	for (r = 0; r < PROMETHEUS_HLL_REGISTERS; r++) {
+		sum += ldexp(1.0, -merged[r]);
+		zeros += merged[r] == 0;
+	}
+	double m = PROMETHEUS_HLL_REGISTERS;
+	double estimate = (0.7213 / (1 + (1.079 / m))) * m * m / sum;
+	if (estimate <= 2.5 * m && zeros > 0) {
+		estimate = m * log(m / zeros);
+	}
+	return estimate;
+}
+
+static int prometheus_hll_render(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	struct uwsgi_buffer *ub = ctx->body;
+	struct prometheus_registry_series *rs = &rf->series[0];
+	double estimate = prometheus_hll_estimate((struct prometheus_hll *) rf->data, ctx);
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	if (uwsgi_buffer_append(ub, rs->line, rs->line_len)) return -1;
+	if (uwsgi_buffer_num64(ub, (int64_t) llround(estimate))) return -1;
+	return uwsgi_buffer_append(ub, (char *)"\n", 1);
+}
+
+static int prometheus_hll_render_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	struct prometheus_registry_series *rs = &rf->series[0];
+	double estimate = prometheus_hll_estimate((struct prometheus_hll *) rf->data, ctx);
+	return prometheus_pb_metric_value(ctx->pb_family, rs->pb_labels, rs->pb_labels_len, UWSGI_METRIC_GAUGE, round(estimate));
+}
+
+static void prometheus_hll_declare(struct prometheus_hll *h) {
+	char name[64], help[128];
+	h->period = (uint64_t) ump_config.cardinality_window * 1000000;
+	snprintf(name, sizeof(name), "unique_%s", h->name);
+	snprintf(help, sizeof(help), "estimated distinct %s over the last one to two windows", h->name);
+	uint32_t family = prometheus_registry_family_new(name, help, UWSGI_METRIC_GAUGE, prometheus_hll_render, h);
+	prometheus_registry.families[family].render_pb = prometheus_hll_render_pb;
+	// no slots: the series only carries the pre-rendered line and labels
+	prometheus_registry_series_new(family, NULL, 0);
+}
+
+static void prometheus_hll_allocate(struct prometheus_hll *h) {
+	uint32_t shards = (uwsgi.numproc + 1) * uwsgi.cores;
+	h->table_size = (sizeof(struct prometheus_hll_table) + (PROMETHEUS_CACHELINE - 1)) & ~((size_t) PROMETHEUS_CACHELINE - 1);
+	h->base = uwsgi_calloc_shared(h->table_size * shards * 2);
+	uwsgi_log("[prometheus] unique %s: %llu bytes of shared memory\n", h->name, (unsigned long long)(h->table_size * shards * 2));
+}
+
+/*
+ * ===========================================================================
+ * RETIRED TOTALS
+ * ===========================================================================
+ */
+
+/*
+ * A respawned worker (max-requests, reload-on-rss, harakiri) starts its
+ * counters from zero: per-worker series reset and cross-worker sums go
+ * backwards. The master keeps what the previous incarnations of every
+ * worker had counted in shared memory, and scrapes add it back, so the
+ * exported counters stay monotonic.
+ *
+ * Slots: the scoreboard and /proc columns, [column][worker], then the
+ * uWSGI metrics present at startup, by position in uwsgi.metrics.
+ *
+ * The master notices a respawn when the pid or the respawn_count of a
+ * worker changes, and retires what the previous incarnation counted:
+ *
+ * - every worker records its counters right after its fork (start) and
+ *   when it exits (final); a worker killed by a signal cannot, and the
+ *   highest value the master saw is used instead
+ * - counters the core does not reset are then at least at the final value
+ *   when the new incarnation starts, so only final - start is retired
+ * - uWSGI metrics are copied by the core's collector long after the
+ *   respawn: they are retired at their first change, if they went down
+ */
+struct prometheus_retired_worker {
+	pid_t start_pid;            // start[] holds the counters of this pid after its fork
+	pid_t final_pid;            // final[] holds the counters of this pid at its exit
+};
+
+struct prometheus_retired {
+	uint64_t *totals;           // shared memory, [cnt]
+	uint64_t *start;            // shared memory, [cnt], written by each worker
+	uint64_t *final;            // shared memory, [cnt], written by each worker
+	struct prometheus_retired_worker *workers;  // shared memory, [numproc]
+	uint64_t *last;             // master: highest value seen in the current incarnation, [cnt]
+	uint64_t *pending;          // master: uWSGI metrics, previous incarnation's value until the next change
+	pid_t *pids;                // master: current incarnation of every worker, [numproc]
+	uint64_t *respawns;         // master: its respawn_count, [numproc]
+	int *metric_wids;           // worker of every uWSGI metric slot, 0 if not tracked
+	uint32_t sb;                // first scoreboard slot
+	uint32_t proc;              // first /proc slot
+	uint32_t metric;            // first uWSGI metric slot
+	uint32_t metrics;           // uWSGI metrics at startup
+	uint32_t cnt;
+} prometheus_retired;
+
+static uint32_t prometheus_retired_reserve(uint32_t slots) {
+	uint32_t first = prometheus_retired.cnt;
+	prometheus_retired.cnt += slots;
+	return first;
+}
+
+// per-worker uWSGI counters; metrics with reset_after are meant to drop
+static int prometheus_retired_tracks(struct uwsgi_metric *um) {
+	return um->type == UWSGI_METRIC_COUNTER && !um->reset_after &&
+	       !uwsgi_starts_with(um->name, um->name_len, (char *)"worker.", 7) &&
+	       uwsgi_starts_with(um->name, um->name_len, (char *)"worker.0.", 9);
+}
+
+// add the retired totals of cnt slots to values[]
+static inline void prometheus_retired_add(uint64_t *values, uint32_t slot, uint32_t cnt) {
+	uint32_t i;
+	if (!prometheus_retired.totals) return;
+	for (i = 0; i < cnt; i++) {
+		values[i] += prometheus_retired.totals[slot + i];
+	}
+}
+
+static uint64_t *prometheus_retired_metric(uint32_t index) {
+	struct prometheus_retired *pr = &prometheus_retired;
+	if (!pr->totals || index >= pr->metrics) return NULL;
+	return &pr->totals[pr->metric + index];
+}
+
+/*
+ * Master, every cycle: follow the tracked uWSGI metrics. A respawn of wid
+ * (> 0) parks the value of the previous incarnation until the collector
+ * changes it: lower means the core reset it, and it is retired.
+ */
+static void prometheus_retired_metrics(int wid) {
+	struct prometheus_retired *pr = &prometheus_retired;
+	struct uwsgi_metric *um = uwsgi.metrics;
+	uint32_t i;
+	if (!pr->metrics) return;
+	uwsgi_rlock(uwsgi.metrics_lock);
+	for (i = 0; i < pr->metrics && um; i++, um = um->next) {
+		uint32_t slot = pr->metric + i;
+		if (!pr->metric_wids[i]) continue;
+		if (wid) {
+			if (pr->metric_wids[i] == wid && !pr->pending[slot]) {
+				pr->pending[slot] = pr->last[slot];
+				pr->last[slot] = 0;
+			}
+			continue;
+		}
+		uint64_t value = *um->value;
+		if (pr->pending[slot]) {
+			if (value == pr->pending[slot]) continue;
+			if (value < pr->pending[slot]) pr->totals[slot] += pr->pending[slot];
+			pr->pending[slot] = 0;
+		}
+		if (value > pr->last[slot]) pr->last[slot] = value;
+	}
+	uwsgi_rwunlock(uwsgi.metrics_lock);
+}
+
+/*
+ * Called from post_init once every source has reserved its slots. Without
+ * a master nobody sees the respawns, and nothing is allocated.
+ */
+static void prometheus_retired_allocate(void) {
+	struct prometheus_retired *pr = &prometheus_retired;
+	struct uwsgi_metric *um;
+	uint32_t i;
+	if (!uwsgi.master_process) return;
+	for (um = uwsgi.has_metrics ? uwsgi.metrics : NULL; um; um = um->next) {
+		pr->metrics++;
+	}
+	pr->metric = prometheus_retired_reserve(pr->metrics);
+	if (pr->cnt == 0) return;
+	pr->totals = uwsgi_calloc_shared(sizeof(uint64_t) * pr->cnt);
+	pr->start = uwsgi_calloc_shared(sizeof(uint64_t) * pr->cnt);
+	pr->final = uwsgi_calloc_shared(sizeof(uint64_t) * pr->cnt);
+	pr->workers = uwsgi_calloc_shared(sizeof(struct prometheus_retired_worker) * uwsgi.numproc);
+	pr->last = uwsgi_calloc(sizeof(uint64_t) * pr->cnt);
+	pr->pending = uwsgi_calloc(sizeof(uint64_t) * pr->cnt);
+	pr->pids = uwsgi_calloc(sizeof(pid_t) * uwsgi.numproc);
+	pr->respawns = uwsgi_calloc(sizeof(uint64_t) * uwsgi.numproc);
+	pr->metric_wids = uwsgi_calloc(sizeof(int) * (pr->metrics + 1));
+	for (i = 0, um = uwsgi.has_metrics ? uwsgi.metrics : NULL; um; i++, um = um->next) {
+		if (prometheus_retired_tracks(um)) pr->metric_wids[i] = atoi(um->name + 7);
+	}
+}
+
+/*
+ * ===========================================================================
+ * WORKER SCOREBOARD
+ * ===========================================================================
+ */
+
+/*
+ * Per-worker families read straight from uwsgi.workers[], which already
+ * lives in shared memory, so they do not need --enable-metrics.
+ *
+ * The first family rendered in a scrape copies the scoreboard with one
+ * memcpy and transposes it into one column per family (structure of
+ * arrays). Every other family of the scrape reads its column from that
+ * snapshot, and all of them see the same instant. The cores live outside of
+ * uwsgi.workers[]: the busy state reads their in_request flags once, right
+ * after the copy.
+ */
+#define PROMETHEUS_SB_REQUESTS      0
+#define PROMETHEUS_SB_RSS           1
+#define PROMETHEUS_SB_VSZ           2
+#define PROMETHEUS_SB_RUNNING_TIME  3
+#define PROMETHEUS_SB_AVG_RESPONSE  4
+#define PROMETHEUS_SB_RESPAWNS      5
+#define PROMETHEUS_SB_HARAKIRI      6
+#define PROMETHEUS_SB_STATE         7
+#define PROMETHEUS_SB_COLUMNS       8
+
+#define PROMETHEUS_SB_STATES 5
+
+static const char *prometheus_sb_states[PROMETHEUS_SB_STATES] = {"idle", "busy", "cheap", "pause", "sig"};
+
+struct prometheus_sb_column {
+	const char *name;
+	const char *help;
+	uint8_t type;
+	uint64_t scale;             // microseconds are exported in seconds
+};
+
+static struct prometheus_sb_column prometheus_sb_columns[PROMETHEUS_SB_COLUMNS] = {
+	{"worker_requests_total", "requests served by the worker", UWSGI_METRIC_COUNTER, 1},
+	{"worker_rss_bytes", "worker resident set size", UWSGI_METRIC_GAUGE, 1},
+	{"worker_vsz_bytes", "worker virtual memory size", UWSGI_METRIC_GAUGE, 1},
+	{"worker_running_time_seconds_total", "time spent serving requests", UWSGI_METRIC_COUNTER, 1000000},
+	{"worker_avg_response_time_seconds", "average response time of the worker", UWSGI_METRIC_GAUGE, 1000000},
+	{"worker_respawns_total", "times the worker has been respawned", UWSGI_METRIC_COUNTER, 1},
+	{"worker_harakiri_total", "requests killed by harakiri in the worker", UWSGI_METRIC_COUNTER, 1},
+	{"worker_state", "current worker state (one series per state, 1 for the current one)", UWSGI_METRIC_GAUGE, 1},
+};
+
+// same precedence as the stats server
+// uwsgi_worker_is_busy(), on the copy
+static int prometheus_sb_busy(struct uwsgi_worker *w) {
+	int core;
+	if (w->sig) return 1;
+	for (core = 0; core < uwsgi.cores; core++) {
+		if (w->cores[core].in_request) return 1;
+	}
+	return 0;
+}
+
+static uint64_t prometheus_sb_state(struct uwsgi_worker *w) {
+	int busy = prometheus_sb_busy(w);
+	if (w->cheaped) return 2;
+	if (w->suspended && !busy) return 3;
+	if (w->sig) return 4;
+	if (busy) return 1;
+	return 0;
+}
+
+static uint64_t *prometheus_sb_snapshot(struct prometheus_scrape_ctx *ctx) {
+	if (ctx->scoreboard) return ctx->scoreboard;
+
+	uint32_t n = uwsgi.numproc, i;
+	struct uwsgi_worker *workers = prometheus_arena_alloc(&ctx->arena, sizeof(struct uwsgi_worker) * n);
+	uint64_t *columns = prometheus_arena_alloc(&ctx->arena, sizeof(uint64_t) * PROMETHEUS_SB_COLUMNS * n);
+	if (!workers || !columns) return NULL;
+
+	memcpy(workers, &uwsgi.workers[1], sizeof(struct uwsgi_worker) * n);
+	for (i = 0; i < n; i++) {
+		struct uwsgi_worker *w = &workers[i];
+		columns[(PROMETHEUS_SB_REQUESTS * n) + i] = w->requests;
+		columns[(PROMETHEUS_SB_RSS * n) + i] = w->rss_size;
+		columns[(PROMETHEUS_SB_VSZ * n) + i] = w->vsz_size;
+		columns[(PROMETHEUS_SB_RUNNING_TIME * n) + i] = w->running_time;
+		columns[(PROMETHEUS_SB_AVG_RESPONSE * n) + i] = w->avg_response_time;
+		columns[(PROMETHEUS_SB_RESPAWNS * n) + i] = w->respawn_count;
+		columns[(PROMETHEUS_SB_HARAKIRI * n) + i] = w->harakiri_count;
+		columns[(PROMETHEUS_SB_STATE * n) + i] = prometheus_sb_state(w);
+	}
+	prometheus_retired_add(columns, prometheus_retired.sb, PROMETHEUS_SB_COLUMNS * n);
+	ctx->scoreboard = columns;
+	return columns;
+}
+
+// value of the series-th series of a column (state: one series per worker and state)
+static inline uint64_t prometheus_sb_value(uint64_t *columns, uint32_t column, uint32_t series) {
+	uint32_t n = uwsgi.numproc;
+	if (column == PROMETHEUS_SB_STATE) {
+		return columns[(column * n) + (series / PROMETHEUS_SB_STATES)] == series % PROMETHEUS_SB_STATES;
+	}
+	return columns[(column * n) + series];
+}
+
+static int prometheus_sb_render(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t column = (uint32_t)(uintptr_t) rf->data;
+	uint64_t scale = prometheus_sb_columns[column].scale;
+	struct uwsgi_buffer *ub = ctx->body;
+	uint64_t *columns = prometheus_sb_snapshot(ctx);
+	uint32_t i;
+	if (!columns) return -1;
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (uwsgi_buffer_append(ub, rs->line, rs->line_len)) return -1;
+		if (prometheus_buffer_append_scaled(ub, prometheus_sb_value(columns, column, i), scale)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+	}
+	return 0;
+}
+
+static int prometheus_sb_render_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t column = (uint32_t)(uintptr_t) rf->data;
+	double scale = prometheus_sb_columns[column].scale;
+	uint64_t *columns = prometheus_sb_snapshot(ctx);
+	uint32_t i;
+	if (!columns) return -1;
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (prometheus_pb_metric_value(ctx->pb_family, rs->pb_labels, rs->pb_labels_len, rf->type,
+		                               prometheus_sb_value(columns, column, i) / scale)) return -1;
+	}
+	return 0;
+}
+
+// the counters of worker i kept across respawns, into their slots (see RETIRED TOTALS)
+#define PROMETHEUS_SB_RETIRED 3
+static const uint32_t prometheus_sb_retired[PROMETHEUS_SB_RETIRED] = {
+	PROMETHEUS_SB_REQUESTS, PROMETHEUS_SB_RUNNING_TIME, PROMETHEUS_SB_HARAKIRI
+};
+
+static uint64_t prometheus_sb_counter(uint32_t i, uint32_t column) {
+	struct uwsgi_worker *w = &uwsgi.workers[i + 1];
+	switch (column) {
+	case PROMETHEUS_SB_REQUESTS: return w->requests;
+	case PROMETHEUS_SB_RUNNING_TIME: return w->running_time;
+	default: return w->harakiri_count;
+	}
+}
+
+// worker i: record its counters into values[] (start or final)
+static void prometheus_sb_counters(uint32_t i, uint64_t *values) {
+	uint32_t n = uwsgi.numproc, j;
+	for (j = 0; j < PROMETHEUS_SB_RETIRED; j++) {
+		uint32_t column = prometheus_sb_retired[j];
+		values[prometheus_retired.sb + (column * n) + i] = prometheus_sb_counter(i, column);
+	}
+}
+
+static void prometheus_sb_declare(void) {
+	char labels[64];
+	uint32_t column;
+	int wid, state;
+	prometheus_retired.sb = prometheus_retired_reserve(PROMETHEUS_SB_COLUMNS * uwsgi.numproc);
+	for (column = 0; column < PROMETHEUS_SB_COLUMNS; column++) {
+		struct prometheus_sb_column *c = &prometheus_sb_columns[column];
+		uint32_t family = prometheus_registry_family_new(c->name, c->help, c->type, prometheus_sb_render, (void *)(uintptr_t) column);
+		prometheus_registry.families[family].render_pb = prometheus_sb_render_pb;
+		// no slots: values come from the snapshot
+		for (wid = 1; wid <= uwsgi.numproc; wid++) {
+			if (column != PROMETHEUS_SB_STATE) {
+				snprintf(labels, sizeof(labels), "worker=\"%d\"", wid);
+				prometheus_registry_series_new(family, labels, 0);
+				continue;
+			}
+			for (state = 0; state < PROMETHEUS_SB_STATES; state++) {
+				snprintf(labels, sizeof(labels), "worker=\"%d\",state=\"%s\"", wid, prometheus_sb_states[state]);
+				prometheus_registry_series_new(family, labels, 0);
+			}
+		}
+	}
+}
+
+/*
+ * ===========================================================================
+ * PROCESS STATS
+ * ===========================================================================
+ */
+
+/*
+ * CPU, memory, open fds, context switches and scheduler latency of every
+ * worker, from /proc.
+ *
+ * The master keeps the /proc files of every worker open and re-reads them
+ * with pread(), so a refresh costs one syscall per file and no path
+ * lookups. Files are re-opened when a worker's pid changes. A worker
+ * scraping through the route handler opens and closes each file around its
+ * read instead: keeping them would hold 7 descriptors per worker in every
+ * worker, and show up in their process_open_fds. Values are cached for
+ * --prometheus-proc-refresh milliseconds, and with --prometheus-proc-threads
+ * the workers are split across threads.
+ */
+#define PROMETHEUS_PROC_STAT    0
+#define PROMETHEUS_PROC_STATM   1
+#define PROMETHEUS_PROC_STATUS  2
+#define PROMETHEUS_PROC_SMAPS   3
+#define PROMETHEUS_PROC_FD      4   // directory, counted with getdents64
+#define PROMETHEUS_PROC_SCHEDSTAT 5
+#define PROMETHEUS_PROC_TASK    6   // directory, threaded workers only
+#define PROMETHEUS_PROC_FILES   7
+
+static const char *prometheus_proc_files[PROMETHEUS_PROC_FILES] = {"stat", "statm", "status", "smaps_rollup", "fd", "schedstat", "task"};
+
+#define PROMETHEUS_PROC_TASKS_MAX 256
+
+#define PROMETHEUS_PROC_CPU       0
+#define PROMETHEUS_PROC_RSS       1
+#define PROMETHEUS_PROC_PSS       2
+#define PROMETHEUS_PROC_FDS       3
+#define PROMETHEUS_PROC_VOLUNTARY 4
+#define PROMETHEUS_PROC_INVOLUNTARY 5
+#define PROMETHEUS_PROC_SCHED_RUN 6
+#define PROMETHEUS_PROC_SCHED_WAIT 7
+#define PROMETHEUS_PROC_SCHED_SLICES 8
+#define PROMETHEUS_PROC_COLUMNS   9
+
+#define PROMETHEUS_PROC_THREADS_MAX 16
+
+static struct prometheus_sb_column prometheus_proc_columns[PROMETHEUS_PROC_COLUMNS] = {
+	{"process_cpu_seconds_total", "user and system CPU time of the worker", UWSGI_METRIC_COUNTER, 1000000},
+	{"process_resident_memory_bytes", "resident memory of the worker", UWSGI_METRIC_GAUGE, 1},
+	{"process_proportional_memory_bytes", "proportional set size (PSS) of the worker", UWSGI_METRIC_GAUGE, 1},
+	{"process_open_fds", "open file descriptors of the worker", UWSGI_METRIC_GAUGE, 1},
+	{"process_voluntary_context_switches_total", "voluntary context switches of the worker", UWSGI_METRIC_COUNTER, 1},
+	{"process_involuntary_context_switches_total", "involuntary context switches of the worker", UWSGI_METRIC_COUNTER, 1},
+	{"process_sched_run_seconds_total", "time the worker threads spent running on a CPU", UWSGI_METRIC_COUNTER, 1000000000},
+	{"process_sched_wait_seconds_total", "time the worker threads spent runnable, waiting for a CPU", UWSGI_METRIC_COUNTER, 1000000000},
+	{"process_sched_timeslices_total", "timeslices the worker threads ran on a CPU", UWSGI_METRIC_COUNTER, 1},
+};
+
+struct prometheus_proc_worker {
+	pid_t pid;
+	int fds[PROMETHEUS_PROC_FILES];     // -1 not opened yet, -2 unavailable
+	uint32_t tasks;             // threaded workers: task/<tid>/schedstat
+	pid_t *tids;
+	int *task_fds;
+	uint64_t *task_sched;       // [task][run, wait, slices], last read
+	uint64_t exited[3];         // run, wait, slices of the threads gone since the fork
+};
+
+struct prometheus_proc {
+	struct prometheus_proc_worker *workers;     // per process, [numproc]
+	uint64_t *columns;          // [column][worker], last refresh
+	uint64_t refreshed;         // uwsgi_micros() of the last refresh
+	pthread_mutex_t lock;
+	long ticks;                 // clock ticks per second
+} prometheus_proc = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, 0};
+
+static ssize_t prometheus_proc_pread(int fd, char *buf, size_t len) {
+	if (fd < 0) return -1;
+	ssize_t rlen = pread(fd, buf, len - 1, 0);
+	if (rlen < 0) return -1;
+	buf[rlen] = 0;
+	return rlen;
+}
+
+#ifdef __linux__
+// value of a "Key:   value" line of status or smaps_rollup
+static uint64_t prometheus_proc_field(const char *buf, const char *key) {
+	const char *ptr = strstr(buf, key);
+	if (!ptr) return 0;
+	return strtoull(ptr + strlen(key), NULL, 10);
+}
+
+static void prometheus_proc_close_tasks(struct prometheus_proc_worker *pw) {
+	uint32_t i;
+	for (i = 0; i < pw->tasks; i++) {
+		if (pw->task_fds[i] >= 0) close(pw->task_fds[i]);
+	}
+	pw->tasks = 0;
+}
+
+// forget the files of the previous pid, they are opened on first read
+static void prometheus_proc_open(struct prometheus_proc_worker *pw, pid_t pid) {
+	int i;
+	prometheus_proc_close_tasks(pw);
+	for (i = 0; i < PROMETHEUS_PROC_FILES; i++) {
+		if (pw->fds[i] >= 0) close(pw->fds[i]);
+		pw->fds[i] = -1;
+	}
+	memset(pw->exited, 0, sizeof(pw->exited));
+	pw->pid = pid;
+}
+
+static int prometheus_proc_file(struct prometheus_proc_worker *pw, int file) {
+	char path[64];
+	if (pw->fds[file] != -1 || pw->pid <= 0) return pw->fds[file];
+	if (file == PROMETHEUS_PROC_TASK && uwsgi.threads <= 1) return -1;
+	int directory = file == PROMETHEUS_PROC_FD || file == PROMETHEUS_PROC_TASK;
+	snprintf(path, sizeof(path), "/proc/%d/%s", (int) pw->pid, prometheus_proc_files[file]);
+	pw->fds[file] = open(path, O_RDONLY | O_CLOEXEC | (directory ? O_DIRECTORY : 0));
+	if (pw->fds[file] < 0) pw->fds[file] = -2;
+	return pw->fds[file];
+}
+
+// in a worker, close a file right after reading it (see above)
+static void prometheus_proc_release(int *fd) {
+	if (uwsgi.mywid > 0 && *fd >= 0) {
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+static ssize_t prometheus_proc_read(struct prometheus_proc_worker *pw, int file, char *buf, size_t len) {
+	ssize_t rlen = prometheus_proc_pread(prometheus_proc_file(pw, file), buf, len);
+	prometheus_proc_release(&pw->fds[file]);
+	return rlen;
+}
+
+// post_fork (see prometheus_fork_reset): close the master's files, empty the cache
+static void prometheus_proc_reset(void) {
+	struct prometheus_proc *pp = &prometheus_proc;
+	uint32_t n = uwsgi.numproc, i;
+	if (!pp->workers) return;
+	for (i = 0; i < n; i++) {
+		prometheus_proc_open(&pp->workers[i], 0);
+	}
+	memset(pp->columns, 0, sizeof(uint64_t) * PROMETHEUS_PROC_COLUMNS * n);
+	pp->refreshed = 0;
+}
+
+struct prometheus_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * Entries of an open directory, rewound first. With names, up to max
+ * numeric names are stored (task ids).
+ */
+static uint64_t prometheus_proc_list(int fd, pid_t *names, uint32_t max) {
+	char buf[4096];
+	uint64_t cnt = 0;
+	long len, pos;
+	if (fd < 0 || lseek(fd, 0, SEEK_SET) < 0) return 0;
+	while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < len;) {
+			struct prometheus_dirent64 *entry = (struct prometheus_dirent64 *)(buf + pos);
+			pos += entry->d_reclen;
+			if (entry->d_name[0] == '.') continue;
+			if (names && cnt < max) names[cnt] = atoi(entry->d_name);
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static int prometheus_proc_schedstat(int fd, uint64_t *run, uint64_t *wait, uint64_t *slices) {
+	char buf[128];
+	char *ptr;
+	if (prometheus_proc_pread(fd, buf, sizeof(buf)) <= 0) return -1;
+	*run += strtoull(buf, &ptr, 10);
+	*wait += strtoull(ptr, &ptr, 10);
+	*slices += strtoull(ptr, NULL, 10);
+	return 0;
+}
+
+/*
+ * /proc/<pid>/schedstat only covers the main thread: threaded workers sum
+ * task/<tid>/schedstat, whose fds the master keeps until the set of threads
+ * changes. The last values of the threads that exited are carried forward,
+ * so the counters do not go down when a thread ends.
+ */
+static void prometheus_proc_sched(struct prometheus_proc_worker *pw, uint64_t *run, uint64_t *wait, uint64_t *slices) {
+	pid_t tids[PROMETHEUS_PROC_TASKS_MAX];
+	uint64_t sched[PROMETHEUS_PROC_TASKS_MAX * 3];
+	char path[64];
+	uint32_t i, j;
+
+	*run = *wait = *slices = 0;
+	int task_dir = prometheus_proc_file(pw, PROMETHEUS_PROC_TASK);
+	if (task_dir < 0) {
+		prometheus_proc_schedstat(prometheus_proc_file(pw, PROMETHEUS_PROC_SCHEDSTAT), run, wait, slices);
+		prometheus_proc_release(&pw->fds[PROMETHEUS_PROC_SCHEDSTAT]);
+		return;
+	}
+
+	uint64_t tasks = prometheus_proc_list(task_dir, tids, PROMETHEUS_PROC_TASKS_MAX);
+	prometheus_proc_release(&pw->fds[PROMETHEUS_PROC_TASK]);
+	if (tasks > PROMETHEUS_PROC_TASKS_MAX) tasks = PROMETHEUS_PROC_TASKS_MAX;
+	if (tasks != pw->tasks || memcmp(tids, pw->tids, sizeof(pid_t) * tasks)) {
+		if (!pw->tids) {
+			pw->tids = uwsgi_calloc(sizeof(pid_t) * PROMETHEUS_PROC_TASKS_MAX);
+			pw->task_fds = uwsgi_calloc(sizeof(int) * PROMETHEUS_PROC_TASKS_MAX);
+			pw->task_sched = uwsgi_calloc(sizeof(uint64_t) * PROMETHEUS_PROC_TASKS_MAX * 3);
+		}
+		// keep the values of the threads still there, retire the others
+		memset(sched, 0, sizeof(uint64_t) * tasks * 3);
+		for (i = 0; i < pw->tasks; i++) {
+			for (j = 0; j < tasks; j++) {
+				if (tids[j] == pw->tids[i]) break;
+			}
+			uint64_t *dst = j < tasks ? &sched[j * 3] : pw->exited;
+			dst[0] += pw->task_sched[i * 3];
+			dst[1] += pw->task_sched[(i * 3) + 1];
+			dst[2] += pw->task_sched[(i * 3) + 2];
+		}
+		prometheus_proc_close_tasks(pw);
+		memcpy(pw->task_sched, sched, sizeof(uint64_t) * tasks * 3);
+		for (i = 0; i < tasks; i++) {
+			pw->tids[i] = tids[i];
+			pw->task_fds[i] = -1;
+		}
+		pw->tasks = tasks;
+	}
+	*run = pw->exited[0];
+	*wait = pw->exited[1];
+	*slices = pw->exited[2];
+	for (i = 0; i < pw->tasks; i++) {
+		// a thread that just exited keeps its last values until the next listing
+		uint64_t *last = &pw->task_sched[i * 3];
+		uint64_t task_run = 0, task_wait = 0, task_slices = 0;
+		if (pw->task_fds[i] == -1) {
+			snprintf(path, sizeof(path), "/proc/%d/task/%d/schedstat", (int) pw->pid, (int) pw->tids[i]);
+			pw->task_fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+			if (pw->task_fds[i] < 0) pw->task_fds[i] = -2;
+		}
+		if (!prometheus_proc_schedstat(pw->task_fds[i], &task_run, &task_wait, &task_slices)) {
+			last[0] = task_run;
+			last[1] = task_wait;
+			last[2] = task_slices;
+		}
+		prometheus_proc_release(&pw->task_fds[i]);
+		*run += last[0];
+		*wait += last[1];
+		*slices += last[2];
+	}
+}
+
+static void prometheus_proc_read_worker(uint32_t i) {
+	struct prometheus_proc *pp = &prometheus_proc;
+	struct prometheus_proc_worker *pw = &pp->workers[i];
+	uint32_t n = uwsgi.numproc;
+	uint64_t *columns = pp->columns;
+	char buf[4096];
+	pid_t pid = uwsgi.workers[i + 1].pid;
+
+	if (pid != pw->pid) prometheus_proc_open(pw, pid);
+
+	columns[(PROMETHEUS_PROC_CPU * n) + i] = 0;
+	columns[(PROMETHEUS_PROC_RSS * n) + i] = 0;
+	if (prometheus_proc_read(pw, PROMETHEUS_PROC_STAT, buf, sizeof(buf)) > 0) {
+		// the command name may contain spaces: fields are counted after ')'
+		char *ptr = strrchr(buf, ')');
+		int field = 2;
+		uint64_t utime = 0, stime = 0;
+		while (ptr && field < 15) {
+			ptr = strchr(ptr + 1, ' ');
+			if (!ptr) break;
+			field++;
+			if (field == 14) utime = strtoull(ptr + 1, NULL, 10);
+			if (field == 15) stime = strtoull(ptr + 1, NULL, 10);
+		}
+		columns[(PROMETHEUS_PROC_CPU * n) + i] = ((utime + stime) * 1000000) / pp->ticks;
+	}
+	if (prometheus_proc_read(pw, PROMETHEUS_PROC_STATM, buf, sizeof(buf)) > 0) {
+		char *ptr = strchr(buf, ' ');
+		if (ptr) columns[(PROMETHEUS_PROC_RSS * n) + i] = strtoull(ptr + 1, NULL, 10) * uwsgi.page_size;
+	}
+	columns[(PROMETHEUS_PROC_VOLUNTARY * n) + i] = 0;
+	columns[(PROMETHEUS_PROC_INVOLUNTARY * n) + i] = 0;
+	if (prometheus_proc_read(pw, PROMETHEUS_PROC_STATUS, buf, sizeof(buf)) > 0) {
+		columns[(PROMETHEUS_PROC_VOLUNTARY * n) + i] = prometheus_proc_field(buf, "\nvoluntary_ctxt_switches:");
+		columns[(PROMETHEUS_PROC_INVOLUNTARY * n) + i] = prometheus_proc_field(buf, "\nnonvoluntary_ctxt_switches:");
+	}
+	columns[(PROMETHEUS_PROC_PSS * n) + i] = 0;
+	if (prometheus_proc_read(pw, PROMETHEUS_PROC_SMAPS, buf, sizeof(buf)) > 0) {
+		columns[(PROMETHEUS_PROC_PSS * n) + i] = prometheus_proc_field(buf, "\nPss:") * 1024;
+	}
+	columns[(PROMETHEUS_PROC_FDS * n) + i] = prometheus_proc_list(prometheus_proc_file(pw, PROMETHEUS_PROC_FD), NULL, 0);
+	prometheus_proc_release(&pw->fds[PROMETHEUS_PROC_FD]);
+	prometheus_proc_sched(pw, &columns[(PROMETHEUS_PROC_SCHED_RUN * n) + i], &columns[(PROMETHEUS_PROC_SCHED_WAIT * n) + i],
+	                      &columns[(PROMETHEUS_PROC_SCHED_SLICES * n) + i]);
+}
+
+struct prometheus_proc_slice {
+	uint32_t first;
+	uint32_t step;
+};
+
+static void *prometheus_proc_read_slice(void *arg) {
+	struct prometheus_proc_slice *slice = (struct prometheus_proc_slice *) arg;
+	uint32_t i;
+	for (i = slice->first; i < (uint32_t) uwsgi.numproc; i += slice->step) {
+		prometheus_proc_read_worker(i);
+	}
+	return NULL;
+}
+
+static void prometheus_proc_refresh(void) {
+	uint32_t threads = ump_config.proc_threads, t;
+	pthread_t tids[PROMETHEUS_PROC_THREADS_MAX];
+	struct prometheus_proc_slice slices[PROMETHEUS_PROC_THREADS_MAX];
+
+	// below a few workers per thread, spawning costs more than it saves
+	if (threads > (uint32_t) uwsgi.numproc / 8) threads = (uwsgi.numproc / 8) > 0 ? uwsgi.numproc / 8 : 1;
+	for (t = 0; t < threads; t++) {
+		slices[t].first = t;
+		slices[t].step = threads;
+		if (t > 0 && pthread_create(&tids[t], NULL, prometheus_proc_read_slice, &slices[t])) {
+			// fall back to the calling thread for this slice
+			slices[t].step = 0;
+		}
+	}
+	prometheus_proc_read_slice(&slices[0]);
+	for (t = 1; t < threads; t++) {
+		if (slices[t].step) {
+			pthread_join(tids[t], NULL);
+		} else {
+			slices[t].step = threads;
+			prometheus_proc_read_slice(&slices[t]);
+		}
+	}
+}
+#endif
+
+// called with the lock held
+static void prometheus_proc_alloc(void) {
+	struct prometheus_proc *pp = &prometheus_proc;
+	uint32_t n = uwsgi.numproc, i;
+	if (pp->workers) return;
+	pp->workers = uwsgi_calloc(sizeof(struct prometheus_proc_worker) * n);
+	pp->columns = uwsgi_calloc(sizeof(uint64_t) * PROMETHEUS_PROC_COLUMNS * n);
+	for (i = 0; i < n; i++) {
+		memset(pp->workers[i].fds, 0xff, sizeof(pp->workers[i].fds));
+	}
+	pp->ticks = sysconf(_SC_CLK_TCK);
+	if (pp->ticks <= 0) pp->ticks = 100;
+}
+
+/*
+ * Refresh the cached columns if they are older than
+ * --prometheus-proc-refresh. Called with the lock held.
+ */
+static void prometheus_proc_update(void) {
+	struct prometheus_proc *pp = &prometheus_proc;
+	prometheus_proc_alloc();
+	uint64_t now = uwsgi_micros();
+	if (!pp->refreshed || now - pp->refreshed >= (uint64_t) ump_config.proc_refresh * 1000) {
+#ifdef __linux__
+		prometheus_proc_refresh();
+#endif
+		pp->refreshed = now;
+	}
+}
+
+/*
+ * Counters of worker i, into their slots (see RETIRED TOTALS). In the
+ * worker itself, at exit, its own files are read; in the master, only what
+ * its last refresh read from pid is available.
+ */
+static void prometheus_proc_counters(uint32_t i, uint64_t *values, pid_t pid) {
+	struct prometheus_proc *pp = &prometheus_proc;
+	uint32_t n = uwsgi.numproc, column;
+	pthread_mutex_lock(&pp->lock);
+	if (!pid) {
+		prometheus_proc_alloc();
+#ifdef __linux__
+		prometheus_proc_read_worker(i);
+#endif
+		pid = uwsgi.mypid;
+	}
+	for (column = 0; column < PROMETHEUS_PROC_COLUMNS; column++) {
+		if (prometheus_proc_columns[column].type != UWSGI_METRIC_COUNTER) continue;
+		uint64_t value = pp->workers && pp->workers[i].pid == pid ? pp->columns[(column * n) + i] : 0;
+		values[prometheus_retired.proc + (column * n) + i] = value;
+	}
+	pthread_mutex_unlock(&pp->lock);
+}
+
+/*
+ * Copy the cached columns into the scrape, with the retired totals.
+ */
+static uint64_t *prometheus_proc_snapshot(struct prometheus_scrape_ctx *ctx) {
+	struct prometheus_proc *pp = &prometheus_proc;
+	if (ctx->proc) return ctx->proc;
+
+	uint32_t n = uwsgi.numproc;
+	size_t size = sizeof(uint64_t) * PROMETHEUS_PROC_COLUMNS * n;
+	uint64_t *columns = prometheus_arena_alloc(&ctx->arena, size);
+	if (!columns) return NULL;
+
+	pthread_mutex_lock(&pp->lock);
+	prometheus_proc_update();
+	memcpy(columns, pp->columns, size);
+	pthread_mutex_unlock(&pp->lock);
+	prometheus_retired_add(columns, prometheus_retired.proc, PROMETHEUS_PROC_COLUMNS * n);
+
+	ctx->proc = columns;
+	return columns;
+}
+
+static int prometheus_proc_render(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t column = (uint32_t)(uintptr_t) rf->data;
+	uint64_t scale = prometheus_proc_columns[column].scale;
+	struct uwsgi_buffer *ub = ctx->body;
+	uint64_t *columns = prometheus_proc_snapshot(ctx);
+	uint32_t i;
+	if (!columns) return -1;
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (uwsgi_buffer_append(ub, rs->line, rs->line_len)) return -1;
+		if (prometheus_buffer_append_scaled(ub, columns[(column * uwsgi.numproc) + i], scale)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+	}
+	return 0;
+}
+
+static int prometheus_proc_render_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t column = (uint32_t)(uintptr_t) rf->data;
+	double scale = prometheus_proc_columns[column].scale;
+	uint64_t *columns = prometheus_proc_snapshot(ctx);
+	uint32_t i;
+	if (!columns) return -1;
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (prometheus_pb_metric_value(ctx->pb_family, rs->pb_labels, rs->pb_labels_len, rf->type,
+		                               columns[(column * uwsgi.numproc) + i] / scale)) return -1;
+	}
+	return 0;
+}
+
+static void prometheus_proc_declare(void) {
+	char labels[32];
+	uint32_t column;
+	int wid;
+
+	if (ump_config.proc_refresh < 0) {
+		uwsgi_log("[prometheus] ERROR: --prometheus-proc-refresh must not be negative\n");
+		uwsgi_exit(1);
+	}
+	if (ump_config.proc_threads <= 0 || ump_config.proc_threads > PROMETHEUS_PROC_THREADS_MAX) {
+		uwsgi_log("[prometheus] ERROR: --prometheus-proc-threads must be between 1 and %d\n", PROMETHEUS_PROC_THREADS_MAX);
+		uwsgi_exit(1);
+	}
+	prometheus_retired.proc = prometheus_retired_reserve(PROMETHEUS_PROC_COLUMNS * uwsgi.numproc);
+	for (column = 0; column < PROMETHEUS_PROC_COLUMNS; column++) {
+		struct prometheus_sb_column *c = &prometheus_proc_columns[column];
+		uint32_t family = prometheus_registry_family_new(c->name, c->help, c->type, prometheus_proc_render, (void *)(uintptr_t) column);
+		prometheus_registry.families[family].render_pb = prometheus_proc_render_pb;
+		for (wid = 1; wid <= uwsgi.numproc; wid++) {
+			snprintf(labels, sizeof(labels), "worker=\"%d\"", wid);
+			prometheus_registry_series_new(family, labels, 0);
+		}
+	}
+}
+
+/*
+ * ===========================================================================
+ * LISTEN QUEUES
+ * ===========================================================================
+ */
+
+/*
+ * Accept queue depth and configured backlog of every uWSGI socket, read
+ * from the kernel at scrape (or sample) time instead of the core's
+ * periodic listen_queue:
+ *
+ *   TCP   getsockopt(TCP_INFO) on a listening socket reports the accept
+ *         queue in tcpi_unacked and the backlog in tcpi_sacked
+ *   UNIX  one NETLINK_SOCK_DIAG dump of listening sockets (UNIX_DIAG_RQLEN),
+ *         matched by inode, covers every UNIX socket at once
+ *
+ * Elsewhere, or when the kernel does not answer, the core's queue and
+ * max_queue are used.
+ */
+struct prometheus_listen_socket {
+	struct uwsgi_socket *sock;
+	int unix_socket;
+	ino_t ino;                  // resolved on first read
+};
+
+struct prometheus_listen {
+	uint32_t cnt;
+	uint32_t unix_cnt;
+	struct prometheus_listen_socket *sockets;
+	int nl_fd;                  // NETLINK_SOCK_DIAG, one per process
+	pthread_mutex_t lock;       // the sampler thread and scrapes share nl_fd
+} prometheus_listen = {0, 0, NULL, -1, PTHREAD_MUTEX_INITIALIZER};
+
+static void prometheus_listen_declare_sockets(void) {
+	struct prometheus_listen *pl = &prometheus_listen;
+	struct uwsgi_socket *uwsgi_sock;
+	if (pl->sockets) return;
+	for (uwsgi_sock = uwsgi.sockets; uwsgi_sock; uwsgi_sock = uwsgi_sock->next) {
+		if (uwsgi_sock->family != AF_INET && uwsgi_sock->family != AF_INET6 && uwsgi_sock->family != AF_UNIX) continue;
+		pl->sockets = realloc(pl->sockets, sizeof(struct prometheus_listen_socket) * (pl->cnt + 1));
+		if (!pl->sockets) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+		struct prometheus_listen_socket *ls = &pl->sockets[pl->cnt++];
+		ls->sock = uwsgi_sock;
+		ls->unix_socket = uwsgi_sock->family == AF_UNIX;
+		ls->ino = 0;
+		pl->unix_cnt += ls->unix_socket;
+	}
+}
+
+#ifdef __linux__
+static int prometheus_listen_tcp(struct prometheus_listen_socket *ls, uint64_t *depth, uint64_t *backlog) {
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	if (getsockopt(ls->sock->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) || ti.tcpi_state != TCP_LISTEN) return -1;
+	*depth = ti.tcpi_unacked;
+	*backlog = ti.tcpi_sacked;
+	return 0;
+}
+
+static int prometheus_listen_unix(uint64_t *depth, uint64_t *backlog) {
+	struct prometheus_listen *pl = &prometheus_listen;
+	uint32_t i;
+
+	if (pl->nl_fd < 0) {
+		pl->nl_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+		if (pl->nl_fd < 0) {
+			uwsgi_error("[prometheus] socket(NETLINK_SOCK_DIAG)");
+			return -1;
+		}
+	}
+	for (i = 0; i < pl->cnt; i++) {
+		struct prometheus_listen_socket *ls = &pl->sockets[i];
+		struct stat st;
+		if (ls->unix_socket && !ls->ino && !fstat(ls->sock->fd, &st)) ls->ino = st.st_ino;
+	}
+
+	struct {
+		struct nlmsghdr nlh;
+		struct unix_diag_req req;
+	} request;
+	memset(&request, 0, sizeof(request));
+	request.nlh.nlmsg_len = sizeof(request);
+	request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.req.sdiag_family = AF_UNIX;
+	request.req.udiag_states = 1 << TCP_LISTEN;
+	request.req.udiag_show = UDIAG_SHOW_RQLEN;
+	if (send(pl->nl_fd, &request, sizeof(request), 0) < 0) return -1;
+
+	uint32_t buf[2048];
+	for (;;) {
+		ssize_t len = recv(pl->nl_fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		struct nlmsghdr *h;
+		for (h = (struct nlmsghdr *) buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) return 0;
+			if (h->nlmsg_type == NLMSG_ERROR) return -1;
+			struct unix_diag_msg *msg = NLMSG_DATA(h);
+			for (i = 0; i < pl->cnt; i++) {
+				if (pl->sockets[i].unix_socket && pl->sockets[i].ino == msg->udiag_ino) break;
+			}
+			if (i == pl->cnt) continue;
+			int attr_len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+			struct rtattr *attr;
+			for (attr = (struct rtattr *)(msg + 1); RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+				if (attr->rta_type != UNIX_DIAG_RQLEN) continue;
+				struct unix_diag_rqlen *rqlen = RTA_DATA(attr);
+				depth[i] = rqlen->udiag_rqueue;
+				backlog[i] = rqlen->udiag_wqueue;
+			}
+		}
+	}
+}
+#endif
+
+/*
+ * Fill depth[] and backlog[] (one entry per declared socket).
+ */
+static void prometheus_listen_read(uint64_t *depth, uint64_t *backlog) {
+	struct prometheus_listen *pl = &prometheus_listen;
+	uint32_t i;
+
+	for (i = 0; i < pl->cnt; i++) {
+		depth[i] = UINT64_MAX;
+	}
+
+	pthread_mutex_lock(&pl->lock);
+#ifdef __linux__
+	for (i = 0; i < pl->cnt; i++) {
+		struct prometheus_listen_socket *ls = &pl->sockets[i];
+		if (!ls->unix_socket && prometheus_listen_tcp(ls, &depth[i], &backlog[i])) depth[i] = UINT64_MAX;
+	}
+	if (pl->unix_cnt > 0) prometheus_listen_unix(depth, backlog);
+#endif
+	pthread_mutex_unlock(&pl->lock);
+
+	for (i = 0; i < pl->cnt; i++) {
+		if (depth[i] != UINT64_MAX) continue;
+		depth[i] = pl->sockets[i].sock->queue;
+		backlog[i] = pl->sockets[i].sock->max_queue;
+	}
+}
+
+// per scrape: both families read the same snapshot
+static uint64_t *prometheus_listen_snapshot(struct prometheus_scrape_ctx *ctx) {
+	if (ctx->listen) return ctx->listen;
+	uint32_t cnt = prometheus_listen.cnt;
+	uint64_t *values = prometheus_arena_alloc(&ctx->arena, sizeof(uint64_t) * 2 * (cnt + 1));
+	if (!values) return NULL;
+	prometheus_listen_read(values, values + cnt);
+	ctx->listen = values;
+	return values;
+}
+
+static int prometheus_listen_render(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint64_t *values = prometheus_listen_snapshot(ctx);
+	uint32_t offset = rf->data ? prometheus_listen.cnt : 0;
+	struct uwsgi_buffer *ub = ctx->body;
+	uint32_t i;
+	if (!values) return -1;
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (uwsgi_buffer_append(ub, rs->line, rs->line_len)) return -1;
+		if (uwsgi_buffer_num64(ub, values[offset + i])) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+	}
+	return 0;
+}
+
+static int prometheus_listen_render_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint64_t *values = prometheus_listen_snapshot(ctx);
+	uint32_t offset = rf->data ? prometheus_listen.cnt : 0;
+	uint32_t i;
+	if (!values) return -1;
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		if (prometheus_pb_metric_value(ctx->pb_family, rs->pb_labels, rs->pb_labels_len, UWSGI_METRIC_GAUGE, (double) values[offset + i])) return -1;
+	}
+	return 0;
+}
+
+static void prometheus_listen_declare(void) {
+	struct prometheus_listen *pl = &prometheus_listen;
+	struct uwsgi_buffer *labels = uwsgi_buffer_new(256);
+	uint32_t i;
+	prometheus_listen_declare_sockets();
+
+	// data: NULL for the depth, non-NULL for the backlog half of the snapshot
+	uint32_t depth = prometheus_registry_family_new("listen_queue_depth", "connections waiting to be accepted", UWSGI_METRIC_GAUGE, prometheus_listen_render, NULL);
+	uint32_t backlog = prometheus_registry_family_new("listen_queue_backlog", "maximum length of the accept queue", UWSGI_METRIC_GAUGE, prometheus_listen_render, (void *) 1);
+	prometheus_registry.families[depth].render_pb = prometheus_listen_render_pb;
+	prometheus_registry.families[backlog].render_pb = prometheus_listen_render_pb;
+
+	for (i = 0; i < pl->cnt; i++) {
+		struct uwsgi_socket *uwsgi_sock = pl->sockets[i].sock;
+		labels->pos = 0;
+		if (uwsgi_buffer_append(labels, (char *)"socket=\"", 8)) goto error;
+		if (prometheus_escape_string(labels, uwsgi_sock->name, strlen(uwsgi_sock->name))) goto error;
+		if (uwsgi_buffer_append(labels, (char *)"\"\0", 2)) goto error;
+		prometheus_registry_series_new(depth, labels->buf, 0);
+		prometheus_registry_series_new(backlog, labels->buf, 0);
+	}
+	uwsgi_buffer_destroy(labels);
+	return;
+
+error:
+	uwsgi_log("[prometheus] ERROR: unable to render socket labels\n");
+	uwsgi_exit(1);
+}
+
+/*
+ * ===========================================================================
+ * CGROUP RESOURCES
+ * ===========================================================================
+ */
+
+/*
+ * CPU throttling, memory and pressure stall information (PSI) of the cgroup
+ * v2 the instance runs in. The cgroup directory is resolved once in the
+ * master, from /proc/self/cgroup and the cgroup2 mount in
+ * /proc/self/mountinfo, and kept open: every process opens the files it
+ * reads relative to it on first use and re-reads them with pread(). Values
+ * are cached for --prometheus-cgroup-refresh milliseconds.
+ *
+ * Only the series the kernel reports at startup are declared: controllers
+ * that are not enabled for the cgroup simply have no series.
+ */
+#define PROMETHEUS_CG_CPU_STAT        0
+#define PROMETHEUS_CG_MEMORY_CURRENT  1
+#define PROMETHEUS_CG_MEMORY_MAX      2
+#define PROMETHEUS_CG_MEMORY_EVENTS   3
+#define PROMETHEUS_CG_CPU_PRESSURE    4
+#define PROMETHEUS_CG_MEMORY_PRESSURE 5
+#define PROMETHEUS_CG_IO_PRESSURE     6
+#define PROMETHEUS_CG_FILES           7
+
+static const char *prometheus_cg_files[PROMETHEUS_CG_FILES] = {"cpu.stat", "memory.current", "memory.max", "memory.events",
+                                                               "cpu.pressure", "memory.pressure", "io.pressure"};
+
+#define PROMETHEUS_CG_FAMILIES 9
+
+static struct prometheus_sb_column prometheus_cg_families[PROMETHEUS_CG_FAMILIES] = {
+	{"cgroup_cpu_usage_seconds_total", "CPU time consumed by the cgroup", UWSGI_METRIC_COUNTER, 1000000},
+	{"cgroup_cpu_periods_total", "enforcement periods of the cgroup CPU limit", UWSGI_METRIC_COUNTER, 1},
+	{"cgroup_cpu_throttled_periods_total", "enforcement periods in which the cgroup was throttled", UWSGI_METRIC_COUNTER, 1},
+	{"cgroup_cpu_throttled_seconds_total", "time the cgroup spent throttled by its CPU limit", UWSGI_METRIC_COUNTER, 1000000},
+	{"cgroup_memory_usage_bytes", "memory charged to the cgroup", UWSGI_METRIC_GAUGE, 1},
+	{"cgroup_memory_limit_bytes", "hard memory limit of the cgroup (+Inf without one)", UWSGI_METRIC_GAUGE, 1},
+	{"cgroup_memory_events_total", "memory events of the cgroup (limits reached, OOM kills)", UWSGI_METRIC_COUNTER, 1},
+	{"cgroup_pressure_stalled_seconds_total", "time tasks of the cgroup were stalled on a resource", UWSGI_METRIC_COUNTER, 1000000},
+	{"cgroup_pressure_avg10_ratio", "share of the last 10 seconds tasks of the cgroup were stalled on a resource", UWSGI_METRIC_GAUGE, 10000},
+};
+
+struct prometheus_cg_value {
+	uint32_t family;
+	uint32_t file;
+	const char *key;            // "key value" line, NULL for single value files
+	const char *field;          // "field=value" within the line (PSI)
+	const char *labels;
+};
+
+// grouped by family: the series of a family are declared in this order
+static struct prometheus_cg_value prometheus_cg_values[] = {
+	{0, PROMETHEUS_CG_CPU_STAT, "usage_usec", NULL, NULL},
+	{1, PROMETHEUS_CG_CPU_STAT, "nr_periods", NULL, NULL},
+	{2, PROMETHEUS_CG_CPU_STAT, "nr_throttled", NULL, NULL},
+	{3, PROMETHEUS_CG_CPU_STAT, "throttled_usec", NULL, NULL},
+	{4, PROMETHEUS_CG_MEMORY_CURRENT, NULL, NULL, NULL},
+	{5, PROMETHEUS_CG_MEMORY_MAX, NULL, NULL, NULL},
+	{6, PROMETHEUS_CG_MEMORY_EVENTS, "low", NULL, "event=\"low\""},
+	{6, PROMETHEUS_CG_MEMORY_EVENTS, "high", NULL, "event=\"high\""},
+	{6, PROMETHEUS_CG_MEMORY_EVENTS, "max", NULL, "event=\"max\""},
+	{6, PROMETHEUS_CG_MEMORY_EVENTS, "oom", NULL, "event=\"oom\""},
+	{6, PROMETHEUS_CG_MEMORY_EVENTS, "oom_kill", NULL, "event=\"oom_kill\""},
+	{7, PROMETHEUS_CG_CPU_PRESSURE, "some", "total=", "resource=\"cpu\",kind=\"some\""},
+	{7, PROMETHEUS_CG_CPU_PRESSURE, "full", "total=", "resource=\"cpu\",kind=\"full\""},
+	{7, PROMETHEUS_CG_MEMORY_PRESSURE, "some", "total=", "resource=\"memory\",kind=\"some\""},
+	{7, PROMETHEUS_CG_MEMORY_PRESSURE, "full", "total=", "resource=\"memory\",kind=\"full\""},
+	{7, PROMETHEUS_CG_IO_PRESSURE, "some", "total=", "resource=\"io\",kind=\"some\""},
+	{7, PROMETHEUS_CG_IO_PRESSURE, "full", "total=", "resource=\"io\",kind=\"full\""},
+	{8, PROMETHEUS_CG_CPU_PRESSURE, "some", "avg10=", "resource=\"cpu\",kind=\"some\""},
+	{8, PROMETHEUS_CG_CPU_PRESSURE, "full", "avg10=", "resource=\"cpu\",kind=\"full\""},
+	{8, PROMETHEUS_CG_MEMORY_PRESSURE, "some", "avg10=", "resource=\"memory\",kind=\"some\""},
+	{8, PROMETHEUS_CG_MEMORY_PRESSURE, "full", "avg10=", "resource=\"memory\",kind=\"full\""},
+	{8, PROMETHEUS_CG_IO_PRESSURE, "some", "avg10=", "resource=\"io\",kind=\"some\""},
+	{8, PROMETHEUS_CG_IO_PRESSURE, "full", "avg10=", "resource=\"io\",kind=\"full\""},
+};
+
+#define PROMETHEUS_CG_VALUES (sizeof(prometheus_cg_values) / sizeof(struct prometheus_cg_value))
+
+struct prometheus_cgroup {
+	int dir_fd;                 // opened in the master, inherited by the workers
+	int opened;                 // fds[] opened by this process
+	int fds[PROMETHEUS_CG_FILES];
+	uint32_t series[PROMETHEUS_CG_VALUES];      // value of every declared series
+	uint32_t first[PROMETHEUS_CG_FAMILIES];     // first series of a family in series[]
+	uint64_t values[PROMETHEUS_CG_VALUES];
+	uint64_t refreshed;         // uwsgi_micros() of the last refresh
+	pthread_mutex_t lock;
+} prometheus_cgroup = {-1, 0, {0}, {0}, {0}, {0}, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * Parse one value. Single value files may read "max" (no limit, stored as
+ * UINT64_MAX); PSI averages are percentages with two decimals, stored in
+ * hundredths.
+ */
+static int prometheus_cg_parse(const char *buf, struct prometheus_cg_value *cv, uint64_t *value) {
+	const char *line = buf;
+	char *end;
+	if (!cv->key) {
+		if (!strncmp(buf, "max", 3)) {
+			*value = UINT64_MAX;
+			return 0;
+		}
+		*value = strtoull(buf, &end, 10);
+		return end == buf ? -1 : 0;
+	}
+	size_t key_len = strlen(cv->key);
+	while (strncmp(line, cv->key, key_len) || line[key_len] != ' ') {
+		line = strchr(line, '\n');
+		if (!line) return -1;
+		line++;
+	}
+	line += key_len + 1;
+	if (cv->field) {
+		const char *eol = strchr(line, '\n');
+		line = strstr(line, cv->field);
+		if (!line || (eol && line > eol)) return -1;
+		line += strlen(cv->field);
+	}
+	*value = strtoull(line, &end, 10);
+	if (end == line) return -1;
+	if (*end == '.') {
+		*value = (*value * 100) + (isdigit((unsigned char) end[1]) ? (end[1] - '0') * 10 : 0) +
+		         (isdigit((unsigned char) end[1]) && isdigit((unsigned char) end[2]) ? end[2] - '0' : 0);
+	}
+	return 0;
+}
+
+/*
+ * Re-read every file into values[]. found[], when given, marks the values
+ * the kernel reported.
+ */
+static void prometheus_cg_refresh(uint8_t *found) {
+	struct prometheus_cgroup *pc = &prometheus_cgroup;
+	char buf[1024];
+	uint32_t file, i;
+
+	if (!pc->opened) {
+		for (file = 0; file < PROMETHEUS_CG_FILES; file++) {
+			pc->fds[file] = openat(pc->dir_fd, prometheus_cg_files[file], O_RDONLY | O_CLOEXEC);
+		}
+		pc->opened = 1;
+	}
+	for (file = 0; file < PROMETHEUS_CG_FILES; file++) {
+		if (prometheus_proc_pread(pc->fds[file], buf, sizeof(buf)) <= 0) continue;
+		for (i = 0; i < PROMETHEUS_CG_VALUES; i++) {
+			if (prometheus_cg_values[i].file != file) continue;
+			if (prometheus_cg_parse(buf, &prometheus_cg_values[i], &pc->values[i])) continue;
+			if (found) found[i] = 1;
+		}
+	}
+}
+
+static uint64_t *prometheus_cg_snapshot(struct prometheus_scrape_ctx *ctx) {
+	struct prometheus_cgroup *pc = &prometheus_cgroup;
+	if (ctx->cgroup) return ctx->cgroup;
+
+	uint64_t *values = prometheus_arena_alloc(&ctx->arena, sizeof(pc->values));
+	if (!values) return NULL;
+
+	pthread_mutex_lock(&pc->lock);
+	uint64_t now = uwsgi_micros();
+	if (now - pc->refreshed >= (uint64_t) ump_config.cgroup_refresh * 1000) {
+		prometheus_cg_refresh(NULL);
+		pc->refreshed = now;
+	}
+	memcpy(values, pc->values, sizeof(pc->values));
+	pthread_mutex_unlock(&pc->lock);
+
+	ctx->cgroup = values;
+	return values;
+}
+
+static int prometheus_cg_render(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t family = (uint32_t)(uintptr_t) rf->data;
+	uint32_t first = prometheus_cgroup.first[family];
+	uint64_t scale = prometheus_cg_families[family].scale;
+	struct uwsgi_buffer *ub = ctx->body;
+	uint64_t *values = prometheus_cg_snapshot(ctx);
+	uint32_t i;
+	if (!values) return -1;
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		uint64_t value = values[prometheus_cgroup.series[first + i]];
+		if (uwsgi_buffer_append(ub, rs->line, rs->line_len)) return -1;
+		if (value == UINT64_MAX) {
+			if (uwsgi_buffer_append(ub, (char *)"+Inf", 4)) return -1;
+		} else if (prometheus_buffer_append_scaled(ub, value, scale)) {
+			return -1;
+		}
+		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) return -1;
+	}
+	return 0;
+}
+
+static int prometheus_cg_render_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t family = (uint32_t)(uintptr_t) rf->data;
+	uint32_t first = prometheus_cgroup.first[family];
+	double scale = prometheus_cg_families[family].scale;
+	uint64_t *values = prometheus_cg_snapshot(ctx);
+	uint32_t i;
+	if (!values) return -1;
+	for (i = 0; i < rf->series_cnt; i++) {
+		struct prometheus_registry_series *rs = &rf->series[i];
+		uint64_t value = values[prometheus_cgroup.series[first + i]];
+		if (prometheus_pb_metric_value(ctx->pb_family, rs->pb_labels, rs->pb_labels_len, rf->type,
+		                               value == UINT64_MAX ? INFINITY : value / scale)) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Directory of the instance's cgroup v2: the "0::" entry of
+ * /proc/self/cgroup, below the cgroup2 mount point.
+ */
+static char *prometheus_cg_find(void) {
+	char line[4096];
+	char *path = NULL, *mount = NULL, *root = NULL;
+	FILE *f;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f) return NULL;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3)) continue;
+		line[strcspn(line, "\n")] = 0;
+		path = uwsgi_str(line + 3);
+		break;
+	}
+	fclose(f);
+	if (!path) return NULL;
+
+	// mountinfo: id parent major:minor root mount-point options ... - fstype source
+	f = fopen("/proc/self/mountinfo", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			char *fields[5], *ptr = line, *sep = strstr(line, " - ");
+			int i;
+			if (!sep || strncmp(sep + 3, "cgroup2 ", 8)) continue;
+			for (i = 0; i < 5 && ptr; i++) {
+				fields[i] = ptr;
+				ptr = strchr(ptr, ' ');
+				if (ptr) *ptr++ = 0;
+			}
+			if (i < 5) continue;
+			root = uwsgi_str(fields[3]);
+			mount = uwsgi_str(fields[4]);
+			break;
+		}
+		fclose(f);
+	}
+
+	// inside a cgroup namespace the mount root may already include the path
+	char *relative = path;
+	if (!strcmp(relative, "/")) relative = (char *) "";
+	if (root && strcmp(root, "/") && !strncmp(path, root, strlen(root))) relative = path + strlen(root);
+	char *dir = uwsgi_concat2(mount ? mount : (char *) "/sys/fs/cgroup", relative);
+	free(path);
+	free(root);
+	free(mount);
+	return dir;
+}
+
+static void prometheus_cg_declare(void) {
+	struct prometheus_cgroup *pc = &prometheus_cgroup;
+	uint8_t found[PROMETHEUS_CG_VALUES];
+	uint32_t i, family = PROMETHEUS_CG_FAMILIES, rf = 0, declared = 0;
+
+	if (ump_config.cgroup_refresh < 0) {
+		uwsgi_log("[prometheus] ERROR: --prometheus-cgroup-refresh must not be negative\n");
+		uwsgi_exit(1);
+	}
+	char *dir = prometheus_cg_find();
+	if (dir) {
+		pc->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (pc->dir_fd < 0) {
+		uwsgi_log("[prometheus] WARNING: no cgroup v2 found for this instance, --prometheus-cgroup disabled\n");
+		free(dir);
+		return;
+	}
+
+	memset(found, 0, sizeof(found));
+	prometheus_cg_refresh(found);
+	for (i = 0; i < PROMETHEUS_CG_VALUES; i++) {
+		struct prometheus_cg_value *cv = &prometheus_cg_values[i];
+		if (!found[i]) continue;
+		if (cv->family != family) {
+			struct prometheus_sb_column *c = &prometheus_cg_families[cv->family];
+			family = cv->family;
+			rf = prometheus_registry_family_new(c->name, c->help, c->type, prometheus_cg_render, (void *)(uintptr_t) family);
+			prometheus_registry.families[rf].render_pb = prometheus_cg_render_pb;
+			pc->first[family] = declared;
+		}
+		pc->series[declared++] = i;
+		prometheus_registry_series_new(rf, cv->labels, 0);
+	}
+	uwsgi_log("[prometheus] cgroup: %u series from %s\n", declared, dir);
+	free(dir);
+}
+
+/*
+ * ===========================================================================
+ * BACKGROUND SAMPLER
+ * ===========================================================================
+ */
+
+/*
+ * Gauges that only exist at scrape time hide anything shorter than the
+ * scrape interval. With --prometheus-sample, a thread in the master reads
+ * the selected sources --prometheus-sample-rate times per second into a
+ * ring buffer in shared memory covering --prometheus-sample-window
+ * seconds. Scrapes export the max, min and average of the ring.
+ *
+ * The sampler is the only writer: a sample is stored for every source,
+ * then published by bumping the sample count.
+ */
+typedef uint64_t (*prometheus_sample_fn)(void);
+
+struct prometheus_sample_source {
+	const char *name;
+	const char *help;
+	prometheus_sample_fn sample;
+};
+
+static uint64_t prometheus_sample_busy_workers(void) {
+	uint64_t busy = 0;
+	int wid;
+	for (wid = 1; wid <= uwsgi.numproc; wid++) {
+		busy += uwsgi_worker_is_busy(wid) ? 1 : 0;
+	}
+	return busy;
+}
+
+static uint64_t prometheus_sample_inflight_requests(void) {
+	uint64_t inflight = 0;
+	int wid, core;
+	for (wid = 1; wid <= uwsgi.numproc; wid++) {
+		for (core = 0; core < uwsgi.cores; core++) {
+			inflight += __atomic_load_n(&uwsgi.workers[wid].cores[core].in_request, __ATOMIC_RELAXED) ? 1 : 0;
+		}
+	}
+	return inflight;
+}
+
+static uint64_t prometheus_sample_listen_queue(void) {
+	uint64_t depth[prometheus_listen.cnt + 1], backlog[prometheus_listen.cnt + 1], queue = 0;
+	uint32_t i;
+	prometheus_listen_read(depth, backlog);
+	for (i = 0; i < prometheus_listen.cnt; i++) {
+		queue += depth[i];
+	}
+	return queue;
+}
+
+static struct prometheus_sample_source prometheus_sample_sources[] = {
+	{"busy_workers", "workers serving a request", prometheus_sample_busy_workers},
+	{"inflight_requests", "requests being served", prometheus_sample_inflight_requests},
+	{"listen_queue", "connections waiting in the listen queues", prometheus_sample_listen_queue},
+	{NULL, NULL, NULL},
+};
+
+#define PROMETHEUS_SAMPLE_MAX  0
+#define PROMETHEUS_SAMPLE_MIN  1
+#define PROMETHEUS_SAMPLE_AVG  2
+#define PROMETHEUS_SAMPLE_STATS 3
+
+static const char *prometheus_sample_stats[PROMETHEUS_SAMPLE_STATS] = {"max", "min", "avg"};
+
+struct prometheus_sampler {
+	uint32_t cnt;
+	struct prometheus_sample_source **sources;
+	uint32_t capacity;          // samples per source
+	uint64_t *count;            // shared memory: samples taken so far
+	uint64_t *ring;             // shared memory: [source][capacity]
+	int started;
+} prometheus_sampler;
+
+static void *prometheus_sampler_loop(void *arg) {
+	struct prometheus_sampler *s = &prometheus_sampler;
+	uint64_t interval = 1000000000ULL / ump_config.sample_rate;
+	struct timespec next;
+	uint32_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		uint64_t count = *s->count;
+		uint32_t pos = count % s->capacity;
+		for (i = 0; i < s->cnt; i++) {
+			__atomic_store_n(&s->ring[(i * s->capacity) + pos], s->sources[i]->sample(), __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(s->count, count + 1, __ATOMIC_RELEASE);
+
+		// absolute deadlines: the rate does not drift with the sampling cost
+		next.tv_nsec += interval;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+	return NULL;
+}
+
+// started from the first master cycle, so that only the master runs it
+static void prometheus_sampler_start(void) {
+	struct prometheus_sampler *s = &prometheus_sampler;
+	pthread_t t;
+	pthread_attr_t attr;
+	if (s->started || s->cnt == 0) return;
+	s->started = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&t, &attr, prometheus_sampler_loop, NULL)) {
+		uwsgi_error("[prometheus] pthread_create()");
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static double prometheus_sampler_stat(uint32_t source, int stat) {
+	struct prometheus_sampler *s = &prometheus_sampler;
+	uint64_t count = __atomic_load_n(s->count, __ATOMIC_ACQUIRE);
+	uint64_t n = count < s->capacity ? count : s->capacity;
+	uint64_t *ring = &s->ring[source * s->capacity];
+	uint64_t i, max = 0, min = UINT64_MAX, sum = 0;
+	if (n == 0) return NAN;
+
+	for (i = 0; i < n; i++) {
+		uint64_t v = __atomic_load_n(&ring[i], __ATOMIC_RELAXED);
+		max = v > max ? v : max;
+		min = v < min ? v : min;
+		sum += v;
+	}
+	switch (stat) {
+		case PROMETHEUS_SAMPLE_MAX:
+			return max;
+		case PROMETHEUS_SAMPLE_MIN:
+			return min;
+	}
+	return (double) sum / n;
+}
+
+static int prometheus_sampler_render(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t id = (uint32_t)(uintptr_t) rf->data;
+	struct uwsgi_buffer *ub = ctx->body;
+	struct prometheus_registry_series *rs = &rf->series[0];
+	if (rf->header_len > 0) {
+		if (uwsgi_buffer_append(ub, rf->header, rf->header_len)) return -1;
+	}
+	if (uwsgi_buffer_append(ub, rs->line, rs->line_len)) return -1;
+	if (prometheus_buffer_append_double(ub, prometheus_sampler_stat(id / PROMETHEUS_SAMPLE_STATS, id % PROMETHEUS_SAMPLE_STATS))) return -1;
+	return uwsgi_buffer_append(ub, (char *)"\n", 1);
+}
+
+static int prometheus_sampler_render_pb(struct prometheus_registry_family *rf, uint64_t *totals, struct prometheus_scrape_ctx *ctx) {
+	uint32_t id = (uint32_t)(uintptr_t) rf->data;
+	struct prometheus_registry_series *rs = &rf->series[0];
+	return prometheus_pb_metric_value(ctx->pb_family, rs->pb_labels, rs->pb_labels_len, UWSGI_METRIC_GAUGE,
+	                                  prometheus_sampler_stat(id / PROMETHEUS_SAMPLE_STATS, id % PROMETHEUS_SAMPLE_STATS));
+}
+
+static void prometheus_sampler_declare(void) {
+	struct prometheus_sampler *s = &prometheus_sampler;
+	struct uwsgi_string_list *usl;
+	char name[128], help[256];
+	uint32_t i;
+	int stat;
+
+	if (ump_config.sample_rate <= 0 || ump_config.sample_rate > 1000) {
+		uwsgi_log("[prometheus] ERROR: --prometheus-sample-rate must be between 1 and 1000\n");
+		uwsgi_exit(1);
+	}
+	if (ump_config.sample_window <= 0) {
+		uwsgi_log("[prometheus] ERROR: --prometheus-sample-window must be a positive number of seconds\n");
+		uwsgi_exit(1);
+	}
+
+	uwsgi_foreach(usl, ump_config.samples) {
+		struct prometheus_sample_source *source;
+		for (source = prometheus_sample_sources; source->name; source++) {
+			if (!strcmp(usl->value, source->name)) break;
+		}
+		if (!source->name) {
+			uwsgi_log("[prometheus] ERROR: unknown sample source '%s'\n", usl->value);
+			uwsgi_exit(1);
+		}
+		s->sources = realloc(s->sources, sizeof(struct prometheus_sample_source *) * (s->cnt + 1));
+		if (!s->sources) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+		s->sources[s->cnt++] = source;
+		if (source->sample == prometheus_sample_listen_queue) prometheus_listen_declare_sockets();
+	}
+
+	for (i = 0; i < s->cnt; i++) {
+		for (stat = 0; stat < PROMETHEUS_SAMPLE_STATS; stat++) {
+			snprintf(name, sizeof(name), "%s_%s", s->sources[i]->name, prometheus_sample_stats[stat]);
+			snprintf(help, sizeof(help), "%s of %s, sampled over the last %d seconds", prometheus_sample_stats[stat], s->sources[i]->help, ump_config.sample_window);
+			uint32_t family = prometheus_registry_family_new(name, help, UWSGI_METRIC_GAUGE, prometheus_sampler_render,
+			                                                 (void *)(uintptr_t)((i * PROMETHEUS_SAMPLE_STATS) + stat));
+			prometheus_registry.families[family].render_pb = prometheus_sampler_render_pb;
+			prometheus_registry_series_new(family, NULL, 0);
+		}
+	}
+
+	s->capacity = ump_config.sample_rate * ump_config.sample_window;
+	s->count = uwsgi_calloc_shared(sizeof(uint64_t));
+	s->ring = uwsgi_calloc_shared(sizeof(uint64_t) * s->cnt * s->capacity);
+}
+
+/*
+ * ===========================================================================
+ * REQUEST METRICS
+ * ===========================================================================
+ */
+
+/*
+ * Per-request recording, enabled by --prometheus-request-metrics.
+ * prometheus_after_request() runs in the worker at the end of every request
+ * and only touches the current core's shard.
+ */
+#define PROMETHEUS_STATUS_MAX 600
+#define PROMETHEUS_STATUS_CODES_MAX 64
+#define PROMETHEUS_METHODS 10
+
+struct prometheus_request_metrics {
+	uint32_t response_bytes;
+	struct prometheus_histogram *duration;
+	uint32_t duration_slot;
+	struct prometheus_histogram *size;  // native histograms only
+	uint32_t size_slot;
+	struct prometheus_sketch *latency;  // --prometheus-quantiles only
+	uint32_t latency_slot;
+	uint32_t requests;                  // first slot of the [code][method] block
+	uint8_t status_row[PROMETHEUS_STATUS_MAX];
+} prometheus_request;
+
+/*
+ * requests_total{code,method} is a dense [code][method] block of counters,
+ * so recording is two table lookups and one increment. code is the exact
+ * status for the codes listed in --prometheus-status-codes and the status
+ * class ("4xx") otherwise: every request is counted exactly once. Series
+ * are only exported once they have been seen.
+ */
+static const char *prometheus_methods[PROMETHEUS_METHODS] = {
+	"GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "CONNECT", "TRACE", "OTHER",
+};
+
+static inline uint32_t prometheus_method_index(const char *method, uint16_t len) {
+	switch (len) {
+		case 3:
+			if (!memcmp(method, "GET", 3)) return 0;
+			if (!memcmp(method, "PUT", 3)) return 3;
+			break;
+		case 4:
+			if (!memcmp(method, "HEAD", 4)) return 1;
+			if (!memcmp(method, "POST", 4)) return 2;
+			break;
+		case 5:
+			if (!memcmp(method, "PATCH", 5)) return 5;
+			if (!memcmp(method, "TRACE", 5)) return 8;
+			break;
+		case 6:
+			if (!memcmp(method, "DELETE", 6)) return 4;
+			break;
+		case 7:
+			if (!memcmp(method, "OPTIONS", 7)) return 6;
+			if (!memcmp(method, "CONNECT", 7)) return 7;
+			break;
+	}
+	return PROMETHEUS_METHODS - 1;
+}
+
+static void prometheus_requests_series(uint32_t family, const char *code) {
+	uint32_t m;
+	for (m = 0; m < PROMETHEUS_METHODS; m++) {
+		char *labels = uwsgi_concat3((char *)"code=\"", (char *)code, (char *)"\",method=\"");
+		char *full = uwsgi_concat3(labels, (char *)prometheus_methods[m], (char *)"\"");
+		prometheus_registry_series_new(family, full, 1);
+		free(full);
+		free(labels);
+	}
+}
+
+/*
+ * One row per exact code, then 1xx..5xx and "other" (anything outside of
+ * 100-599, e.g. requests that never sent a status).
+ */
+static void prometheus_requests_declare(void) {
+	uint32_t family = prometheus_registry_family_new("requests_total", "requests by status code and method", UWSGI_METRIC_COUNTER, NULL, NULL);
+	prometheus_registry.families[family].sparse = 1;
+	uint8_t rows = 0;
+	int status;
+
+	memset(prometheus_request.status_row, 0xff, sizeof(prometheus_request.status_row));
+	prometheus_request.requests = prometheus_registry.slots;
+
+	if (ump_config.status_codes) {
+		char *list = uwsgi_str(ump_config.status_codes);
+		char *ctx = NULL;
+		char *p = strtok_r(list, ",", &ctx);
+		while (p) {
+			size_t len = strlen(p);
+			p = prometheus_trim(p, &len);
+			p[len] = 0;
+			status = atoi(p);
+			if (len != 3 || status < 100 || status >= PROMETHEUS_STATUS_MAX) {
+				uwsgi_log("[prometheus] ERROR: invalid status code '%s'\n", p);
+				uwsgi_exit(1);
+			}
+			if (prometheus_request.status_row[status] == 0xff) {
+				if (rows == PROMETHEUS_STATUS_CODES_MAX) {
+					uwsgi_log("[prometheus] ERROR: too many status codes (max %d)\n", PROMETHEUS_STATUS_CODES_MAX);
+					uwsgi_exit(1);
+				}
+				prometheus_request.status_row[status] = rows++;
+				prometheus_requests_series(family, p);
+			}
+			p = strtok_r(NULL, ",", &ctx);
+		}
+		free(list);
+	}
+
+	char class[4] = "0xx";
+	uint8_t class_row[6];
+	for (status = 1; status <= 5; status++) {
+		class[0] = '0' + status;
+		class_row[status] = rows++;
+		prometheus_requests_series(family, class);
+	}
+	prometheus_requests_series(family, "other");
+
+	for (status = 0; status < PROMETHEUS_STATUS_MAX; status++) {
+		if (prometheus_request.status_row[status] != 0xff) continue;
+		prometheus_request.status_row[status] = status >= 100 ? class_row[status / 100] : rows;
+	}
+}
+
+/*
+ * Route groups: requests are bucketed by the first --prometheus-route-group
+ * regexp matching PATH_INFO ("other" if none), which keeps the label bounded
+ * whatever the paths look like.
+ *
+ * Regexps only run on a cache miss. Every core has a small set-associative
+ * cache of PATH_INFO -> group, with the ways of a set kept in LRU order, so
+ * the usual working set of paths costs one hash per request. A hit compares
+ * the whole path, not only its hash: paths up to PROMETHEUS_ROUTE_KEY bytes
+ * are stored in the entry, longer ones in a copy freed on eviction.
+ */
+#define PROMETHEUS_ROUTE_SETS 64
+#define PROMETHEUS_ROUTE_WAYS 4
+#define PROMETHEUS_ROUTE_KEY 48         // an entry is one cache line
+#define PROMETHEUS_ROUTE_CLASSES 6      // 1xx .. 5xx, other
+
+struct prometheus_route_entry {
+	uint64_t hash;
+	uint32_t group;             // group + 1, 0 for an empty way
+	uint32_t len;               // of the whole path
+	union {
+		char key[PROMETHEUS_ROUTE_KEY];     // len <= PROMETHEUS_ROUTE_KEY
+		char *path;                         // longer paths, allocated
+	};
+};
+
+static inline const char *prometheus_route_key(struct prometheus_route_entry *e) {
+	return e->len <= PROMETHEUS_ROUTE_KEY ? e->key : e->path;
+}
+
+struct prometheus_route_set {
+	struct prometheus_route_entry ways[PROMETHEUS_ROUTE_WAYS];   // most recent first
+};
+
+struct prometheus_routes {
+	uint32_t cnt;               // configured groups, "other" is group cnt
+	uwsgi_pcre **patterns;
+	uint32_t requests;          // first slot of the [group][class] block
+	uint32_t duration;          // first slot of the per-group histograms
+	uint32_t duration_stride;
+	struct prometheus_route_set *cache;   // per core, allocated after fork
+} prometheus_routes;
+
+static void prometheus_routes_declare(void) {
+	struct prometheus_routes *routes = &prometheus_routes;
+	struct uwsgi_string_list *usl;
+	struct uwsgi_buffer *labels = uwsgi_buffer_new(256);
+	char **names = NULL;
+	uint32_t i, c;
+
+	uwsgi_foreach(usl, ump_config.route_groups) {
+		char *eq = strchr(usl->value, '=');
+		if (!eq || eq == usl->value || !eq[1]) {
+			uwsgi_log("[prometheus] ERROR: invalid route group '%s' (expected name=regexp)\n", usl->value);
+			uwsgi_exit(1);
+		}
+		routes->patterns = realloc(routes->patterns, sizeof(uwsgi_pcre *) * (routes->cnt + 1));
+		names = realloc(names, sizeof(char *) * (routes->cnt + 1));
+		if (!routes->patterns || !names) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+		routes->patterns[routes->cnt] = NULL;
+		if (uwsgi_regexp_build(eq + 1, &routes->patterns[routes->cnt])) {
+			uwsgi_log("[prometheus] ERROR: invalid route group regexp '%s'\n", eq + 1);
+			uwsgi_exit(1);
+		}
+		names[routes->cnt] = uwsgi_strncopy(usl->value, eq - usl->value);
+		// every name is a series, "other" is taken by the unmatched paths
+		if (!strcmp(names[routes->cnt], "other")) {
+			uwsgi_log("[prometheus] ERROR: route group name 'other' is reserved for unmatched paths\n");
+			uwsgi_exit(1);
+		}
+		for (i = 0; i < routes->cnt; i++) {
+			if (!strcmp(names[i], names[routes->cnt])) {
+				uwsgi_log("[prometheus] ERROR: duplicate route group '%s'\n", names[i]);
+				uwsgi_exit(1);
+			}
+		}
+		routes->cnt++;
+	}
+
+	uint32_t requests = prometheus_registry_family_new("route_requests_total", "requests by route group and status class", UWSGI_METRIC_COUNTER, NULL, NULL);
+	prometheus_registry.families[requests].sparse = 1;
+	uint32_t duration = prometheus_histogram_family_new("route_request_duration_seconds", "request duration in seconds by route group", prometheus_request.duration);
+
+	const char *classes[PROMETHEUS_ROUTE_CLASSES] = {"1xx", "2xx", "3xx", "4xx", "5xx", "other"};
+	for (i = 0; i <= routes->cnt; i++) {
+		const char *name = i < routes->cnt ? names[i] : "other";
+		for (c = 0; c < PROMETHEUS_ROUTE_CLASSES; c++) {
+			labels->pos = 0;
+			if (uwsgi_buffer_append(labels, (char *)"route=\"", 7)) goto error;
+			if (prometheus_escape_string(labels, name, strlen(name))) goto error;
+			if (uwsgi_buffer_append(labels, (char *)"\",code=\"", 8)) goto error;
+			if (uwsgi_buffer_append(labels, (char *)classes[c], strlen(classes[c]))) goto error;
+			if (uwsgi_buffer_append(labels, (char *)"\"\0", 2)) goto error;
+			uint32_t slot = prometheus_registry_series_new(requests, labels->buf, 1);
+			if (i == 0 && c == 0) routes->requests = slot;
+		}
+	}
+	for (i = 0; i <= routes->cnt; i++) {
+		const char *name = i < routes->cnt ? names[i] : "other";
+		labels->pos = 0;
+		if (uwsgi_buffer_append(labels, (char *)"route=\"", 7)) goto error;
+		if (prometheus_escape_string(labels, name, strlen(name))) goto error;
+		if (uwsgi_buffer_append(labels, (char *)"\"\0", 2)) goto error;
+		uint32_t slot = prometheus_registry_series_new(duration, labels->buf, prometheus_histogram_slots(prometheus_request.duration));
+		if (i == 0) routes->duration = slot;
+	}
+	routes->duration_stride = prometheus_histogram_slots(prometheus_request.duration);
+
+	for (i = 0; i < routes->cnt; i++) {
+		free(names[i]);
+	}
+	free(names);
+	uwsgi_buffer_destroy(labels);
+	return;
+
+error:
+	uwsgi_log("[prometheus] ERROR: unable to render route group labels\n");
+	uwsgi_exit(1);
+}
+
+static uint32_t prometheus_route_group(struct wsgi_request *wsgi_req) {
+	struct prometheus_routes *routes = &prometheus_routes;
+	uint64_t hash = prometheus_hash(wsgi_req->path_info, wsgi_req->path_info_len);
+	struct prometheus_route_set *set = &routes->cache[(wsgi_req->async_id * PROMETHEUS_ROUTE_SETS) + (hash % PROMETHEUS_ROUTE_SETS)];
+	struct prometheus_route_entry entry;
+	uint32_t w;
+
+	size_t len = wsgi_req->path_info_len;
+
+	for (w = 0; w < PROMETHEUS_ROUTE_WAYS; w++) {
+		struct prometheus_route_entry *e = &set->ways[w];
+		if (e->group && e->hash == hash && e->len == len && !memcmp(prometheus_route_key(e), wsgi_req->path_info, len)) break;
+	}
+
+	if (w < PROMETHEUS_ROUTE_WAYS) {
+		entry = set->ways[w];
+	} else {
+		uint32_t group;
+		for (group = 0; group < routes->cnt; group++) {
+			if (uwsgi_regexp_match(routes->patterns[group], wsgi_req->path_info, wsgi_req->path_info_len) >= 0) break;
+		}
+		entry.hash = hash;
+		entry.group = group + 1;
+		entry.len = len;
+		if (len > PROMETHEUS_ROUTE_KEY) {
+			// not cached if the copy cannot be made
+			entry.path = malloc(len);
+			if (!entry.path) return group;
+		}
+		memcpy((char *) prometheus_route_key(&entry), wsgi_req->path_info, len);
+		// evict the least recently used way
+		w = PROMETHEUS_ROUTE_WAYS - 1;
+		struct prometheus_route_entry *e = &set->ways[w];
+		if (e->group && e->len > PROMETHEUS_ROUTE_KEY) free(e->path);
+	}
+
+	memmove(&set->ways[1], &set->ways[0], sizeof(struct prometheus_route_entry) * w);
+	set->ways[0] = entry;
+	return entry.group - 1;
+}
+
+static void prometheus_request_metrics_declare(void) {
+	uint32_t family = prometheus_registry_family_new("response_bytes_total", "bytes sent in responses", UWSGI_METRIC_COUNTER, NULL, NULL);
+	prometheus_request.response_bytes = prometheus_registry_series_new(family, NULL, 1);
+
+	prometheus_requests_declare();
+
+	// durations are recorded in microseconds and exported in seconds
+	prometheus_request.duration = prometheus_histogram_new(ump_config.histogram_buckets ? ump_config.histogram_buckets : PROMETHEUS_DEFAULT_BUCKETS, 1000000);
+	family = prometheus_histogram_family_new("request_duration_seconds", "request duration in seconds", prometheus_request.duration);
+	if (ump_config.native_histograms) {
+		// 1us .. ~68 minutes
+		prometheus_exp_buckets_init(&prometheus_request.duration->native, ump_config.native_schema, prometheus_request.duration->scale, 12);
+	}
+	prometheus_request.duration_slot = prometheus_registry_series_new(family, NULL, prometheus_histogram_slots(prometheus_request.duration));
+
+	if (ump_config.quantiles) {
+		double accuracy = ump_config.quantile_accuracy ? strtod(ump_config.quantile_accuracy, NULL) : PROMETHEUS_SKETCH_ACCURACY;
+		prometheus_request.latency = prometheus_sketch_new(ump_config.quantiles, accuracy, ump_config.quantile_window, 1000000, 12);
+		family = prometheus_sketch_family_new("request_latency_seconds", "request duration quantiles over a sliding window", prometheus_request.latency);
+		prometheus_request.latency_slot = prometheus_registry_series_new(family, NULL, prometheus_sketch_slots(prometheus_request.latency));
+		// every shard carries a sketch: (numproc + 1) * cores of them
+		uint32_t shards = (uwsgi.numproc + 1) * uwsgi.cores;
+		size_t size = sizeof(uint64_t) * prometheus_sketch_slots(prometheus_request.latency);
+		uwsgi_log("[prometheus] quantile sketch: %llu bytes per shard, %llu bytes for %u shards\n",
+		          (unsigned long long) size, (unsigned long long)(size * shards), shards);
+	}
+
+	if (ump_config.route_groups) {
+		prometheus_routes_declare();
+	}
+
+	if (ump_config.topk) {
+		prometheus_topk_declare(&prometheus_topk_paths);
+		prometheus_topk_declare(&prometheus_topk_clients);
+	}
+
+	if (ump_config.cardinality) {
+		prometheus_hll_declare(&prometheus_hll_clients);
+		prometheus_hll_declare(&prometheus_hll_paths);
+	}
+
+	if (!ump_config.native_histograms) return;
+	// 1 byte .. 64 GiB, no classic buckets
+	prometheus_request.size = prometheus_histogram_new(NULL, 1);
+	prometheus_exp_buckets_init(&prometheus_request.size->native, ump_config.native_schema, 1, 36);
+	family = prometheus_histogram_family_new("response_size_bytes", "response size in bytes", prometheus_request.size);
+	prometheus_request.size_slot = prometheus_registry_series_new(family, NULL, prometheus_histogram_slots(prometheus_request.size));
+}
+
+static inline uint64_t prometheus_request_duration(struct wsgi_request *wsgi_req) {
+	uint64_t end = wsgi_req->end_of_request;
+	if (end < wsgi_req->start_of_request) end = uwsgi_micros();
+	return end - wsgi_req->start_of_request;
+}
+
+static void prometheus_after_request(struct wsgi_request *wsgi_req) {
+	if (!prometheus_registry.base) return;
+	uint64_t *shard = prometheus_registry_shard(uwsgi.mywid, wsgi_req->async_id);
+	prometheus_shard_add(shard, prometheus_request.response_bytes, wsgi_req->response_size);
+	uint32_t row = wsgi_req->status < PROMETHEUS_STATUS_MAX ? prometheus_request.status_row[wsgi_req->status] : prometheus_request.status_row[0];
+	prometheus_shard_add(shard, prometheus_request.requests + (row * PROMETHEUS_METHODS) +
+	                     prometheus_method_index(wsgi_req->method, wsgi_req->method_len), 1);
+	uint64_t duration = prometheus_request_duration(wsgi_req);
+	uint64_t now = wsgi_req->start_of_request + duration;
+	prometheus_histogram_observe(prometheus_request.duration, shard, prometheus_request.duration_slot, duration);
+	if (prometheus_request.latency) {
+		prometheus_sketch_observe(prometheus_request.latency, shard, prometheus_request.latency_slot, duration, now);
+	}
+	if (prometheus_request.size) {
+		prometheus_histogram_observe(prometheus_request.size, shard, prometheus_request.size_slot, wsgi_req->response_size);
+	}
+	if (prometheus_routes.cache) {
+		uint32_t group = prometheus_route_group(wsgi_req);
+		uint32_t class = (wsgi_req->status >= 100 && wsgi_req->status < 600) ? (wsgi_req->status / 100) - 1 : PROMETHEUS_ROUTE_CLASSES - 1;
+		prometheus_shard_add(shard, prometheus_routes.requests + (group * PROMETHEUS_ROUTE_CLASSES) + class, 1);
+		prometheus_histogram_observe(prometheus_request.duration, shard, prometheus_routes.duration + (group * prometheus_routes.duration_stride), duration);
+	}
+	// heavy hitters and cardinality tables use the registry's shard numbering
+	uint32_t core = (uwsgi.mywid * uwsgi.cores) + wsgi_req->async_id;
+	if (prometheus_topk_paths.base) {
+		prometheus_topk_observe(&prometheus_topk_paths, core, wsgi_req->path_info, wsgi_req->path_info_len, duration, now);
+		prometheus_topk_observe(&prometheus_topk_clients, core, wsgi_req->remote_addr, wsgi_req->remote_addr_len, duration, now);
+	}
+	if (prometheus_hll_clients.base) {
+		prometheus_hll_observe(&prometheus_hll_clients, core, wsgi_req->remote_addr, wsgi_req->remote_addr_len, now);
+		prometheus_hll_observe(&prometheus_hll_paths, core, wsgi_req->path_info, wsgi_req->path_info_len, now);
+	}
+}
+
+/*
+ * ===========================================================================
+ * SERIES CACHE
+ * ===========================================================================
+ */
+
+/*
+ * Everything that does not change between scrapes is computed once per
+ * process: the Prometheus name and label block of every uWSGI metric,
+ * grouped by family, with the HELP/TYPE header already rendered. A scrape
+ * only snapshots the values and copies precomputed lines.
+ *
+ * uWSGI appends new metrics to the tail of uwsgi.metrics, so the cache
+ * remembers the last metric it has seen and extends itself when new ones
+ * show up.
+ */
+#define PROMETHEUS_AGG_SUM 0
+#define PROMETHEUS_AGG_MAX 1
+#define PROMETHEUS_AGG_MIN 2
+#define PROMETHEUS_AGG_MODES 3
+
+static const char *prometheus_agg_names[PROMETHEUS_AGG_MODES] = {"sum", "max", "min"};
+
+struct prometheus_series {
+	struct uwsgi_metric *um;
+	char *line;                 // "name{labels} "
+	size_t line_len;
+	uint32_t group;             // aggregation group inside the family
+	char *pb_labels;            // encoded LabelPairs (protobuf only)
+	size_t pb_labels_len;
+	uint64_t *retired;          // counted by respawned workers (NULL if not tracked)
+};
+
+/*
+ * Series of an aggregated family that share every label except
+ * worker/core/thread.
+ */
+struct prometheus_agg_group {
+	char *lines[PROMETHEUS_AGG_MODES];
+	size_t lines_len[PROMETHEUS_AGG_MODES];
+	char *pb_labels;
+	size_t pb_labels_len;
+};
+
+struct prometheus_family {
+	char *name;
+	size_t name_len;
+	uint8_t type;
+	int aggregate;              // emit cross-worker aggregates instead of series
+	char *header;
+	size_t header_len;
+	char *agg_names[PROMETHEUS_AGG_MODES];
+	size_t agg_names_len[PROMETHEUS_AGG_MODES];
+	char *agg_headers[PROMETHEUS_AGG_MODES];
+	size_t agg_headers_len[PROMETHEUS_AGG_MODES];
+	char *pb_header;            // protobuf only
+	size_t pb_header_len;
+	char *agg_pb_headers[PROMETHEUS_AGG_MODES];
+	size_t agg_pb_headers_len[PROMETHEUS_AGG_MODES];
+	struct prometheus_series *series;
+	uint32_t series_cnt;
+	uint32_t series_size;
+	struct prometheus_agg_group *groups;
+	char **groups_key;
+	size_t *groups_key_len;
+	uint32_t groups_cnt;
+	uint32_t groups_size;
+};
+
+struct prometheus_series_cache {
+	struct prometheus_family *families;
+	uint32_t families_cnt;
+	uint32_t families_size;
+	uint32_t series_cnt;
+	struct uwsgi_metric *tail;
+	uint32_t metrics_cnt;       // position of the next metric in uwsgi.metrics
+	int built;
+	pthread_rwlock_t lock;
+} prometheus_cache = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+/*
+ * Drop worker/core/thread from a label block. Values may come from label
+ * rules and contain escaped quotes or commas, so pairs are split on the
+ * closing quote rather than on ','.
+ */
+static void prometheus_strip_worker_labels(struct uwsgi_buffer *labels_buf, struct uwsgi_buffer *out) {
+	char *ptr = labels_buf->buf;
+	char *end = labels_buf->buf + labels_buf->pos;
+	out->pos = 0;
+	while (ptr < end) {
+		char *cur = memchr(ptr, '"', end - ptr);
+		if (!cur) break;
+		// skip the value up to its unescaped closing quote
+		for (cur++; cur < end && *cur != '"'; cur++) {
+			if (*cur == '\\') cur++;
+		}
+		size_t len = (cur < end ? cur + 1 : end) - ptr;
+		if (uwsgi_starts_with(ptr, len, (char *)"worker=", 7) &&
+		    uwsgi_starts_with(ptr, len, (char *)"core=", 5) &&
+		    uwsgi_starts_with(ptr, len, (char *)"thread=", 7)) {
+			if (out->pos > 0) uwsgi_buffer_append(out, (char *)",", 1);
+			uwsgi_buffer_append(out, ptr, len);
+		}
+		// skip the ',' separator
+		ptr += len + 1;
+	}
+}
+
+static struct prometheus_family *prometheus_cache_family(struct prometheus_series_cache *cache, struct uwsgi_buffer *name_buf,
+                                                         struct uwsgi_metric *um, int aggregate) {
+	uint32_t i;
+	for (i = 0; i < cache->families_cnt; i++) {
+		struct prometheus_family *pf = &cache->families[i];
+		if (pf->name_len == name_buf->pos && !memcmp(pf->name, name_buf->buf, name_buf->pos)) return pf;
+	}
+
+	if (cache->families_cnt == cache->families_size) {
+		cache->families_size = cache->families_size ? cache->families_size * 2 : 64;
+		cache->families = realloc(cache->families, sizeof(struct prometheus_family) * cache->families_size);
+		if (!cache->families) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+	}
+
+	struct prometheus_family *pf = &cache->families[cache->families_cnt++];
+	memset(pf, 0, sizeof(struct prometheus_family));
+	pf->name = uwsgi_strncopy(name_buf->buf, name_buf->pos);
+	pf->name_len = name_buf->pos;
+	pf->type = um->type;
+	pf->aggregate = aggregate;
+
+	if (!aggregate) {
+		pf->header = prometheus_render_header(pf->name, pf->name_len, um->name, um->name_len,
+		                                      prometheus_type_name(um->type), &pf->header_len);
+		if (ump_config.native_histograms) {
+			pf->pb_header = prometheus_pb_header(pf->name, pf->name_len, um->name, um->name_len, um->type, &pf->pb_header_len);
+		}
+		return pf;
+	}
+
+	// aggregated families: "sum" keeps the name, max/min are gauges named after the base name
+	size_t base_len = pf->name_len;
+	if (um->type == UWSGI_METRIC_COUNTER && base_len > 6) base_len -= 6;
+	int mode;
+	for (mode = 0; mode < PROMETHEUS_AGG_MODES; mode++) {
+		if (!(ump_config.aggregate & (1 << mode))) continue;
+		const char *agg_type = "gauge";
+		uint8_t agg_metric_type = UWSGI_METRIC_GAUGE;
+		if (mode == PROMETHEUS_AGG_SUM) {
+			pf->agg_names[mode] = uwsgi_strncopy(pf->name, pf->name_len);
+			pf->agg_names_len[mode] = pf->name_len;
+			agg_type = prometheus_type_name(um->type);
+			agg_metric_type = um->type;
+		} else {
+			pf->agg_names[mode] = uwsgi_concat2n(pf->name, base_len, (char *)(mode == PROMETHEUS_AGG_MAX ? "_max" : "_min"), 4);
+			pf->agg_names_len[mode] = base_len + 4;
+		}
+		char *help = uwsgi_concat3(um->name, (char *)" aggregated across workers: ", (char *)prometheus_agg_names[mode]);
+		pf->agg_headers[mode] = prometheus_render_header(pf->agg_names[mode], pf->agg_names_len[mode], help, strlen(help), agg_type,
+		                                                 &pf->agg_headers_len[mode]);
+		if (ump_config.native_histograms) {
+			pf->agg_pb_headers[mode] = prometheus_pb_header(pf->agg_names[mode], pf->agg_names_len[mode], help, strlen(help),
+			                                                agg_metric_type, &pf->agg_pb_headers_len[mode]);
+		}
+		free(help);
+	}
+	return pf;
+}
+
+static uint32_t prometheus_cache_group(struct prometheus_family *pf, struct uwsgi_buffer *key) {
+	uint32_t i;
+	for (i = 0; i < pf->groups_cnt; i++) {
+		if (pf->groups_key_len[i] == key->pos && !memcmp(pf->groups_key[i], key->buf, key->pos)) return i;
+	}
+
+	if (pf->groups_cnt == pf->groups_size) {
+		pf->groups_size = pf->groups_size ? pf->groups_size * 2 : 4;
+		pf->groups = realloc(pf->groups, sizeof(struct prometheus_agg_group) * pf->groups_size);
+		pf->groups_key = realloc(pf->groups_key, sizeof(char *) * pf->groups_size);
+		pf->groups_key_len = realloc(pf->groups_key_len, sizeof(size_t) * pf->groups_size);
+		if (!pf->groups || !pf->groups_key || !pf->groups_key_len) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+	}
+
+	struct prometheus_agg_group *group = &pf->groups[pf->groups_cnt];
+	memset(group, 0, sizeof(struct prometheus_agg_group));
+	pf->groups_key[pf->groups_cnt] = uwsgi_strncopy(key->buf, key->pos);
+	pf->groups_key_len[pf->groups_cnt] = key->pos;
+
+	int mode;
+	for (mode = 0; mode < PROMETHEUS_AGG_MODES; mode++) {
+		if (!pf->agg_names[mode]) continue;
+		group->lines[mode] = prometheus_render_line(pf->agg_names[mode], pf->agg_names_len[mode], key->buf, key->pos,
+		                                            &group->lines_len[mode]);
+	}
+	if (ump_config.native_histograms) {
+		group->pb_labels = prometheus_pb_labels(key->buf, key->pos, &group->pb_labels_len);
+	}
+	return pf->groups_cnt++;
+}
+
+/*
+ * Include/exclude filters. Patterns are compiled once in post_init and only
+ * evaluated here, when a metric enters the cache: a dropped metric simply
+ * never gets a series, so filtering costs nothing per scrape.
+ */
+static int prometheus_filter_matches(struct uwsgi_string_list *patterns, struct uwsgi_metric *um) {
+	struct uwsgi_string_list *usl;
+	uwsgi_foreach(usl, patterns) {
+		if (uwsgi_regexp_match((uwsgi_pcre *) usl->custom_ptr, um->name, um->name_len) >= 0) return 1;
+	}
+	return 0;
+}
+
+static int prometheus_filter_keep(struct uwsgi_metric *um) {
+	if (ump_config.include && !prometheus_filter_matches(ump_config.include, um)) return 0;
+	if (ump_config.exclude && prometheus_filter_matches(ump_config.exclude, um)) return 0;
+	return 1;
+}
+
+static void prometheus_filter_compile(struct uwsgi_string_list *patterns) {
+	struct uwsgi_string_list *usl;
+	uwsgi_foreach(usl, patterns) {
+		uwsgi_pcre *pattern = NULL;
+		if (uwsgi_regexp_build(usl->value, &pattern)) {
+			uwsgi_log("[prometheus] ERROR: invalid filter regexp '%s'\n", usl->value);
+			uwsgi_exit(1);
+		}
+		usl->custom_ptr = pattern;
+	}
+}
+
+static void prometheus_cache_add(struct prometheus_series_cache *cache, struct prometheus_scrape_ctx *ctx, struct uwsgi_metric *um, uint32_t index) {
+	const char *prefix = prometheus_prefix();
+	struct uwsgi_buffer *name_buf = ctx->name_buf;
+	struct uwsgi_buffer *labels_buf = ctx->labels_buf;
+
+	if (!um->name || um->name_len == 0 || !um->value) return;
+
+	int is_worker = !uwsgi_starts_with(um->name, um->name_len, (char *)"worker.", 7);
+	if (ump_config.no_workers && is_worker) return;
+	if (!prometheus_filter_keep(um)) return;
+
+	// worker 0 is not a real worker, it must not be summed with the others
+	int aggregate = ump_config.aggregate && is_worker;
+	if (aggregate && !uwsgi_starts_with(um->name, um->name_len, (char *)"worker.0.", 9)) return;
+
+	int ruled = prometheus_rules_apply(name_buf, labels_buf, um->name, um->name_len);
+	if (ruled < 0 || (!ruled && prometheus_format_metric_name(name_buf, labels_buf, um->name, um->name_len, prefix) < 0)) {
+		uwsgi_log("[prometheus] Failed to format metric: %.*s\n", (int)um->name_len, um->name);
+		return;
+	}
+
+	if (name_buf->pos == 0) return;
+
+	// Append _total suffix for counter metrics (Prometheus best practice)
+	if (um->type == UWSGI_METRIC_COUNTER &&
+	    !(ruled && name_buf->pos > 6 && !memcmp(name_buf->buf + name_buf->pos - 6, "_total", 6))) {
+		if (uwsgi_buffer_append(name_buf, (char *)"_total", 6)) {
+			uwsgi_log("[prometheus] Failed to append _total suffix\n");
+			return;
+		}
+	}
+
+	struct prometheus_family *pf = prometheus_cache_family(cache, name_buf, um, aggregate);
+
+	if (pf->series_cnt == pf->series_size) {
+		pf->series_size = pf->series_size ? pf->series_size * 2 : 8;
+		pf->series = realloc(pf->series, sizeof(struct prometheus_series) * pf->series_size);
+		if (!pf->series) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+	}
+
+	struct prometheus_series *ps = &pf->series[pf->series_cnt];
+	memset(ps, 0, sizeof(struct prometheus_series));
+	ps->um = um;
+	if (prometheus_retired_tracks(um)) ps->retired = prometheus_retired_metric(index);
+
+	if (pf->aggregate) {
+		// the family is resolved, name_buf is free to hold the group labels
+		prometheus_strip_worker_labels(labels_buf, name_buf);
+		if (prometheus_const_labels_splice(name_buf)) return;
+		ps->group = prometheus_cache_group(pf, name_buf);
+	} else {
+		if (prometheus_const_labels_splice(labels_buf)) return;
+		ps->line = prometheus_render_line(name_buf->buf, name_buf->pos, labels_buf->buf, labels_buf->pos, &ps->line_len);
+		if (ump_config.native_histograms) {
+			ps->pb_labels = prometheus_pb_labels(labels_buf->buf, labels_buf->pos, &ps->pb_labels_len);
+		}
+	}
+
+	pf->series_cnt++;
+	cache->series_cnt++;
+}
+
+/*
+ * Prefix trie over the emitted family names, rebuilt when the cache grows.
+ * Every node knows the range of families below it (in trie order), so exact
+ * and prefix lookups cost O(length of the name + matched families). An
+ * aggregated family has one name per mode, each ending on its own node.
+ */
+struct prometheus_trie_node {
+	uint32_t child;
+	uint32_t sibling;
+	uint32_t lo;
+	uint32_t hi;
+	int32_t family;
+	int8_t mode;                // aggregation mode of the name, -1 for the whole family
+	char c;
+};
+
+struct prometheus_trie {
+	struct prometheus_trie_node *nodes;
+	uint32_t nodes_cnt;
+	uint32_t nodes_size;
+	uint32_t *order;            // nodes ending a name
+	uint32_t order_cnt;
+	uint32_t order_size;
+};
+
+static struct prometheus_trie prometheus_families_trie;
+
+static uint32_t prometheus_trie_node_new(struct prometheus_trie *trie, char c) {
+	if (trie->nodes_cnt == trie->nodes_size) {
+		trie->nodes_size = trie->nodes_size ? trie->nodes_size * 2 : 256;
+		trie->nodes = realloc(trie->nodes, sizeof(struct prometheus_trie_node) * trie->nodes_size);
+		if (!trie->nodes) {
+			uwsgi_error("[prometheus] realloc()");
+			uwsgi_exit(1);
+		}
+	}
+	struct prometheus_trie_node *node = &trie->nodes[trie->nodes_cnt];
+	memset(node, 0, sizeof(struct prometheus_trie_node));
+	node->family = -1;
+	node->mode = -1;
+	node->c = c;
+	return trie->nodes_cnt++;
+}
+
+static void prometheus_trie_insert(struct prometheus_trie *trie, const char *name, size_t name_len, uint32_t family, int mode) {
+	uint32_t cur = 0;
+	size_t i;
+	for (i = 0; i < name_len; i++) {
+		uint32_t child = trie->nodes[cur].child;
+		while (child && trie->nodes[child].c != name[i]) {
+			child = trie->nodes[child].sibling;
+		}
+		if (!child) {
+			child = prometheus_trie_node_new(trie, name[i]);
+			trie->nodes[child].sibling = trie->nodes[cur].child;
+			trie->nodes[cur].child = child;
+		}
+		cur = child;
+	}
+	trie->nodes[cur].family = family;
+	trie->nodes[cur].mode = mode;
+}
+
+static void prometheus_trie_number(struct prometheus_trie *trie, uint32_t cur) {
+	struct prometheus_trie_node *node = &trie->nodes[cur];
+	node->lo = trie->order_cnt;
+	if (node->family >= 0) {
+		if (trie->order_cnt == trie->order_size) {
+			trie->order_size = trie->order_size ? trie->order_size * 2 : 64;
+			trie->order = realloc(trie->order, sizeof(uint32_t) * trie->order_size);
+			if (!trie->order) {
+				uwsgi_error("[prometheus] realloc()");
+				uwsgi_exit(1);
+			}
+		}
+		trie->order[trie->order_cnt++] = cur;
+	}
+	uint32_t child = node->child;
+	while (child) {
+		prometheus_trie_number(trie, child);
+		child = trie->nodes[child].sibling;
+	}
+	// nodes may have moved during recursion
+	trie->nodes[cur].hi = trie->order_cnt;
+}
+
+static void prometheus_trie_build(struct prometheus_trie *trie, struct prometheus_series_cache *cache) {
+	uint32_t i;
+	int mode;
+
+	trie->nodes_cnt = 0;
+	trie->order_cnt = 0;
+	prometheus_trie_node_new(trie, 0);
+
+	for (i = 0; i < cache->families_cnt; i++) {
+		struct prometheus_family *pf = &cache->families[i];
+		if (!pf->aggregate) {
+			prometheus_trie_insert(trie, pf->name, pf->name_len, i, -1);
+			continue;
+		}
+		for (mode = 0; mode < PROMETHEUS_AGG_MODES; mode++) {
+			if (!pf->agg_names[mode]) continue;
+			prometheus_trie_insert(trie, pf->agg_names[mode], pf->agg_names_len[mode], i, mode);
+		}
+	}
+
+	// registry families follow the cache families
+	for (i = 0; i < prometheus_registry.families_cnt; i++) {
+		struct prometheus_registry_family *rf = &prometheus_registry.families[i];
+		if (!rf->full_name) continue;
+		prometheus_trie_insert(trie, rf->full_name, rf->full_name_len, cache->families_cnt + i, -1);
+	}
 
-static struct seen_metric_name *seen_names_create(void) {
-	return NULL;  // Empty list
+	prometheus_trie_number(trie, 0);
 }
 
-static int seen_names_contains(struct seen_metric_name *head, const char *name, size_t name_len) {
-	struct seen_metric_name *current = head;
-	while (current) {
-		if (current->name_len == name_len && memcmp(current->name, name, name_len) == 0) {
-			return 1;  // Found
+static struct prometheus_trie_node *prometheus_trie_find(struct prometheus_trie *trie, const char *name, size_t name_len) {
+	if (!trie->nodes_cnt) return NULL;
+	uint32_t cur = 0;
+	size_t i;
+	for (i = 0; i < name_len; i++) {
+		uint32_t child = trie->nodes[cur].child;
+		while (child && trie->nodes[child].c != name[i]) {
+			child = trie->nodes[child].sibling;
 		}
-		current = current->next;
+		if (!child) return NULL;
+		cur = child;
 	}
-	return 0;  // Not found
+	return &trie->nodes[cur];
 }
 
-static struct seen_metric_name *seen_names_add(struct seen_metric_name *head, const char *name, size_t name_len) {
-	struct seen_metric_name *node = uwsgi_malloc(sizeof(struct seen_metric_name));
-	if (!node) return head;
-
-	node->name = uwsgi_malloc(name_len);
-	if (!node->name) {
-		free(node);
-		return head;
-	}
+/*
+ * Bring the cache up to date with uwsgi.metrics. Cheap when nothing changed:
+ * a read lock and a look at the tail.
+ */
+static void prometheus_cache_update(struct prometheus_series_cache *cache, struct prometheus_scrape_ctx *ctx) {
+	struct uwsgi_metric *metrics = uwsgi.has_metrics ? uwsgi.metrics : NULL;
 
-	memcpy(node->name, name, name_len);
-	node->name_len = name_len;
-	node->next = head;
-	return node;
-}
+	pthread_rwlock_rdlock(&cache->lock);
+	int stale = !cache->built || (cache->tail ? cache->tail->next : metrics) != NULL;
+	pthread_rwlock_unlock(&cache->lock);
+	if (!stale) return;
 
-static void seen_names_destroy(struct seen_metric_name *head) {
-	while (head) {
-		struct seen_metric_name *next = head->next;
-		free(head->name);
-		free(head);
-		head = next;
+	pthread_rwlock_wrlock(&cache->lock);
+	cache->built = 1;
+	struct uwsgi_metric *um = cache->tail ? cache->tail->next : metrics;
+	while (um) {
+		prometheus_cache_add(cache, ctx, um, cache->metrics_cnt++);
+		cache->tail = um;
+		um = um->next;
 	}
+	prometheus_trie_build(&prometheus_families_trie, cache);
+	pthread_rwlock_unlock(&cache->lock);
 }
 
-__attribute__((unused))
-static int prometheus_escape_string(struct uwsgi_buffer *ub, const char *str, size_t len) {
-	size_t i;
+/*
+ * ===========================================================================
+ * SERIES SELECTION
+ * ===========================================================================
+ */
+
+/*
+ * Families requested through the query string:
+ *   ?name[]=uwsgi_workerrequests_total&name[]=uwsgi_socketlisten_queue
+ *   ?prefix=uwsgi_worker
+ * Without any of these parameters every family is rendered.
+ */
+struct prometheus_selection {
+	int active;
+	uint32_t *families;
+	uint32_t cnt;
+	uint8_t *modes;             // per family: aggregation modes selected, a bit each
+};
+
+static size_t prometheus_url_decode(char *dst, const char *src, size_t len) {
+	size_t i, pos = 0;
 	for (i = 0; i < len; i++) {
-		switch (str[i]) {
-			case '\\':
-				if (uwsgi_buffer_append(ub, (char *)"\\\\", 2)) return -1;
-				break;
-			case '"':
-				if (uwsgi_buffer_append(ub, (char *)"\\\"", 2)) return -1;
-				break;
-			case '\n':
-				if (uwsgi_buffer_append(ub, (char *)"\\n", 2)) return -1;
-				break;
-			default:
-				if (uwsgi_buffer_append(ub, (char *)&str[i], 1)) return -1;
-				break;
+		if (src[i] == '%' && i + 2 < len && isxdigit((unsigned char)src[i + 1]) && isxdigit((unsigned char)src[i + 2])) {
+			char hex[3] = {src[i + 1], src[i + 2], 0};
+			dst[pos++] = (char) strtol(hex, NULL, 16);
+			i += 2;
+		} else if (src[i] == '+') {
+			dst[pos++] = ' ';
+		} else {
+			dst[pos++] = src[i];
 		}
 	}
-	return 0;
+	return pos;
 }
 
-static int prometheus_format_metric_name(struct uwsgi_buffer *name_buf, struct uwsgi_buffer *labels_buf,
-                                         const char *metric_name, size_t metric_name_len, const char *prefix) {
-	size_t i, label_index = 0;
-	char segment[256];
-	size_t segment_len = 0;
-	int is_numeric = 1;
-	int in_numeric_sequence = 0;
-	char label_names[4][16] = {"worker", "core", "thread", "id"};
+static void prometheus_selection_add(struct prometheus_selection *sel, struct prometheus_trie_node *node) {
+	if (!sel->modes[node->family]) sel->families[sel->cnt++] = node->family;
+	sel->modes[node->family] |= node->mode >= 0 ? (1 << node->mode) : 0xff;
+}
 
-	name_buf->pos = 0;
-	labels_buf->pos = 0;
+static int prometheus_selection_parse(struct prometheus_series_cache *cache, struct prometheus_arena *arena,
+                                      const char *query, size_t query_len, struct prometheus_selection *sel) {
+	memset(sel, 0, sizeof(struct prometheus_selection));
+	if (!query || query_len == 0) return 0;
 
-	if (uwsgi_buffer_append(name_buf, (char *)prefix, strlen(prefix))) return -1;
+	char *buf = prometheus_arena_alloc(arena, query_len);
+	if (!buf) return -1;
 
-	for (i = 0; i <= metric_name_len; i++) {
-		if (i == metric_name_len || metric_name[i] == '.') {
-			if (segment_len > 0) {
-				size_t j;
-				is_numeric = 1;
-				for (j = 0; j < segment_len; j++) {
-					if (segment[j] < '0' || segment[j] > '9') {
-						is_numeric = 0;
-						break;
-					}
-				}
+	const char *ptr = query;
+	const char *end = query + query_len;
+	while (ptr < end) {
+		const char *amp = memchr(ptr, '&', end - ptr);
+		size_t param_len = amp ? (size_t)(amp - ptr) : (size_t)(end - ptr);
+		const char *eq = memchr(ptr, '=', param_len);
+		if (eq) {
+			size_t key_len = prometheus_url_decode(buf, ptr, eq - ptr);
+			int exact = 0;
+			if ((key_len == 6 && !memcmp(buf, "name[]", 6)) || (key_len == 4 && !memcmp(buf, "name", 4))) {
+				exact = 1;
+			} else if (!(key_len == 6 && !memcmp(buf, "prefix", 6))) {
+				goto next;
+			}
 
-				if (is_numeric && segment_len > 0) {
-					if (label_index < 4) {
-						if (labels_buf->pos > 0) {
-							if (uwsgi_buffer_append(labels_buf, (char *)",", 1)) return -1;
-						}
-						if (uwsgi_buffer_append(labels_buf, label_names[label_index], strlen(label_names[label_index]))) return -1;
-						if (uwsgi_buffer_append(labels_buf, (char *)"=\"", 2)) return -1;
-						if (uwsgi_buffer_append(labels_buf, segment, segment_len)) return -1;
-						if (uwsgi_buffer_append(labels_buf, (char *)"\"", 1)) return -1;
-						label_index++;
-					}
-					in_numeric_sequence = 1;
-				} else {
-					if (name_buf->pos > strlen(prefix) && !in_numeric_sequence) {
-						if (uwsgi_buffer_append(name_buf, (char *)"_", 1)) return -1;
-					}
-					if (uwsgi_buffer_append(name_buf, segment, segment_len)) return -1;
-					in_numeric_sequence = 0;
-				}
-				segment_len = 0;
+			if (!sel->active) {
+				sel->active = 1;
+				uint32_t families_cnt = cache->families_cnt + prometheus_registry.families_cnt + 1;
+				sel->families = prometheus_arena_alloc(arena, sizeof(uint32_t) * families_cnt);
+				sel->modes = prometheus_arena_alloc(arena, families_cnt);
+				if (!sel->families || !sel->modes) return -1;
+				memset(sel->modes, 0, families_cnt);
 			}
-		} else {
-			if (segment_len < sizeof(segment) - 1) {
-				char c = metric_name[i];
-				if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
-				    (c >= '0' && c <= '9') || c == '_') {
-					segment[segment_len++] = c;
-				} else {
-					segment[segment_len++] = '_';
+
+			size_t value_len = prometheus_url_decode(buf, eq + 1, param_len - (eq + 1 - ptr));
+			struct prometheus_trie_node *node = prometheus_trie_find(&prometheus_families_trie, buf, value_len);
+			if (!node) goto next;
+			if (exact) {
+				if (node->family >= 0) prometheus_selection_add(sel, node);
+			} else {
+				uint32_t i;
+				for (i = node->lo; i < node->hi; i++) {
+					prometheus_selection_add(sel, &prometheus_families_trie.nodes[prometheus_families_trie.order[i]]);
 				}
 			}
 		}
+next:
+		ptr += param_len + 1;
 	}
-
 	return 0;
 }
 
-static struct uwsgi_buffer *prometheus_generate_metrics(void) {
-	struct uwsgi_buffer *ub = uwsgi_buffer_new(uwsgi.page_size);
-	if (!ub) {
-		uwsgi_log("[prometheus] Failed to allocate output buffer\n");
-		return NULL;
+
+static int prometheus_render_self_metrics(struct prometheus_scrape_ctx *ctx, int protobuf) {
+	struct uwsgi_buffer *ub = ctx->body;
+	const char *prefix = prometheus_prefix();
+	size_t prefix_len = strlen(prefix);
+	uint64_t reallocs = __atomic_load_n(ump_config.buffer_reallocs, __ATOMIC_RELAXED);
+
+	if (protobuf) {
+		struct uwsgi_buffer *pb = ctx->pb_family;
+		pb->pos = 0;
+		if (prometheus_pb_tag(pb, 1, PROMETHEUS_PB_BYTES)) return -1;
+		if (prometheus_pb_varint(pb, prefix_len + 32)) return -1;
+		if (uwsgi_buffer_append(pb, (char *)prefix, prefix_len)) return -1;
+		if (uwsgi_buffer_append(pb, (char *)"prometheus_buffer_reallocs_total", 32)) return -1;
+		if (ump_config.include_help) {
+			if (prometheus_pb_bytes(pb, 2, "exporter buffer and arena growth events", 39)) return -1;
+		}
+		if (prometheus_pb_uint(pb, 3, PROMETHEUS_PB_COUNTER)) return -1;
+		if (prometheus_pb_metric_value(pb, ump_config.const_labels_pb, ump_config.const_labels_pb_len, UWSGI_METRIC_COUNTER, (double) reallocs)) return -1;
+		return prometheus_pb_family_end(ub, pb);
 	}
 
-	struct uwsgi_buffer *name_buf = uwsgi_buffer_new(256);
-	struct uwsgi_buffer *labels_buf = uwsgi_buffer_new(256);
-	if (!name_buf || !labels_buf) {
-		uwsgi_log("[prometheus] Failed to allocate conversion buffers\n");
-		if (name_buf) uwsgi_buffer_destroy(name_buf);
-		if (labels_buf) uwsgi_buffer_destroy(labels_buf);
-		uwsgi_buffer_destroy(ub);
-		return NULL;
+	if (ump_config.include_help) {
+		if (uwsgi_buffer_append(ub, (char *)"# HELP ", 7)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)prefix, prefix_len)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"prometheus_buffer_reallocs_total exporter buffer and arena growth events\n", 73)) return -1;
 	}
+	if (ump_config.include_type) {
+		if (uwsgi_buffer_append(ub, (char *)"# TYPE ", 7)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)prefix, prefix_len)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"prometheus_buffer_reallocs_total counter\n", 41)) return -1;
+	}
+	if (uwsgi_buffer_append(ub, (char *)prefix, prefix_len)) return -1;
+	if (uwsgi_buffer_append(ub, (char *)"prometheus_buffer_reallocs_total", 32)) return -1;
+	if (ump_config.const_labels_block) {
+		if (uwsgi_buffer_append(ub, (char *)"{", 1)) return -1;
+		if (uwsgi_buffer_append(ub, ump_config.const_labels_block, ump_config.const_labels_block_len)) return -1;
+		if (uwsgi_buffer_append(ub, (char *)"}", 1)) return -1;
+	}
+	if (uwsgi_buffer_append(ub, (char *)" ", 1)) return -1;
+	if (uwsgi_buffer_num64(ub, reallocs)) return -1;
+	return uwsgi_buffer_append(ub, (char *)"\n", 1);
+}
+
+/*
+ * Render a scrape into ctx->body, in the text format or, when protobuf is
+ * set, as delimited MetricFamily messages.
+ */
+static struct uwsgi_buffer *prometheus_generate_metrics(struct prometheus_scrape_ctx *ctx, const char *query, size_t query_len, int protobuf) {
+	if (prometheus_scrape_ctx_init(ctx)) return NULL;
 
-	// Track seen metric names to avoid duplicate HELP/TYPE comments
-	struct seen_metric_name *seen_names = seen_names_create();
+	struct uwsgi_buffer *ub = ctx->body;
+	size_t body_len = ub->len;
+	size_t name_len = ctx->name_buf->len;
+	size_t labels_len = ctx->labels_buf->len;
+	size_t pb_family_len = ctx->pb_family->len;
+	struct uwsgi_buffer *pb = ctx->pb_family;
+	uint32_t i, j;
+	int mode;
 
-	const char *prefix = ump_config.prefix ? ump_config.prefix : "uwsgi_";
+	ub->pos = 0;
 
-	if (!uwsgi.has_metrics || !uwsgi.metrics ) {
+	// exporter-owned metrics are still available without --enable-metrics
+	if ((!uwsgi.has_metrics || !uwsgi.metrics) && !prometheus_registry.base) {
 		uwsgi_log("[prometheus] No metrics available (metrics=%p)\n", uwsgi.metrics);
-		uwsgi_buffer_destroy(name_buf);
-		uwsgi_buffer_destroy(labels_buf);
-		seen_names_destroy(seen_names);
 		return ub;
 	}
 
-	struct uwsgi_metric *um = uwsgi.metrics;
-	while (um){
-		if (!um->name || um->name_len == 0 || !um->value) {
-			um = um->next;
-			continue;
-		}
+	struct prometheus_series_cache *cache = &prometheus_cache;
+	prometheus_cache_update(cache, ctx);
 
-		if (ump_config.no_workers && uwsgi_starts_with(um->name, um->name_len, (char *)"worker.", 7)) {
-			um = um->next;
-			continue;
-		}
+	pthread_rwlock_rdlock(&cache->lock);
 
-		if (prometheus_format_metric_name(name_buf, labels_buf, um->name, um->name_len, prefix) < 0) {
-			uwsgi_log("[prometheus] Failed to format metric: %.*s\n", (int)um->name_len, um->name);
-			um = um->next;
-			continue;
+	struct prometheus_selection sel;
+	if (prometheus_selection_parse(cache, &ctx->arena, query, query_len, &sel)) goto error;
+	uint32_t families_cnt = sel.active ? sel.cnt : cache->families_cnt + prometheus_registry.families_cnt;
+	uint64_t *registry_totals = NULL;
+
+	// Snapshot every selected value under a single metrics lock acquisition
+	int64_t *values = prometheus_arena_alloc(&ctx->arena, sizeof(int64_t) * (cache->series_cnt + 1));
+	if (!values) goto error;
+
+	size_t n = 0;
+	if (cache->series_cnt > 0) {
+		uwsgi_rlock(uwsgi.metrics_lock);
+		for (i = 0; i < families_cnt; i++) {
+			uint32_t family = sel.active ? sel.families[i] : i;
+			if (family >= cache->families_cnt) continue;
+			struct prometheus_family *pf = &cache->families[family];
+			for (j = 0; j < pf->series_cnt; j++) {
+				struct prometheus_series *ps = &pf->series[j];
+				values[n] = *ps->um->value;
+				if (ps->retired) values[n] += *ps->retired;
+				n++;
+			}
 		}
+		uwsgi_rwunlock(uwsgi.metrics_lock);
+	}
 
-		if (name_buf->pos == 0) {
-			um = um->next;
+	n = 0;
+	for (i = 0; i < families_cnt; i++) {
+		uint32_t family = sel.active ? sel.families[i] : i;
+		if (family >= cache->families_cnt) {
+			struct prometheus_registry_family *rf = &prometheus_registry.families[family - cache->families_cnt];
+			if (!prometheus_registry.base) continue;
+			if (!registry_totals) {
+				registry_totals = prometheus_arena_alloc(&ctx->arena, sizeof(uint64_t) * prometheus_registry.slots);
+				if (!registry_totals) goto error;
+				prometheus_registry_sum(registry_totals);
+			}
+			if (protobuf) {
+				pb->pos = 0;
+				if (uwsgi_buffer_append(pb, rf->pb_header, rf->pb_header_len)) goto error;
+				if (rf->render_pb(rf, registry_totals, ctx)) goto error;
+				if (prometheus_pb_family_end(ub, pb)) goto error;
+			} else if (rf->render(rf, registry_totals, ctx)) {
+				goto error;
+			}
 			continue;
 		}
+		struct prometheus_family *pf = &cache->families[family];
+		int64_t *fvalues = values + n;
+		n += pf->series_cnt;
 
-		// Append _total suffix for counter metrics (Prometheus best practice)
-		if (um->type == UWSGI_METRIC_COUNTER) {
-			if (uwsgi_buffer_append(name_buf, (char *)"_total", 6)) {
-				uwsgi_log("[prometheus] Failed to append _total suffix\n");
-				um = um->next;
-				continue;
+		if (!pf->aggregate && protobuf) {
+			pb->pos = 0;
+			if (uwsgi_buffer_append(pb, pf->pb_header, pf->pb_header_len)) goto error;
+			for (j = 0; j < pf->series_cnt; j++) {
+				struct prometheus_series *ps = &pf->series[j];
+				if (prometheus_pb_metric_value(pb, ps->pb_labels, ps->pb_labels_len, pf->type, (double) fvalues[j])) goto error;
 			}
+			if (prometheus_pb_family_end(ub, pb)) goto error;
+			continue;
 		}
 
-		// Only emit HELP and TYPE if we haven't seen this metric name before
-		int is_new_metric = !seen_names_contains(seen_names, name_buf->buf, name_buf->pos);
-		if (is_new_metric) {
-			if (ump_config.include_help) {
-				if (uwsgi_buffer_append(ub, (char *)"# HELP ", 7)) goto error;
-				if (uwsgi_buffer_append(ub, name_buf->buf, name_buf->pos)) goto error;
-				if (uwsgi_buffer_append(ub, (char *)" ", 1)) goto error;
-				if (uwsgi_buffer_append(ub, um->name, um->name_len)) goto error;
-				if (uwsgi_buffer_append(ub, (char *)"\n", 1)) goto error;
+		if (!pf->aggregate) {
+			if (pf->header_len > 0) {
+				if (uwsgi_buffer_append(ub, pf->header, pf->header_len)) goto error;
 			}
-
-			if (ump_config.include_type) {
-				if (uwsgi_buffer_append(ub, (char *)"# TYPE ", 7)) goto error;
-				if (uwsgi_buffer_append(ub, name_buf->buf, name_buf->pos)) goto error;
-
-				const char *prom_type = "untyped";
-				switch (um->type) {
-					case UWSGI_METRIC_COUNTER:
-						prom_type = "counter";
-						break;
-					case UWSGI_METRIC_GAUGE:
-						prom_type = "gauge";
-						break;
-					case UWSGI_METRIC_ABSOLUTE:
-						prom_type = "gauge";
-						break;
-				}
-
-				if (uwsgi_buffer_append(ub, (char *)" ", 1)) goto error;
-				if (uwsgi_buffer_append(ub, (char *)prom_type, strlen(prom_type))) goto error;
+			for (j = 0; j < pf->series_cnt; j++) {
+				struct prometheus_series *ps = &pf->series[j];
+				if (uwsgi_buffer_append(ub, ps->line, ps->line_len)) goto error;
+				if (uwsgi_buffer_num64(ub, fvalues[j])) goto error;
 				if (uwsgi_buffer_append(ub, (char *)"\n", 1)) goto error;
 			}
-
-			// Mark this metric name as seen
-			seen_names = seen_names_add(seen_names, name_buf->buf, name_buf->pos);
+			continue;
 		}
 
-		if (uwsgi_buffer_append(ub, name_buf->buf, name_buf->pos)) goto error;
-
-		if (labels_buf->pos > 0) {
-			if (uwsgi_buffer_append(ub, (char *)"{", 1)) goto error;
-			if (uwsgi_buffer_append(ub, labels_buf->buf, labels_buf->pos)) goto error;
-			if (uwsgi_buffer_append(ub, (char *)"}", 1)) goto error;
+		// Cross-worker aggregation: one pass over the family's value slice
+		int64_t *acc = prometheus_arena_alloc(&ctx->arena, sizeof(int64_t) * PROMETHEUS_AGG_MODES * pf->groups_cnt);
+		if (!acc) goto error;
+		int64_t *sums = acc;
+		int64_t *maxs = acc + pf->groups_cnt;
+		int64_t *mins = acc + (2 * pf->groups_cnt);
+		for (j = 0; j < pf->groups_cnt; j++) {
+			sums[j] = 0;
+			maxs[j] = INT64_MIN;
+			mins[j] = INT64_MAX;
+		}
+		for (j = 0; j < pf->series_cnt; j++) {
+			uint32_t g = pf->series[j].group;
+			int64_t v = fvalues[j];
+			sums[g] += v;
+			maxs[g] = v > maxs[g] ? v : maxs[g];
+			mins[g] = v < mins[g] ? v : mins[g];
 		}
 
-		if (uwsgi_buffer_append(ub, (char *)" ", 1)) goto error;
-
-		uwsgi_rlock(uwsgi.metrics_lock);
-		int64_t value = *um->value;
-		uwsgi_rwunlock(uwsgi.metrics_lock);
+		for (mode = 0; mode < PROMETHEUS_AGG_MODES; mode++) {
+			if (!(ump_config.aggregate & (1 << mode))) continue;
+			if (sel.active && !(sel.modes[family] & (1 << mode))) continue;
+			if (protobuf) {
+				uint8_t type = mode == PROMETHEUS_AGG_SUM ? pf->type : UWSGI_METRIC_GAUGE;
+				pb->pos = 0;
+				if (uwsgi_buffer_append(pb, pf->agg_pb_headers[mode], pf->agg_pb_headers_len[mode])) goto error;
+				for (j = 0; j < pf->groups_cnt; j++) {
+					struct prometheus_agg_group *group = &pf->groups[j];
+					if (prometheus_pb_metric_value(pb, group->pb_labels, group->pb_labels_len, type,
+					                               (double) acc[(mode * pf->groups_cnt) + j])) goto error;
+				}
+				if (prometheus_pb_family_end(ub, pb)) goto error;
+				continue;
+			}
+			if (pf->agg_headers_len[mode] > 0) {
+				if (uwsgi_buffer_append(ub, pf->agg_headers[mode], pf->agg_headers_len[mode])) goto error;
+			}
+			for (j = 0; j < pf->groups_cnt; j++) {
+				struct prometheus_agg_group *group = &pf->groups[j];
+				if (uwsgi_buffer_append(ub, group->lines[mode], group->lines_len[mode])) goto error;
+				if (uwsgi_buffer_num64(ub, acc[(mode * pf->groups_cnt) + j])) goto error;
+				if (uwsgi_buffer_append(ub, (char *)"\n", 1)) goto error;
+			}
+		}
+	}
 
-		if (uwsgi_buffer_num64(ub, value)) goto error;
-		if (uwsgi_buffer_append(ub, (char *)"\n", 1)) goto error;
+	pthread_rwlock_unlock(&cache->lock);
 
-		um = um->next;
+	// Exporter self-metric: lets operators verify the steady state does not realloc
+	if (ump_config.buffer_reallocs && !sel.active) {
+		if (prometheus_render_self_metrics(ctx, protobuf)) goto error_unlocked;
 	}
 
-	uwsgi_buffer_destroy(name_buf);
-	uwsgi_buffer_destroy(labels_buf);
-	seen_names_destroy(seen_names);
+	prometheus_buffer_track(ub, body_len);
+	prometheus_buffer_track(ctx->name_buf, name_len);
+	prometheus_buffer_track(ctx->labels_buf, labels_len);
+	prometheus_buffer_track(pb, pb_family_len);
 	return ub;
 
 error:
-	uwsgi_buffer_destroy(name_buf);
-	uwsgi_buffer_destroy(labels_buf);
-	uwsgi_buffer_destroy(ub);
-	seen_names_destroy(seen_names);
+	pthread_rwlock_unlock(&cache->lock);
+error_unlocked:
+	ub->pos = 0;
 	return NULL;
 }
 
@@ -326,6 +5266,92 @@ error:
  * ===========================================================================
  */
 
+/*
+ * Master: retire what the previous incarnation old of worker i counted
+ * (see RETIRED TOTALS).
+ */
+static void prometheus_retired_respawn(uint32_t i, pid_t old) {
+	struct prometheus_retired *pr = &prometheus_retired;
+	int exited = pr->workers[i].final_pid == old;
+	uint32_t n = uwsgi.numproc, j;
+	if (ump_config.scoreboard) {
+		for (j = 0; j < PROMETHEUS_SB_RETIRED; j++) {
+			uint32_t slot = pr->sb + (prometheus_sb_retired[j] * n) + i;
+			uint64_t final = exited ? pr->final[slot] : pr->last[slot];
+			if (final > pr->start[slot]) pr->totals[slot] += final - pr->start[slot];
+			pr->last[slot] = pr->start[slot];
+		}
+	}
+	if (ump_config.proc) {
+		// the master never reads /proc for this: killed workers get what the last scrape saw
+		if (!exited) prometheus_proc_counters(i, pr->final, old);
+		for (j = 0; j < PROMETHEUS_PROC_COLUMNS; j++) {
+			if (prometheus_proc_columns[j].type != UWSGI_METRIC_COUNTER) continue;
+			uint32_t slot = pr->proc + (j * n) + i;
+			pr->totals[slot] += pr->final[slot];
+		}
+	}
+	prometheus_retired_metrics(i + 1);
+}
+
+/*
+ * Master, every cycle: a new pid or respawn_count is a respawn. It is
+ * handled once the new incarnation has recorded its start counters, which
+ * it does before serving anything.
+ */
+static void prometheus_retired_check(void) {
+	struct prometheus_retired *pr = &prometheus_retired;
+	uint32_t n = uwsgi.numproc, i, j;
+	if (!pr->totals) return;
+	for (i = 0; i < n; i++) {
+		struct uwsgi_worker *w = &uwsgi.workers[i + 1];
+		if (w->pid <= 0) continue;
+		if (w->pid != pr->pids[i] || w->respawn_count != pr->respawns[i]) {
+			if (pr->pids[i] > 0) {
+				if (pr->workers[i].start_pid != w->pid) continue;
+				prometheus_retired_respawn(i, pr->pids[i]);
+			}
+			pr->pids[i] = w->pid;
+			pr->respawns[i] = w->respawn_count;
+		}
+		if (!ump_config.scoreboard) continue;
+		for (j = 0; j < PROMETHEUS_SB_RETIRED; j++) {
+			uint32_t slot = pr->sb + (prometheus_sb_retired[j] * n) + i;
+			uint64_t value = prometheus_sb_counter(i, prometheus_sb_retired[j]);
+			if (value > pr->last[slot]) pr->last[slot] = value;
+		}
+	}
+	prometheus_retired_metrics(0);
+}
+
+/*
+ * Worker, at exit: record the final counters of this incarnation. Forks
+ * of the worker inherit the handler and skip it.
+ */
+static void prometheus_retired_exit(void) {
+	struct prometheus_retired *pr = &prometheus_retired;
+	uint32_t i = uwsgi.mywid - 1;
+	if (getpid() != pr->workers[i].start_pid) return;
+	if (ump_config.scoreboard) prometheus_sb_counters(i, pr->final);
+	if (ump_config.proc) prometheus_proc_counters(i, pr->final, 0);
+	__sync_synchronize();
+	pr->workers[i].final_pid = getpid();
+}
+
+/*
+ * Worker, from post_fork: record the start counters, before the master
+ * may look at them.
+ */
+static void prometheus_retired_start(void) {
+	struct prometheus_retired *pr = &prometheus_retired;
+	if (!pr->totals || uwsgi.mywid <= 0) return;
+	uint32_t i = uwsgi.mywid - 1;
+	if (ump_config.scoreboard) prometheus_sb_counters(i, pr->start);
+	__sync_synchronize();
+	pr->workers[i].start_pid = getpid();
+	atexit(prometheus_retired_exit);
+}
+
 /**
  * Handle incoming connection on dedicated metrics server
  *
@@ -335,84 +5361,28 @@ error:
  * Called from master_cycle hook when server_fd has activity.
  */
 static void prometheus_server_handle_request(void) {
-	struct sockaddr_un client_src;
-	socklen_t client_src_len = sizeof(struct sockaddr_un);
-
-	// Accept connection
-	int client_fd = accept(ump_config.server_fd, (struct sockaddr *) &client_src, &client_src_len);
-	if (client_fd < 0) {
-		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
-			uwsgi_error("[prometheus] accept()");
-		}
-		return;
-	}
+	struct prometheus_http_request req;
+	int client_fd = prometheus_http_accept(ump_config.server_fd, &req);
+	if (client_fd < 0) return;
 
-	// Set socket to blocking mode for simplicity
-	int flags = fcntl(client_fd, F_GETFL, 0);
-	fcntl(client_fd, F_SETFL, flags & ~O_NONBLOCK);
-
-	// Read HTTP request (we don't actually parse it, just read and discard)
-	char request_buf[4096];
-	ssize_t rlen = read(client_fd, request_buf, sizeof(request_buf) - 1);
-	if (rlen <= 0) {
-		close(client_fd);
-		return;
-	}
+	int topk = ump_config.topk && req.path_len == 11 && !memcmp(req.path, "/debug/topk", 11);
+	int protobuf = req.accept && prometheus_accepts_protobuf(req.accept, req.accept_len);
 
 	// Generate metrics
-	struct uwsgi_buffer *metrics = prometheus_generate_metrics();
+	struct prometheus_scrape_ctx *ctx = &prometheus_master_ctx;
+	struct uwsgi_buffer *metrics = topk ? prometheus_topk_json(ctx) : prometheus_generate_metrics(ctx, req.query, req.query_len, protobuf);
 	if (!metrics) {
-		const char *response =
-			"HTTP/1.0 500 Internal Server Error\r\n"
-			"Content-Type: text/plain\r\n"
-			"Content-Length: 28\r\n"
-			"\r\n"
-			"Failed to generate metrics\n";
-		if (write(client_fd, response, strlen(response)) < 0) {
-			uwsgi_error("[prometheus] write()");
+		prometheus_http_error(client_fd);
+	} else {
+		// the headers go to the context's header buffer
+		size_t head_len = ctx->head->len;
+		const char *content_type = topk ? "application/json" : protobuf ? PROMETHEUS_PB_CONTENT_TYPE : PROMETHEUS_TEXT_CONTENT_TYPE;
+		if (!prometheus_http_respond(client_fd, ctx->head, content_type, metrics)) {
+			prometheus_buffer_track(ctx->head, head_len);
 		}
-		close(client_fd);
-		return;
 	}
 
-	// Build HTTP response
-	struct uwsgi_buffer *response = uwsgi_buffer_new(uwsgi.page_size);
-	if (!response) {
-		uwsgi_buffer_destroy(metrics);
-		close(client_fd);
-		return;
-	}
-
-	// Status line
-	uwsgi_buffer_append(response, (char *)"HTTP/1.0 200 OK\r\n", 17);
-
-	// Headers
-	uwsgi_buffer_append(response, (char *)"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n", 56);
-
-	// Content-Length
-	uwsgi_buffer_append(response, (char *)"Content-Length: ", 16);
-	uwsgi_buffer_num64(response, metrics->pos);
-	uwsgi_buffer_append(response, (char *)"\r\n", 2);
-
-	// Connection header
-	uwsgi_buffer_append(response, (char *)"Connection: close\r\n", 19);
-
-	// End of headers
-	uwsgi_buffer_append(response, (char *)"\r\n", 2);
-
-	// Send headers
-	if (write(client_fd, response->buf, response->pos) < 0) {
-		uwsgi_error("[prometheus] write()");
-	}
-
-	// Send body
-	if (write(client_fd, metrics->buf, metrics->pos) < 0) {
-		uwsgi_error("[prometheus] write()");
-	}
-
-	// Cleanup
-	uwsgi_buffer_destroy(response);
-	uwsgi_buffer_destroy(metrics);
+	prometheus_scrape_ctx_end(ctx);
 	close(client_fd);
 }
 
@@ -422,6 +5392,9 @@ static void prometheus_server_handle_request(void) {
  * Checks if there's activity on our server socket and handles it.
  */
 static void prometheus_master_cycle(void) {
+	prometheus_sampler_start();
+	prometheus_retired_check();
+
 	// Only run if server is configured
 	if (ump_config.server_fd < 0) return;
 
@@ -438,11 +5411,95 @@ static void prometheus_master_cycle(void) {
 	}
 }
 
+/*
+ * A graceful reload re-executes the master: the server socket is kept open
+ * across exec() and its fd is passed in the environment, so scrapes queue
+ * in the kernel during the reload instead of being refused. The inherited
+ * socket is only reused if it is still bound to the configured address.
+ */
+#define PROMETHEUS_SERVER_FD_ENV "UWSGI_PROMETHEUS_FD"
+
+// does addr match --prometheus-server (":port", "host:port", "[ipv6]:port" or a unix path)?
+static int prometheus_server_same_address(struct sockaddr *sa, const char *tcp_port) {
+	if (!tcp_port) {
+		struct sockaddr_un *un = (struct sockaddr_un *) sa;
+		if (sa->sa_family != AF_UNIX) return 0;
+		// abstract sockets start with a nul byte, written '@' in the option
+		if (ump_config.server_address[0] == '@') return !un->sun_path[0] && !strcmp(un->sun_path + 1, ump_config.server_address + 1);
+		return !strcmp(un->sun_path, ump_config.server_address);
+	}
+
+	char *host = prometheus_address_host(ump_config.server_address, tcp_port);
+	struct addrinfo hints, *res = NULL, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	int match = 0;
+	if (!getaddrinfo(host, tcp_port + 1, &hints, &res)) {
+		for (ai = res; ai && !match; ai = ai->ai_next) {
+			if (ai->ai_family != sa->sa_family) continue;
+			if (sa->sa_family == AF_INET) {
+				struct sockaddr_in *a = (struct sockaddr_in *) sa, *b = (struct sockaddr_in *) ai->ai_addr;
+				match = a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+			} else if (sa->sa_family == AF_INET6) {
+				struct sockaddr_in6 *a = (struct sockaddr_in6 *) sa, *b = (struct sockaddr_in6 *) ai->ai_addr;
+				match = a->sin6_port == b->sin6_port && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+			}
+		}
+		freeaddrinfo(res);
+	}
+	free(host);
+	return match;
+}
+
+static int prometheus_server_inherit(const char *tcp_port) {
+	char *env = getenv(PROMETHEUS_SERVER_FD_ENV);
+	if (!env) return -1;
+
+	int fd = atoi(env);
+	unsetenv(PROMETHEUS_SERVER_FD_ENV);
+	int listening = 0;
+	socklen_t len = sizeof(listening);
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+		struct sockaddr_un un;
+	} addr;
+	socklen_t addr_len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) || !listening ||
+	    getsockname(fd, &addr.sa, &addr_len)) {
+		return -1;
+	}
+	if (!prometheus_server_same_address(&addr.sa, tcp_port)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * master_cleanup: the last hook before the reload's exec(). Only now is the
+ * socket left open across exec() and announced in the environment, so that
+ * attach-daemons, hooks and other children exec'ed before never see it.
+ * The master does not return from here: it either execs or exits.
+ */
+static void prometheus_server_cleanup(void) {
+	char fd_env[16];
+	if (ump_config.server_fd < 0) return;
+	snprintf(fd_env, sizeof(fd_env), "%d", ump_config.server_fd);
+	fcntl(ump_config.server_fd, F_SETFD, fcntl(ump_config.server_fd, F_GETFD) & ~FD_CLOEXEC);
+	setenv(PROMETHEUS_SERVER_FD_ENV, fd_env, 1);
+}
+
 /**
  * Initialize dedicated metrics server
  *
- * Called during post_init (after workers forked, in master process).
- * Creates socket and sets it to non-blocking.
+ * Called during post_init (in the master, before workers are forked).
+ * Creates socket, or takes it over from the previous master, and sets it
+ * to non-blocking.
  */
 static void prometheus_server_init(void) {
 	if (!ump_config.server_address) return;
@@ -450,9 +5507,12 @@ static void prometheus_server_init(void) {
 	uwsgi_log("[prometheus] Initializing dedicated metrics server on %s\n", ump_config.server_address);
 
 	// Parse address (TCP port or Unix socket)
-	char *tcp_port = strchr(ump_config.server_address, ':');
+	char *tcp_port = strrchr(ump_config.server_address, ':');
 
-	if (tcp_port) {
+	ump_config.server_fd = prometheus_server_inherit(tcp_port);
+	if (ump_config.server_fd >= 0) {
+		uwsgi_log("[prometheus] reusing the metrics server socket of the previous master (fd %d)\n", ump_config.server_fd);
+	} else if (tcp_port) {
 		// TCP socket
 		ump_config.server_fd = bind_to_tcp(ump_config.server_address, uwsgi.listen_queue, tcp_port);
 	} else {
@@ -468,6 +5528,11 @@ static void prometheus_server_init(void) {
 	// Set socket to non-blocking
 	uwsgi_socket_nb(ump_config.server_fd);
 
+	// Keep it for the next master: not closed by the reload, but not passed
+	// to anything else exec'ed until then (see prometheus_server_cleanup)
+	fcntl(ump_config.server_fd, F_SETFD, fcntl(ump_config.server_fd, F_GETFD) | FD_CLOEXEC);
+	uwsgi_add_safe_fd(ump_config.server_fd);
+
 	uwsgi_log("[prometheus] *** Dedicated metrics server enabled on %s fd: %d ***\n",
 	          ump_config.server_address, ump_config.server_fd);
 	uwsgi_log("[prometheus] Metrics available at: http://<host>%s/metrics (or just access the address)\n",
@@ -481,7 +5546,7 @@ static void prometheus_server_init(void) {
  */
 
 static int uwsgi_routing_func_prometheus_metrics(struct wsgi_request *wsgi_req, struct uwsgi_route *ur) {
-	if (!uwsgi.has_metrics || !uwsgi.metrics) {
+	if ((!uwsgi.has_metrics || !uwsgi.metrics) && !prometheus_registry.base) {
 		uwsgi_log("[prometheus] Metrics subsystem not initialized. Did you enable metrics with --enable-metrics?\n");
 		if (uwsgi_response_prepare_headers(wsgi_req, (char *)"503 Service Unavailable", 23)) {
 			return UWSGI_ROUTE_BREAK;
@@ -491,7 +5556,17 @@ static int uwsgi_routing_func_prometheus_metrics(struct wsgi_request *wsgi_req,
 		return UWSGI_ROUTE_BREAK;
 	}
 
-	struct uwsgi_buffer *metrics = prometheus_generate_metrics();
+	if (!prometheus_core_ctx) {
+		prometheus_core_ctx = uwsgi_calloc(sizeof(struct prometheus_scrape_ctx) * uwsgi.cores);
+	}
+
+	uint16_t accept_len = 0;
+	char *accept = uwsgi_get_var(wsgi_req, (char *)"HTTP_ACCEPT", 11, &accept_len);
+	int protobuf = prometheus_accepts_protobuf(accept, accept_len);
+
+	struct prometheus_scrape_ctx *ctx = &prometheus_core_ctx[wsgi_req->async_id];
+	struct uwsgi_buffer *metrics = prometheus_generate_metrics(ctx, wsgi_req->query_string, wsgi_req->query_string_len, protobuf);
+	prometheus_scrape_ctx_end(ctx);
 	if (!metrics) {
 		uwsgi_log("[prometheus] Failed to generate metrics buffer\n");
 		if (uwsgi_response_prepare_headers(wsgi_req, (char *)"500 Internal Server Error", 25)) {
@@ -503,31 +5578,63 @@ static int uwsgi_routing_func_prometheus_metrics(struct wsgi_request *wsgi_req,
 	}
 
 	if (uwsgi_response_prepare_headers(wsgi_req, (char *)"200 OK", 6)) {
-		uwsgi_buffer_destroy(metrics);
 		return UWSGI_ROUTE_BREAK;
 	}
 
-	if (uwsgi_response_add_content_type(wsgi_req, (char *)"text/plain; version=0.0.4; charset=utf-8", 40)) {
-		uwsgi_buffer_destroy(metrics);
+	if (protobuf) {
+		if (uwsgi_response_add_content_type(wsgi_req, (char *)PROMETHEUS_PB_CONTENT_TYPE, sizeof(PROMETHEUS_PB_CONTENT_TYPE) - 1)) {
+			return UWSGI_ROUTE_BREAK;
+		}
+	} else if (uwsgi_response_add_content_type(wsgi_req, (char *)"text/plain; version=0.0.4; charset=utf-8", 40)) {
 		return UWSGI_ROUTE_BREAK;
 	}
 
 	if (uwsgi_response_add_content_length(wsgi_req, metrics->pos)) {
-		uwsgi_buffer_destroy(metrics);
 		return UWSGI_ROUTE_BREAK;
 	}
 
-	if (uwsgi_response_write_body_do(wsgi_req, metrics->buf, metrics->pos)) {
-		uwsgi_buffer_destroy(metrics);
+	uwsgi_response_write_body_do(wsgi_req, metrics->buf, metrics->pos);
+	return UWSGI_ROUTE_BREAK;
+}
+
+static int uwsgi_router_prometheus_metrics(struct uwsgi_route *ur, char *args) {
+	ur->func = uwsgi_routing_func_prometheus_metrics;
+	ur->data = args;
+	ur->data_len = args ? strlen(args) : 0;
+	return 0;
+}
+
+static int uwsgi_routing_func_prometheus_topk(struct wsgi_request *wsgi_req, struct uwsgi_route *ur) {
+	if (!prometheus_topk_paths.base) {
+		if (uwsgi_response_prepare_headers(wsgi_req, (char *)"404 Not Found", 13)) {
+			return UWSGI_ROUTE_BREAK;
+		}
+		const char *error_msg = "Heavy hitters tracking is disabled. Enable with --prometheus-topk\n";
+		uwsgi_response_write_body_do(wsgi_req, (char *)error_msg, strlen(error_msg));
+		return UWSGI_ROUTE_BREAK;
+	}
+
+	struct prometheus_scrape_ctx *ctx = &prometheus_core_ctx[wsgi_req->async_id];
+	struct uwsgi_buffer *json = prometheus_topk_json(ctx);
+	prometheus_scrape_ctx_end(ctx);
+	if (!json) {
+		if (uwsgi_response_prepare_headers(wsgi_req, (char *)"500 Internal Server Error", 25)) {
+			return UWSGI_ROUTE_BREAK;
+		}
+		const char *error_msg = "Failed to generate heavy hitters\n";
+		uwsgi_response_write_body_do(wsgi_req, (char *)error_msg, strlen(error_msg));
 		return UWSGI_ROUTE_BREAK;
 	}
 
-	uwsgi_buffer_destroy(metrics);
+	if (uwsgi_response_prepare_headers(wsgi_req, (char *)"200 OK", 6)) return UWSGI_ROUTE_BREAK;
+	if (uwsgi_response_add_content_type(wsgi_req, (char *)"application/json", 16)) return UWSGI_ROUTE_BREAK;
+	if (uwsgi_response_add_content_length(wsgi_req, json->pos)) return UWSGI_ROUTE_BREAK;
+	uwsgi_response_write_body_do(wsgi_req, json->buf, json->pos);
 	return UWSGI_ROUTE_BREAK;
 }
 
-static int uwsgi_router_prometheus_metrics(struct uwsgi_route *ur, char *args) {
-	ur->func = uwsgi_routing_func_prometheus_metrics;
+static int uwsgi_router_prometheus_topk(struct uwsgi_route *ur, char *args) {
+	ur->func = uwsgi_routing_func_prometheus_topk;
 	ur->data = args;
 	ur->data_len = args ? strlen(args) : 0;
 	return 0;
@@ -544,18 +5651,118 @@ static void metrics_prometheus_init(void) {
 	ump_config.include_help = 1;
 	ump_config.include_type = 1;
 	ump_config.server_fd = -1;  // No server by default
+	ump_config.native_schema = 3;
+	ump_config.quantile_window = 60;
+	ump_config.topk_window = 60;
+	ump_config.cardinality_window = 60;
+	ump_config.sample_rate = 100;
+	ump_config.proc_refresh = 1000;
+	ump_config.proc_threads = 1;
+	ump_config.cgroup_refresh = 1000;
+	ump_config.sample_window = 15;
+
+	// Shared so that every worker and the master report the same counter
+	ump_config.buffer_reallocs = uwsgi_calloc_shared(sizeof(uint64_t));
 
 	// Register route handler
 	uwsgi_register_router("prometheus-metrics", uwsgi_router_prometheus_metrics);
+	uwsgi_register_router("prometheus-topk", uwsgi_router_prometheus_topk);
 
 	uwsgi_log("*** Prometheus metrics exporter plugin loaded ***\n");
 }
 
 /**
- * Post-init hook - called after workers forked, in master process only
- * This is where we initialize the dedicated server if configured.
+ * Post-init hook - called in the master before workers are forked
+ * This is where we compile the configuration, map the shared memory registry
+ * and initialize the dedicated server if configured.
  */
 static void metrics_prometheus_post_init(void) {
+	struct uwsgi_string_list *usl;
+	uwsgi_foreach(usl, ump_config.aggregate_modes) {
+		int mode;
+		for (mode = 0; mode < PROMETHEUS_AGG_MODES; mode++) {
+			if (!strcmp(usl->value, prometheus_agg_names[mode])) break;
+		}
+		if (mode == PROMETHEUS_AGG_MODES) {
+			uwsgi_log("[prometheus] ERROR: invalid aggregation mode '%s' (use sum, max or min)\n", usl->value);
+			uwsgi_exit(1);
+		}
+		ump_config.aggregate |= (1 << mode);
+	}
+
+	prometheus_filter_compile(ump_config.include);
+	prometheus_filter_compile(ump_config.exclude);
+
+	uwsgi_foreach(usl, ump_config.label_rules) {
+		prometheus_rule_compile(usl->value);
+	}
+
+	prometheus_const_labels_compile();
+
+	if (ump_config.native_histograms) {
+		if (ump_config.native_schema < 0 || ump_config.native_schema > 8) {
+			uwsgi_log("[prometheus] ERROR: native histogram schema must be between 0 and 8\n");
+			uwsgi_exit(1);
+		}
+		if (ump_config.const_labels_block) {
+			ump_config.const_labels_pb = prometheus_pb_labels(ump_config.const_labels_block, ump_config.const_labels_block_len,
+			                                                  &ump_config.const_labels_pb_len);
+			if (!ump_config.const_labels_pb) uwsgi_exit(1);
+		}
+		ump_config.request_metrics = 1;
+	}
+	if (ump_config.topk) {
+		if (ump_config.topk < 0 || ump_config.topk > PROMETHEUS_TOPK_MAX) {
+			uwsgi_log("[prometheus] ERROR: --prometheus-topk must be between 1 and %d\n", PROMETHEUS_TOPK_MAX);
+			uwsgi_exit(1);
+		}
+		if (ump_config.topk_window <= 0) {
+			uwsgi_log("[prometheus] ERROR: --prometheus-topk-window must be a positive number of seconds\n");
+			uwsgi_exit(1);
+		}
+	}
+	if (ump_config.cardinality && ump_config.cardinality_window <= 0) {
+		uwsgi_log("[prometheus] ERROR: --prometheus-cardinality-window must be a positive number of seconds\n");
+		uwsgi_exit(1);
+	}
+	if (ump_config.quantiles || ump_config.route_groups || ump_config.topk || ump_config.cardinality) {
+		ump_config.request_metrics = 1;
+	}
+
+	if (ump_config.request_metrics) {
+		prometheus_request_metrics_declare();
+	}
+	if (ump_config.scoreboard) {
+		prometheus_sb_declare();
+	}
+	if (ump_config.proc) {
+		prometheus_proc_declare();
+	}
+	if (ump_config.listen_queue) {
+		prometheus_listen_declare();
+	}
+	if (ump_config.cgroup) {
+		prometheus_cg_declare();
+	}
+	if (ump_config.samples) {
+		// the sampler thread runs in the master
+		if (!uwsgi.master_process) {
+			uwsgi_log("[prometheus] ERROR: --prometheus-sample requires master mode. Add 'master = true' to your config.\n");
+			uwsgi_exit(1);
+		}
+		prometheus_sampler_declare();
+	}
+	prometheus_registry_allocate();
+	prometheus_retired_allocate();
+	if (ump_config.topk) {
+		prometheus_topk_allocate(&prometheus_topk_paths);
+		prometheus_topk_allocate(&prometheus_topk_clients);
+	}
+	if (ump_config.cardinality) {
+		prometheus_hll_allocate(&prometheus_hll_clients);
+		prometheus_hll_allocate(&prometheus_hll_paths);
+	}
+
 	// Only initialize server if we're the master process
 	if (ump_config.server_address) {
 		if (uwsgi.master_process) {
@@ -566,14 +5773,69 @@ static void metrics_prometheus_post_init(void) {
 	}
 }
 
+/*
+ * The master's sampler thread may have held a lock while forking, and the
+ * descriptors the master opened are inherited: their offsets (getdents64 on
+ * /proc directories) and netlink replies would be shared with it. Every
+ * process gets fresh locks and opens its own descriptors on first use.
+ */
+static void prometheus_fork_reset(void) {
+	struct prometheus_listen *pl = &prometheus_listen;
+	struct prometheus_cgroup *pc = &prometheus_cgroup;
+	uint32_t file;
+
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_mutex_init(&prometheus_proc.lock, NULL);
+	pthread_mutex_init(&pc->lock, NULL);
+
+	if (pl->nl_fd >= 0) close(pl->nl_fd);
+	pl->nl_fd = -1;
+	if (pc->opened) {
+		for (file = 0; file < PROMETHEUS_CG_FILES; file++) {
+			if (pc->fds[file] >= 0) close(pc->fds[file]);
+		}
+		pc->opened = 0;
+	}
+#ifdef __linux__
+	prometheus_proc_reset();
+#endif
+}
+
+/**
+ * Post-fork hook - called in every worker
+ * Allocates the per-core scrape contexts used by the route handler and
+ * installs the request metrics hook.
+ */
+static void metrics_prometheus_post_fork(void) {
+	prometheus_fork_reset();
+	prometheus_retired_start();
+
+	if (!prometheus_core_ctx) {
+		prometheus_core_ctx = uwsgi_calloc(sizeof(struct prometheus_scrape_ctx) * uwsgi.cores);
+	}
+
+	// Join the core's after-request chain (symbols in it are already resolved)
+	if (ump_config.request_metrics && uwsgi.mywid > 0) {
+		if (ump_config.route_groups) {
+			prometheus_routes.cache = uwsgi_calloc(sizeof(struct prometheus_route_set) * PROMETHEUS_ROUTE_SETS * uwsgi.cores);
+		}
+		struct uwsgi_string_list *usl = uwsgi_string_new_list(&uwsgi.after_request_hooks, (char *)"prometheus_after_request");
+		usl->custom_ptr = prometheus_after_request;
+	}
+}
+
 struct uwsgi_plugin metrics_prometheus_plugin = {
 	.name = "metrics_prometheus",
 	.options = metrics_prometheus_options,
 	.on_load = metrics_prometheus_init,
 	.post_init = metrics_prometheus_post_init,
+	.post_fork = metrics_prometheus_post_fork,
 	.master_cycle = prometheus_master_cycle,
+	.master_cleanup = prometheus_server_cleanup,
 };
 
+#endif
+
 #else
 struct uwsgi_plugin metrics_prometheus_plugin = {
 	.name = "metrics_prometheus",
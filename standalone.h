@@ -0,0 +1,137 @@
+/*
+ * ===========================================================================
+ * uWSGI API subset for the standalone exporter
+ * ===========================================================================
+ *
+ * plugin.c is built a second time, with PROMETHEUS_STANDALONE defined, into
+ * an exporter that runs outside of uWSGI (see exporter.c). Only its
+ * configuration, utility, label rule and HTTP server sections are compiled
+ * then, and this header provides the few uWSGI types and helpers they use,
+ * with the same semantics as the core ones.
+ */
+
+#ifndef PROMETHEUS_STANDALONE_H
+#define PROMETHEUS_STANDALONE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <strings.h>
+
+#define UMAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define UWSGI_METRIC_COUNTER  0
+#define UWSGI_METRIC_GAUGE    1
+#define UWSGI_METRIC_ABSOLUTE 2
+
+#define uwsgi_log(...) fprintf(stderr, __VA_ARGS__)
+#define uwsgi_error(x) uwsgi_log("%s: %s [%s line %d]\n", x, strerror(errno), __FILE__, __LINE__)
+#define uwsgi_exit(x) exit(x)
+#define uwsgi_foreach(x, y) for (x = y; x; x = x->next)
+
+struct uwsgi_string_list {
+	char *value;
+	size_t len;
+	struct uwsgi_string_list *next;
+};
+
+struct uwsgi_buffer {
+	char *buf;
+	size_t pos;
+	size_t len;
+};
+
+static inline void *uwsgi_malloc(size_t size) {
+	void *ptr = malloc(size);
+	if (!ptr) {
+		uwsgi_error("malloc()");
+		uwsgi_exit(1);
+	}
+	return ptr;
+}
+
+static inline void *uwsgi_calloc(size_t size) {
+	void *ptr = uwsgi_malloc(size);
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+static inline char *uwsgi_strncopy(char *s, size_t len) {
+	char *copy = uwsgi_malloc(len + 1);
+	memcpy(copy, s, len);
+	copy[len] = 0;
+	return copy;
+}
+
+static inline int uwsgi_starts_with(char *src, int slen, char *dst, int dlen) {
+	if (slen < dlen) return -1;
+	return memcmp(src, dst, dlen) ? -1 : 0;
+}
+
+static inline struct uwsgi_string_list *uwsgi_string_new_list(struct uwsgi_string_list **list, char *value) {
+	struct uwsgi_string_list *usl = uwsgi_calloc(sizeof(struct uwsgi_string_list));
+	usl->value = value;
+	usl->len = strlen(value);
+	while (*list) list = &(*list)->next;
+	*list = usl;
+	return usl;
+}
+
+static inline struct uwsgi_buffer *uwsgi_buffer_new(size_t len) {
+	struct uwsgi_buffer *ub = uwsgi_calloc(sizeof(struct uwsgi_buffer));
+	if (len) {
+		ub->buf = uwsgi_malloc(len);
+		ub->len = len;
+	}
+	return ub;
+}
+
+static inline int uwsgi_buffer_fix(struct uwsgi_buffer *ub, size_t len) {
+	if (ub->len >= len) return 0;
+	size_t new_len = UMAX(len, ub->len * 2);
+	char *buf = realloc(ub->buf, new_len);
+	if (!buf) {
+		uwsgi_error("uwsgi_buffer_fix()");
+		return -1;
+	}
+	ub->buf = buf;
+	ub->len = new_len;
+	return 0;
+}
+
+static inline int uwsgi_buffer_append(struct uwsgi_buffer *ub, char *buf, size_t len) {
+	if (uwsgi_buffer_fix(ub, ub->pos + len)) return -1;
+	memcpy(ub->buf + ub->pos, buf, len);
+	ub->pos += len;
+	return 0;
+}
+
+static inline int uwsgi_buffer_num64(struct uwsgi_buffer *ub, int64_t num) {
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%lld", (long long) num);
+	if (len <= 0 || (size_t) len >= sizeof(buf)) return -1;
+	return uwsgi_buffer_append(ub, buf, len);
+}
+
+static inline void uwsgi_buffer_destroy(struct uwsgi_buffer *ub) {
+	free(ub->buf);
+	free(ub);
+}
+
+#endif
@@ -242,6 +242,31 @@ fi
 run_test "Worker metrics are present"
 validate_metric_present "/tmp/metrics_route_after.txt" "uwsgi_workerrequests"
 
+run_test "Request duration histogram is present"
+validate_metric_present "/tmp/metrics_route_after.txt" 'uwsgi_request_duration_seconds_bucket{le="+Inf"}'
+
+run_test "Requests are counted by status code and method"
+validate_metric_present "/tmp/metrics_route_after.txt" 'uwsgi_requests_total{code="2xx",method="GET"}'
+
+run_test "Route group metrics are present"
+validate_metric_present "/tmp/metrics_route_after.txt" 'uwsgi_route_requests_total{route="root",code="2xx"}'
+
+run_test "Request latency quantiles are present"
+validate_metric_present "/tmp/metrics_route_after.txt" 'uwsgi_request_latency_seconds{quantile="0.99"}'
+
+run_test "Top paths are ranked"
+validate_metric_present "/tmp/metrics_route_after.txt" 'uwsgi_top_paths_requests{rank="1",path="/"}'
+
+run_test "Distinct client estimate is present"
+validate_metric_present "/tmp/metrics_route_after.txt" 'uwsgi_unique_clients 1$'
+
+run_test "Top-K debug endpoint serves JSON"
+if curl --max-time 5 -s "http://127.0.0.1:8082/debug/topk" | grep -q '"paths":\[{"rank":1,"key":"/"'; then
+    success "Top-K JSON lists the most frequent path"
+else
+    fail "Top-K JSON is missing or empty"
+fi
+
 info "Stopping uWSGI (route handler test)..."
 kill $UWSGI_PID 2>/dev/null || true
 sleep 0.5
@@ -261,6 +286,9 @@ echo "========================================="
 echo ""
 
 info "Starting uWSGI with dedicated server configuration..."
+rm -f /tmp/uwsgi_prometheus_test.state
+rm -rf /tmp/uwsgi_prometheus_test_metrics
+mkdir -p /tmp/uwsgi_prometheus_test_metrics
 ./uwsgi --ini plugins/metrics_prometheus/t/dedicated_server.ini > /tmp/uwsgi_server.log 2>&1 &
 UWSGI_PID=$!
 
@@ -292,6 +320,15 @@ validate_prometheus_format "http://127.0.0.1:9091" "/tmp/metrics_server.txt"
 run_test "Metrics work on any path"
 validate_http_response "http://127.0.0.1:9091/any/path" "200"
 
+run_test "Query string selects metric families"
+curl -g --max-time 5 -s "http://127.0.0.1:9091/metrics?name[]=uwsgi_workerrequests_total" > "/tmp/metrics_server_selected.txt"
+if grep -q "^uwsgi_workerrequests_total" "/tmp/metrics_server_selected.txt" && \
+   [ -z "$(grep -v '^#' /tmp/metrics_server_selected.txt | grep -v '^uwsgi_workerrequests_total')" ]; then
+    success "Only the selected family is returned"
+else
+    fail "Selection returned unexpected families"
+fi
+
 # Generate traffic and check metrics update
 generate_traffic "http://127.0.0.1:8081/" 10
 
@@ -308,6 +345,175 @@ fi
 run_test "Worker metrics are present"
 validate_metric_present "/tmp/metrics_server_after.txt" "uwsgi_workerrequests"
 
+run_test "Constant labels are attached to every series"
+if [ -z "$(grep -v '^#' /tmp/metrics_server_after.txt | grep -v 'app="uwsgi-test"')" ]; then
+    success "Every series carries app=\"uwsgi-test\""
+else
+    fail "Some series are missing the constant label"
+fi
+
+run_test "Worker scoreboard families are present"
+validate_metric_present "/tmp/metrics_server_after.txt" 'uwsgi_worker_state{worker="1",state="idle"'
+
+run_test "Request counters survive worker respawns"
+# An incarnation serves at most max-requests (3). Only the retired totals
+# can put a worker above that, and above what the stats server reports for
+# its current incarnation.
+curl --max-time 5 -s "http://127.0.0.1:9191" > /tmp/metrics_server_stats.json
+if python3 - /tmp/metrics_server_after.txt /tmp/metrics_server_stats.json <<'PYEOF'
+import json, re, sys
+exported = {}
+for line in open(sys.argv[1]):
+    m = re.match(r'uwsgi_worker_requests_total\{worker="(\d+)"[^}]*\} (\d+)', line)
+    if m:
+        exported[int(m.group(1))] = int(m.group(2))
+raw = dict((w['id'], w['requests']) for w in json.load(open(sys.argv[2]))['workers'])
+carried = [wid for wid, value in exported.items() if value > 3 and value > raw.get(wid, 0)]
+print("exported %s, current incarnations %s" % (exported, raw))
+sys.exit(0 if carried else 1)
+PYEOF
+then
+    success "A respawned worker kept the requests of its previous incarnations"
+else
+    fail "No worker counted more than one incarnation's requests"
+fi
+
+run_test "Sampled gauges are present"
+validate_metric_present "/tmp/metrics_server_after.txt" 'uwsgi_busy_workers_max'
+
+run_test "Listen queue backlog is read from the kernel"
+validate_metric_present "/tmp/metrics_server_after.txt" 'uwsgi_listen_queue_backlog{socket="127.0.0.1:8081"'
+
+run_test "Per-worker /proc stats are present"
+validate_metric_present "/tmp/metrics_server_after.txt" 'uwsgi_process_cpu_seconds_total{worker="1"'
+
+run_test "Scheduler wait time is present"
+validate_metric_present "/tmp/metrics_server_after.txt" 'uwsgi_process_sched_wait_seconds_total{worker="1"'
+
+run_test "Cgroup CPU usage is present"
+if grep -q ' - cgroup2 ' /proc/self/mountinfo 2>/dev/null; then
+    validate_metric_present "/tmp/metrics_server_after.txt" 'uwsgi_cgroup_cpu_usage_seconds_total'
+else
+    info "no cgroup v2 mounted - skipping"
+fi
+
+run_test "Protobuf is served when requested"
+content_type=$(curl --max-time 5 -s -o /dev/null -D - \
+    -H 'Accept: application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited;q=0.7,text/plain;version=0.0.4;q=0.3' \
+    "http://127.0.0.1:9091" | grep -i "content-type" | cut -d: -f2 | tr -d ' \r')
+if echo "$content_type" | grep -q "application/vnd.google.protobuf"; then
+    success "Content-Type is protobuf: $content_type"
+else
+    fail "Expected a protobuf Content-Type, got: $content_type"
+fi
+
+run_test "Untyped families carry an untyped value in protobuf"
+curl --max-time 5 -s \
+    -H 'Accept: application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited' \
+    "http://127.0.0.1:9091" > /tmp/metrics_server.pb
+# MetricFamily.type (field 3) must be UNTYPED (3) and every Metric must hold Metric.untyped (field 5)
+if python3 - /tmp/metrics_server.pb uwsgi_test_alias <<'PYEOF'
+import sys
+
+def varint(buf, pos):
+    value = shift = 0
+    while True:
+        b = buf[pos]
+        pos += 1
+        value |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return value, pos
+
+def fields(buf):
+    pos = 0
+    while pos < len(buf):
+        key, pos = varint(buf, pos)
+        wire = key & 7
+        if wire == 0:
+            value, pos = varint(buf, pos)
+        elif wire == 1:
+            value, pos = buf[pos:pos + 8], pos + 8
+        elif wire == 2:
+            size, pos = varint(buf, pos)
+            value, pos = buf[pos:pos + size], pos + size
+        else:
+            raise ValueError("unexpected wire type %d" % wire)
+        yield key >> 3, value
+
+data = open(sys.argv[1], 'rb').read()
+pos = 0
+while pos < len(data):
+    size, pos = varint(data, pos)
+    family = list(fields(data[pos:pos + size]))
+    pos += size
+    if (1, sys.argv[2].encode()) not in family:
+        continue
+    metrics = [m for f, m in family if f == 4]
+    ok = (3, 3) in family and metrics and all(any(f == 5 for f, _ in fields(m)) for m in metrics)
+    sys.exit(0 if ok else 1)
+sys.exit(1)
+PYEOF
+then
+    success "uwsgi_test_alias is UNTYPED with Metric.untyped values"
+else
+    fail "uwsgi_test_alias is not encoded as an untyped family (see /tmp/metrics_server.pb)"
+fi
+
+run_test "Standalone exporter serves --metrics-dir"
+if [ -x plugins/metrics_prometheus/uwsgi_prometheus_exporter ]; then
+    plugins/metrics_prometheus/uwsgi_prometheus_exporter --metrics-dir /tmp/uwsgi_prometheus_test_metrics \
+        --server 127.0.0.1:9092 --label app=uwsgi-test > /tmp/uwsgi_exporter.log 2>&1 &
+    EXPORTER_PID=$!
+    sleep 0.5
+    # a metric created after startup is picked up through inotify
+    printf '7\n' > /tmp/uwsgi_prometheus_test_metrics/exporter.test
+    sleep 0.2
+    curl --max-time 5 -s "http://127.0.0.1:9092" > /tmp/metrics_exporter.txt
+    kill $EXPORTER_PID 2>/dev/null || true
+    if grep -q '^uwsgi_workerrequests{worker="1",app="uwsgi-test"} ' /tmp/metrics_exporter.txt &&
+       grep -q '^uwsgi_exporter_test{app="uwsgi-test"} 7$' /tmp/metrics_exporter.txt; then
+        success "Exporter serves the worker metrics and picks up new files"
+    else
+        fail "Exporter output is missing metrics (see /tmp/metrics_exporter.txt)"
+    fi
+
+    run_test "Emperor mode labels every vassal"
+    rm -rf /tmp/uwsgi_prometheus_test_emperor
+    mkdir -p /tmp/uwsgi_prometheus_test_emperor
+    ln -s /tmp/uwsgi_prometheus_test_metrics /tmp/uwsgi_prometheus_test_emperor/app1
+    plugins/metrics_prometheus/uwsgi_prometheus_exporter --emperor-dir /tmp/uwsgi_prometheus_test_emperor \
+        --server 127.0.0.1:9093 --threads 2 > /tmp/uwsgi_exporter_emperor.log 2>&1 &
+    EXPORTER_PID=$!
+    sleep 0.5
+    # a vassal started after the exporter is discovered through inotify
+    mkdir /tmp/uwsgi_prometheus_test_emperor/app2
+    printf '5\n' > /tmp/uwsgi_prometheus_test_emperor/app2/worker.1.requests
+    sleep 0.2
+    curl --max-time 5 -s "http://127.0.0.1:9093" > /tmp/metrics_exporter_emperor.txt
+    kill $EXPORTER_PID 2>/dev/null || true
+    if grep -q '^uwsgi_workerrequests{worker="1",vassal="app1"} ' /tmp/metrics_exporter_emperor.txt &&
+       grep -q '^uwsgi_workerrequests{worker="1",vassal="app2"} 5$' /tmp/metrics_exporter_emperor.txt &&
+       [ "$(grep -c '^# TYPE uwsgi_workerrequests ' /tmp/metrics_exporter_emperor.txt)" -eq 1 ]; then
+        success "Both vassals are exported under a single family"
+    else
+        fail "Emperor output is missing vassals (see /tmp/metrics_exporter_emperor.txt)"
+    fi
+else
+    info "Exporter not built (make -C plugins/metrics_prometheus exporter) - skipping"
+fi
+
+run_test "Counters survive a graceful reload"
+requests_before=$(curl --max-time 5 -s "http://127.0.0.1:9091" | grep '^uwsgi_requests_total{' | awk '{ total += $2 } END { print total + 0 }')
+kill -HUP $UWSGI_PID
+sleep 3
+requests_after=$(curl --max-time 10 -s "http://127.0.0.1:9091" | grep '^uwsgi_requests_total{' | awk '{ total += $2 } END { print total + 0 }')
+if [ "$requests_before" -gt 0 ] && [ "$requests_after" -ge "$requests_before" ]; then
+    success "requests_total went from $requests_before to $requests_after across the reload"
+else
+    fail "requests_total went from $requests_before to $requests_after across the reload"
+fi
+
 info "Stopping uWSGI (dedicated server test)..."
 kill $UWSGI_PID 2>/dev/null || true
 sleep 0.5
@@ -3,6 +3,6 @@ NAME = 'metrics_prometheus'
 # Add debug flags: -g for debug symbols, -O0 to disable optimization
 CFLAGS = ['-O2']
 LDFLAGS = []
-LIBS = []
+LIBS = ['-lm']
 
 GCC_LIST = ['plugin']